@@ -3,6 +3,7 @@
 #include "App.hpp"
 #include "base/Main.hpp"
 #include "gpu/Buffer.hpp"
+#include "base/Timer.hpp"
 #include "gpu/GLContext.hpp"
 #include "utility.hpp"
 
@@ -40,6 +41,11 @@ App::App(void)
       filename_(),
       shading_toggle_(false),
       shading_mode_changed_(false),
+      multithreaded_skinning_(true),
+      dual_quaternion_skinning_(false),
+      benchmark_skinning_(false),
+      crowd_size_(16),
+      crowd_buffer_vertices_(0),
       camera_rotation_(FW_PI),
       selected_joint_(0) {
     static_assert(is_standard_layout<Vertex>::value, "Vertex must be standard layout to use offsetof");
@@ -51,6 +57,12 @@ App::App(void)
     for (auto i = 0u; i < 100; ++i)
         joint_colors_.push_back(distinct_colors[i % 6]);
 
+    // Animation clips are stored losslessly unless lossy compression is asked for on the command line.
+    for (int i = 1; i < FW::argc; ++i) {
+        if (String(FW::argv[i]) == "--lossy-animation")
+            skel_.setAnimationOptions(AnimClip::Options::lossy());
+    }
+
     String filename = window_.showFileLoadDialog("Load model");
     if (filename.getLength()) {
         if (filename.endsWith(".bvhobj") || filename.endsWith(".bvh") || filename.endsWith(".names") || filename.endsWith(".weights"))
@@ -65,9 +77,16 @@ App::App(void)
     common_ctrl_.addToggle((S32 *) &drawmode_, MODE_SKELETON, FW_KEY_1, "Draw joints and bones (1)");
     common_ctrl_.addToggle((S32 *) &drawmode_, MODE_MESH_CPU, FW_KEY_2, "Draw mesh, SSD on CPU (2)");
     common_ctrl_.addToggle((S32 *) &drawmode_, MODE_MESH_GPU, FW_KEY_3, "EXTRA: Draw mesh, SSD on GPU (3)");
+    common_ctrl_.addToggle((S32 *) &drawmode_, MODE_CROWD, FW_KEY_4, "Draw crowd, SSD on CPU (4)");
     common_ctrl_.addSeparator();
     common_ctrl_.addToggle(&animationMode, FW_KEY_A, "Animate mesh (A)");
     common_ctrl_.addToggle(&shading_toggle_, FW_KEY_T, "Toggle shading mode (T)", &shading_mode_changed_);
+    common_ctrl_.addToggle(&multithreaded_skinning_, FW_KEY_M, "Multithreaded CPU skinning (M)");
+    common_ctrl_.addToggle(&dual_quaternion_skinning_, FW_KEY_D, "Dual quaternion skinning on CPU (D)");
+    common_ctrl_.addButton(&benchmark_skinning_, FW_KEY_B, "Benchmark LBS vs. DQS on CPU (B)");
+    common_ctrl_.beginSliderStack();
+    common_ctrl_.addSlider(&crowd_size_, 1, 64, true, FW_KEY_PLUS, FW_KEY_MINUS, "Crowd size (+/-) = %d");
+    common_ctrl_.endSliderStack();
 
     window_.setTitle("Assignment 3");
 
@@ -84,6 +103,11 @@ bool App::handleEvent(const Window::Event &ev) {
         shading_mode_changed_ = false;
     }
 
+    if (benchmark_skinning_) {
+        benchmarkSkinning();
+        benchmark_skinning_ = false;
+    }
+
     if (ev.type == Window::EventType_KeyDown) {
         if (ev.key == FW_KEY_HOME)
             camera_rotation_ -= 0.05 * FW_PI;
@@ -132,17 +156,33 @@ void App::initRendering() {
     // As a side effect, this initializes the OpenGL context and lets us call GL functions.
     auto ctx = window_.getGL();
 
-    animationStart = GetTickCount();
+    animationTimer.start();
 
     // Create vertex attribute objects and buffers for vertex data.
     glGenVertexArrays(1, &gl_.simple_vao);
     glGenVertexArrays(1, &gl_.ssd_vao);
+    glGenVertexArrays(1, &gl_.crowd_vao);
     glGenBuffers(1, &gl_.simple_vertex_buffer);
     glGenBuffers(1, &gl_.ssd_vertex_buffer);
+    glGenBuffers(1, &gl_.crowd_vertex_buffer);
 
-    // Set up vertex attribute object for doing SSD on the CPU. The data will be loaded and re-loaded later, on each frame.
+    // Set up vertex attribute object for doing SSD on the CPU. The buffer is allocated once here
+    // and its contents are overwritten with the skinned vertices on each frame.
     glBindVertexArray(gl_.simple_vao);
     glBindBuffer(GL_ARRAY_BUFFER, gl_.simple_vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * weighted_vertices_.size(), nullptr, GL_DYNAMIC_DRAW);
+    glEnableVertexAttribArray(ATTRIB_POSITION);
+    glVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid *) 0);
+    glEnableVertexAttribArray(ATTRIB_NORMAL);
+    glVertexAttribPointer(ATTRIB_NORMAL, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid *) offsetof(Vertex, normal));
+    glEnableVertexAttribArray(ATTRIB_COLOR);
+    glVertexAttribPointer(ATTRIB_COLOR, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid *) offsetof(Vertex, color));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+
+    // The crowd uses the same vertex format. Its buffer is (re)allocated when the crowd size changes.
+    glBindVertexArray(gl_.crowd_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, gl_.crowd_vertex_buffer);
     glEnableVertexAttribArray(ATTRIB_POSITION);
     glVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid *) 0);
     glEnableVertexAttribArray(ATTRIB_NORMAL);
@@ -162,13 +202,14 @@ void App::initRendering() {
     glEnableVertexAttribArray(ATTRIB_COLOR);
     glVertexAttribPointer(ATTRIB_COLOR, 3, GL_FLOAT, GL_FALSE, sizeof(WeightedVertex), (GLvoid *) offsetof(WeightedVertex, color));
     glEnableVertexAttribArray(ATTRIB_JOINTS1);
-    glVertexAttribIPointer(ATTRIB_JOINTS1, 4, GL_INT, sizeof(WeightedVertex), (GLvoid *) offsetof(WeightedVertex, joints[0]));
+    // Joint indices are 8 bit integers and weights 16 bit fixed point, which GL normalizes to [0, 1].
+    glVertexAttribIPointer(ATTRIB_JOINTS1, 4, GL_UNSIGNED_BYTE, sizeof(WeightedVertex), (GLvoid *) offsetof(WeightedVertex, joints[0]));
     glEnableVertexAttribArray(ATTRIB_JOINTS2);
-    glVertexAttribIPointer(ATTRIB_JOINTS2, 4, GL_INT, sizeof(WeightedVertex), (GLvoid *) offsetof(WeightedVertex, joints[4]));
+    glVertexAttribIPointer(ATTRIB_JOINTS2, 4, GL_UNSIGNED_BYTE, sizeof(WeightedVertex), (GLvoid *) offsetof(WeightedVertex, joints[4]));
     glEnableVertexAttribArray(ATTRIB_WEIGHTS1);
-    glVertexAttribPointer(ATTRIB_WEIGHTS1, 4, GL_FLOAT, GL_FALSE, sizeof(WeightedVertex), (GLvoid *) offsetof(WeightedVertex, weights[0]));
+    glVertexAttribPointer(ATTRIB_WEIGHTS1, 4, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(WeightedVertex), (GLvoid *) offsetof(WeightedVertex, weights[0]));
     glEnableVertexAttribArray(ATTRIB_WEIGHTS2);
-    glVertexAttribPointer(ATTRIB_WEIGHTS2, 4, GL_FLOAT, GL_FALSE, sizeof(WeightedVertex), (GLvoid *) offsetof(WeightedVertex, weights[4]));
+    glVertexAttribPointer(ATTRIB_WEIGHTS2, 4, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(WeightedVertex), (GLvoid *) offsetof(WeightedVertex, weights[4]));
 
     glBufferData(GL_ARRAY_BUFFER, sizeof(WeightedVertex) * weighted_vertices_.size(), weighted_vertices_.data(), GL_STATIC_DRAW);
 
@@ -212,8 +253,8 @@ void App::initRendering() {
             layout(location = 0) in vec4 aPosition;
             layout(location = 1) in vec3 aNormal;
             layout(location = 2) in vec4 aColor;
-            layout(location = 3) in ivec4 aJoints1;
-            layout(location = 4) in ivec4 aJoints2;
+            layout(location = 3) in uvec4 aJoints1;
+            layout(location = 4) in uvec4 aJoints2;
             layout(location = 5) in vec4 aWeights1;
             layout(location = 6) in vec4 aWeights2;
 
@@ -270,8 +311,7 @@ void App::render() {
     glEnable(GL_DEPTH_TEST);
 
     if (animationMode) {
-        int animFrame = int((GetTickCount() - animationStart) / 16.666668f);
-        skel_.setAnimationFrame(animFrame);
+        skel_.setAnimationTime(animationTimer.getElapsed());
     }
 
     // Adjust viewport and aspect ratio to window
@@ -318,10 +358,12 @@ void App::render() {
         glLoadMatrixf(&C(0, 0));
         renderSkeleton();
     } else if (drawmode_ == MODE_MESH_CPU) {
-        auto vertices = computeSSD(weighted_vertices_);
+        skinner_.setMultithreaded(multithreaded_skinning_);
+        skinner_.setMode(dual_quaternion_skinning_ ? SkinningEngine::SKINNING_DQS : SkinningEngine::SKINNING_LBS);
+        const auto &vertices = computeSSD(weighted_vertices_);
 
         glBindBuffer(GL_ARRAY_BUFFER, gl_.simple_vertex_buffer);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Vertex) * vertices.size(), vertices.data());
         glBindBuffer(GL_ARRAY_BUFFER, 0);
 
         glUseProgram(gl_.simple_shader);
@@ -332,7 +374,7 @@ void App::render() {
         glBindVertexArray(0);
         glUseProgram(0);
     } else if (drawmode_ == MODE_MESH_GPU) {
-        auto ssd_transforms = skel_.getSSDTransforms();
+        const auto &ssd_transforms = skel_.getSSDTransforms();
 
         glUseProgram(gl_.ssd_shader);
         glUniformMatrix4fv(gl_.ssd_world_to_clip_uniform, 1, GL_FALSE, world_to_clip.getPtr());
@@ -343,6 +385,29 @@ void App::render() {
         glDrawArrays(GL_TRIANGLES, 0, (int) weighted_vertices_.size());
         glBindVertexArray(0);
         glUseProgram(0);
+    } else if (drawmode_ == MODE_CROWD) {
+        // All instances are posed and skinned in one pass and drawn with one call.
+        if (crowd_.getSize() != size_t(crowd_size_))
+            crowd_.setSize(unsigned(crowd_size_));
+        skinner_.setMultithreaded(multithreaded_skinning_);
+        skinner_.setMode(dual_quaternion_skinning_ ? SkinningEngine::SKINNING_DQS : SkinningEngine::SKINNING_LBS);
+        const auto &vertices = crowd_.update(skel_, skinner_, animationTimer.getElapsed());
+
+        glBindBuffer(GL_ARRAY_BUFFER, gl_.crowd_vertex_buffer);
+        if (vertices.size() != crowd_buffer_vertices_) {
+            glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vertices.size(), nullptr, GL_DYNAMIC_DRAW);
+            crowd_buffer_vertices_ = vertices.size();
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Vertex) * vertices.size(), vertices.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        glUseProgram(gl_.simple_shader);
+        glUniformMatrix4fv(gl_.simple_world_to_clip_uniform, 1, GL_FALSE, world_to_clip.getPtr());
+        glUniform1f(gl_.simple_shading_mix_uniform, shading_toggle_ ? 1.0f : 0.0f);
+        glBindVertexArray(gl_.crowd_vao);
+        glDrawArrays(GL_TRIANGLES, 0, (int) vertices.size());
+        glBindVertexArray(0);
+        glUseProgram(0);
     }
 
     // Check for OpenGL errors.
@@ -363,7 +428,7 @@ void App::renderSkeleton() {
     glPointSize(15);
 
     // Let's fetch the transforms you generated in Skeleton::updateToWorldTransforms().
-    vector<Mat4f> transforms = skel_.getToWorldTransforms();
+    const vector<Mat4f> &transforms = skel_.getToWorldTransforms();
 
     // And loop through all the joints.
     for (auto i = 0u; i < transforms.size(); ++i) {
@@ -436,36 +501,75 @@ void App::renderSkeleton() {
     }
 }
 
-vector<Vertex> App::computeSSD(const vector<WeightedVertex> &source_vertices) {
-    vector<Mat4f> ssd_transforms = skel_.getSSDTransforms();
-    vector<Vertex> skinned_vertices;
-    skinned_vertices.reserve(source_vertices.size());
-    for (const auto &sv : source_vertices) {
-        // YOUR CODE HERE (R4 & R5)
-        // Compute the skinned position for each vertex and push it to skinned_vertices.
-        // This starter code just copies the source vertex untouched, so the result is not animated.
-        // Replace these lines with the loop that applies the bone transforms and weights.
-        // For R5, transform the normals as well.
-        Vertex v;
-        auto joints = sv.joints;
-        auto weights = sv.weights;
-        for (int i = 0; i < WEIGHTS_PER_VERTEX; i++) {
-            auto joint_index = joints[i];
-            v.position += (weights[i] * ssd_transforms[joint_index] * Vec4f(sv.position, 1)).getXYZ();
-            v.color += weights[i] * ssd_transforms[joint_index] * sv.color;
-            v.normal += (weights[i] * (ssd_transforms[joint_index]).transposed().inverted() * Vec4f(sv.normal, 0)).getXYZ();
+const vector<Vertex> &App::computeSSD(const vector<WeightedVertex> &source_vertices) {
+    // YOUR CODE HERE (R4 & R5)
+    // The skinning itself lives in SkinningEngine, which keeps a SIMD friendly copy
+    // of the weighted vertices with the zero weights stripped out, and skins into
+    // one of its two persistent output arrays.
+    assert(source_vertices.size() == skinner_.getNumVertices() && "skinner out of sync with the mesh");
+    (void) source_vertices; // silence warning on release build
+    return skinner_.skin(skel_.getSSDTransforms());
+}
+
+void App::benchmarkSkinning() {
+    // Skins the current pose of the loaded character repeatedly with both methods,
+    // single and multithreaded, and reports the throughput along with the model it was measured on.
+    // Then checks that both methods place the instances of the crowd alike.
+    if (!skinner_.getNumVertices()) {
+        common_ctrl_.message("Load a mesh to benchmark skinning");
+        return;
+    }
+
+    static const int iterations = 100;
+    const auto &ssd_transforms = skel_.getSSDTransforms();
+    vector<Vertex> result(skinner_.getNumVertices());
+
+    ostringstream report;
+    report << "Skinning " << filename_.getPtr() << ", " << skinner_.getNumVertices() << " vertices, " << skel_.getNumJoints() << " joints:";
+    for (int threaded = 0; threaded < 2; ++threaded) {
+        skinner_.setMultithreaded(threaded != 0);
+        for (int dqs = 0; dqs < 2; ++dqs) {
+            // Warm up the caches and the worker threads.
+            if (dqs)
+                skinner_.skinDQS(ssd_transforms, result.data());
+            else
+                skinner_.skinLBS(ssd_transforms, result.data());
+
+            Timer timer(true);
+            for (int i = 0; i < iterations; ++i) {
+                if (dqs)
+                    skinner_.skinDQS(ssd_transforms, result.data());
+                else
+                    skinner_.skinLBS(ssd_transforms, result.data());
+            }
+            const float seconds = timer.getElapsed();
+            const float mverts = float(skinner_.getNumVertices()) * iterations / seconds * 1e-6f;
+            report << "\n    " << (dqs ? "DQS" : "LBS") << (threaded ? ", multithreaded:  " : ", single thread: ")
+                   << 1e3f * seconds / iterations << " ms/frame, " << mverts << " Mverts/s";
         }
-        v.normal = normalize(v.normal);
-        skinned_vertices.push_back(v);
     }
-    return skinned_vertices;
+    skinner_.setMultithreaded(multithreaded_skinning_);
+
+    // The crowd places its instances after skinning, so both methods must put every instance in
+    // the same place. They differ only around bent joints, by well under the limit, while an
+    // instance that one of them misplaced or scaled differs by about its whole size. The last
+    // instance is the one furthest from the origin.
+    static const float crowd_tolerance = 1e-2f;
+    if (crowd_.getSize() != size_t(crowd_size_))
+        crowd_.setSize(unsigned(crowd_size_));
+    crowd_.update(skel_, skinner_, animationTimer.getElapsed());
+    const float difference = crowd_.compareSkinningModes(skinner_, crowd_.getSize() - 1);
+    report << "\n    Crowd of " << crowd_.getSize() << ": LBS and DQS bounds differ by " << 100.0f * difference << "% of the instance size"
+           << (difference <= crowd_tolerance ? "" : ", FAILED: more than 1%");
+
+    cout << report.str() << endl;
+    common_ctrl_.message(report.str().c_str(), "benchmark");
 }
 
 vector<WeightedVertex> App::loadAnimatedMesh(string namefile, string mesh_file, string attachment_file) {
     vector<WeightedVertex> vertices;
-    vector<array<int, WEIGHTS_PER_VERTEX>> indices;
-    vector<array<float, WEIGHTS_PER_VERTEX>> weights;
-    vector<Vec3f> colors;
+    // Influences and color of each mesh vertex, packed once and copied to every face corner.
+    vector<WeightedVertex> influences;
 
     // Load name to index conversion map
     vector<string> names;
@@ -499,12 +603,12 @@ vector<WeightedVertex> App::loadAnimatedMesh(string namefile, string mesh_file,
             }
         }
         assert(n_weights <= WEIGHTS_PER_VERTEX);
-        weights.push_back(temp_w);
-        indices.push_back(temp_i);
-        auto color = Vec3f();
+        WeightedVertex v;
+        setInfluences(v, temp_i.data(), temp_w.data());
+        v.color = Vec3f();
         for (auto i = 0u; i < WEIGHTS_PER_VERTEX; ++i)
-            color += joint_colors_[temp_i[i]] * temp_w[i];
-        colors.push_back(color);
+            v.color += joint_colors_[temp_i[i]] * temp_w[i];
+        influences.push_back(v);
     }
 
     // Load vertices
@@ -528,13 +632,11 @@ vector<WeightedVertex> App::loadAnimatedMesh(string namefile, string mesh_file,
                 f[i] = stoi(word) - 1;
             }
 
-            WeightedVertex v;
-            v.normal = cross(positions[f[1]] - positions[f[0]], positions[f[2]] - positions[f[0]]).normalized();
+            auto normal = cross(positions[f[1]] - positions[f[0]], positions[f[2]] - positions[f[0]]).normalized();
             for (auto i : f) {
+                WeightedVertex v = influences[i];
                 v.position = positions[i];
-                v.color = colors[i];
-                memcpy(v.joints, indices[i].data(), sizeof(v.joints));
-                memcpy(v.weights, weights[i].data(), sizeof(v.weights));
+                v.normal = normal;
                 vertices.push_back(v);
             }
 
@@ -545,12 +647,11 @@ vector<WeightedVertex> App::loadAnimatedMesh(string namefile, string mesh_file,
                 word = word.substr(0, word.find_first_of('/'));
                 f[2] = stoi(word) - 1;
 
-                v.normal = cross(positions[f[1]] - positions[f[0]], positions[f[2]] - positions[f[0]]).normalized();
+                normal = cross(positions[f[1]] - positions[f[0]], positions[f[2]] - positions[f[0]]).normalized();
                 for (auto i : f) {
+                    WeightedVertex v = influences[i];
                     v.position = positions[i];
-                    v.color = colors[i];
-                    memcpy(v.joints, indices[i].data(), sizeof(v.joints));
-                    memcpy(v.weights, weights[i].data(), sizeof(v.weights));
+                    v.normal = normal;
                     vertices.push_back(v);
                 }
             }
@@ -566,11 +667,11 @@ vector<WeightedVertex> App::loadAnimatedMesh(string namefile, string mesh_file,
 
     int idx = 0;
     for (const auto &v : vertices) {
-        float sum_weights = accumulate(begin(v.weights), end(v.weights), 0.0f);
+        auto sum_weights = accumulate(begin(v.weights), end(v.weights), 0u);
         (void) sum_weights; // silence warning on release build
-        assert(0.99 < sum_weights && sum_weights < 1.01 && "weights do not sum up to 1");
-        for (auto i = 0u; i < WEIGHTS_PER_VERTEX; ++i) {
-            assert(0 <= v.joints[i] && "invalid index");
+        assert(sum_weights == SKIN_WEIGHT_ONE && "weights do not sum up to 1");
+        for (auto i = 0u; i < v.num_influences; ++i) {
+            assert(v.joints[i] < skel_.getNumJoints() && "invalid index");
         }
         idx++;
     }
@@ -579,9 +680,8 @@ vector<WeightedVertex> App::loadAnimatedMesh(string namefile, string mesh_file,
 
 vector<WeightedVertex> App::loadWeightedMesh(string mesh_file, string attachment_file) {
     vector<WeightedVertex> vertices;
-    vector<array<int, WEIGHTS_PER_VERTEX>> indices;
-    vector<array<float, WEIGHTS_PER_VERTEX>> weights;
-    vector<Vec3f> colors;
+    // Influences and color of each mesh vertex, packed once and copied to every face corner.
+    vector<WeightedVertex> influences;
     ifstream attachment_input(attachment_file, ios::in);
     string line;
     while (getline(attachment_input, line)) {
@@ -599,12 +699,12 @@ vector<WeightedVertex> App::loadWeightedMesh(string mesh_file, string attachment
             }
         }
         assert(n_weights <= WEIGHTS_PER_VERTEX);
-        weights.push_back(temp_w);
-        indices.push_back(temp_i);
-        auto color = Vec3f();
+        WeightedVertex v;
+        setInfluences(v, temp_i.data(), temp_w.data());
+        v.color = Vec3f();
         for (auto i = 0u; i < WEIGHTS_PER_VERTEX; ++i)
-            color += joint_colors_[temp_i[i]] * temp_w[i];
-        colors.push_back(color);
+            v.color += joint_colors_[temp_i[i]] * temp_w[i];
+        influences.push_back(v);
     }
 
     vector<Vec3f> positions;
@@ -621,30 +721,29 @@ vector<WeightedVertex> App::loadWeightedMesh(string mesh_file, string attachment
             array<int, 3> f;
             ss >> f[0] >> f[1] >> f[2];
             for (auto &i : f) --i;
-            WeightedVertex v;
-            v.normal = cross(positions[f[1]] - positions[f[0]], positions[f[2]] - positions[f[0]]).normalized();
+            auto normal = cross(positions[f[1]] - positions[f[0]], positions[f[2]] - positions[f[0]]).normalized();
             for (auto i : f) {
+                WeightedVertex v = influences[i];
                 v.position = positions[i];
-                v.color = colors[i];
-                memcpy(v.joints, indices[i].data(), sizeof(v.joints));
-                memcpy(v.weights, weights[i].data(), sizeof(v.weights));
+                v.normal = normal;
                 vertices.push_back(v);
             }
         }
     }
 
     for (const auto &v : vertices) {
-        float sum_weights = accumulate(begin(v.weights), end(v.weights), 0.0f);
+        auto sum_weights = accumulate(begin(v.weights), end(v.weights), 0u);
         (void) sum_weights; // silence warning on release build
-        assert(0.99 < sum_weights && sum_weights < 1.01 && "weights do not sum up to 1");
-        for (auto i = 0u; i < WEIGHTS_PER_VERTEX; ++i) {
-            assert(0 <= v.joints[i] && "invalid index");
+        assert(sum_weights == SKIN_WEIGHT_ONE && "weights do not sum up to 1");
+        for (auto i = 0u; i < v.num_influences; ++i) {
+            assert(v.joints[i] < skel_.getNumJoints() && "invalid index");
         }
     }
     return vertices;
 }
 
 void App::loadAnimation(const String &filename) {
+    filename_ = filename;
     int end = filename.lastIndexOf('.');
     String prefix = (end > 0) ? filename.substring(0, end) : filename;
     string p(prefix.getPtr());
@@ -658,10 +757,14 @@ void App::loadAnimation(const String &filename) {
     cout << "weight:     " << weight_file << endl;
 
     scale_ = skel_.loadBVH(skel_file);
+    const auto &clip = skel_.getAnimation();
+    cout << "animation:  " << clip.getNumKeys() << " keys of " << clip.getNumFrames() << " frames, " << clip.getMemoryUsage() << " bytes" << endl;
     weighted_vertices_ = loadAnimatedMesh(name_file, mesh_file, weight_file);
+    skinner_.setSource(weighted_vertices_);
 }
 
 void App::loadModel(const String &filename) {
+    filename_ = filename;
     int end = filename.lastIndexOf('.');
     String prefix = (end > 0) ? filename.substring(0, end) : filename;
     string p(prefix.getPtr());
@@ -676,6 +779,7 @@ void App::loadModel(const String &filename) {
     scale_ = 1;
     skel_.load(skel_file);
     weighted_vertices_ = loadWeightedMesh(mesh_file, weight_file);
+    skinner_.setSource(weighted_vertices_);
 }
 
 void FW::init(void) {
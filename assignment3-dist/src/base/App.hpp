@@ -1,40 +1,27 @@
 #pragma once
 
+#include "crowd.hpp"
 #include "skeleton.hpp"
+#include "skinning.hpp"
 
 #include "gui/Window.hpp"
 #include "gui/CommonControls.hpp"
+#include "base/Timer.hpp"
 
 #include <vector>
 
 namespace FW {
 
-struct Vertex
-{
-	Vec3f position;
-	Vec3f normal;
-	Vec3f color;
-};
-
-struct WeightedVertex
-{
-	Vec3f	position;
-	Vec3f	normal;
-	Vec3f	color;
-	int		joints[WEIGHTS_PER_VERTEX];
-	float	weights[WEIGHTS_PER_VERTEX];
-};
-
 struct glGeneratedIndices
 {
 	// Shader programs
 	GLuint simple_shader, ssd_shader;
 
 	// Vertex array objects
-	GLuint simple_vao, ssd_vao;
+	GLuint simple_vao, ssd_vao, crowd_vao;
 
 	// Buffers
-	GLuint simple_vertex_buffer, ssd_vertex_buffer;
+	GLuint simple_vertex_buffer, ssd_vertex_buffer, crowd_vertex_buffer;
 
 	// simple_shader uniforms
 	GLint simple_world_to_clip_uniform, simple_shading_mix_uniform;
@@ -50,7 +37,8 @@ private:
 	{
 		MODE_SKELETON,
 		MODE_MESH_CPU,
-		MODE_MESH_GPU
+		MODE_MESH_GPU,
+		MODE_CROWD
 	};
 
 public:
@@ -71,7 +59,8 @@ private:
 	std::vector<WeightedVertex>	loadAnimatedMesh		(std::string namefile, std::string mesh_file, std::string attachment_file);
 	std::vector<WeightedVertex>	loadWeightedMesh		(std::string mesh_file, std::string attachment_file);
 
-	std::vector<Vertex>			computeSSD				(const std::vector<WeightedVertex>& source);
+	const std::vector<Vertex>&	computeSSD				(const std::vector<WeightedVertex>& source);
+	void			benchmarkSkinning	(void);
 private:
 					App             (const App&); // forbid copy
 	App&            operator=       (const App&); // forbid assignment
@@ -84,11 +73,19 @@ private:
 	String			filename_;
 	bool			shading_toggle_;
 	bool			shading_mode_changed_;
+	bool			multithreaded_skinning_;
+	bool			dual_quaternion_skinning_;
+	bool			benchmark_skinning_;
 	std::vector<Vec3f> joint_colors_;
 
 	glGeneratedIndices	gl_;
 
 	std::vector<WeightedVertex> weighted_vertices_;
+	SkinningEngine	skinner_;
+
+	Crowd			crowd_;
+	S32				crowd_size_;
+	size_t			crowd_buffer_vertices_;
 	
 	float			camera_rotation_;
 	float			scale_ = 1.f;
@@ -98,7 +95,7 @@ private:
 	unsigned		selected_joint_;
 
 	bool			animationMode = false;
-	DWORD			animationStart;
+	Timer			animationTimer;
 };
 
 } // namespace FW
@@ -0,0 +1,174 @@
+#include "animclip.hpp"
+#include "quaternion.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using namespace std;
+using namespace FW;
+
+void AnimClip::clear() {
+    num_channels_ = 0;
+    frame_time_ = ANIM_DEFAULT_FRAME_TIME;
+    positions_.clear();
+    keys_.clear();
+    rotations_.clear();
+    quantized_rotations_.clear();
+}
+
+void AnimClip::build(const Vec3f *raw, size_t num_frames, unsigned num_channels, float frame_time, const Options &options) {
+    clear();
+    const size_t stride = 1 + num_channels;
+    num_channels_ = num_channels;
+    if (frame_time > 0.0f)
+        frame_time_ = frame_time;
+
+    positions_.resize(num_frames);
+    for (size_t f = 0; f < num_frames; ++f)
+        positions_[f] = raw[f * stride];
+
+    // Convert all angles to quaternions, keeping each channel in the hemisphere of its
+    // previous frame so that neighbouring keys interpolate along the shorter arc.
+    vector<Vec4f> rotations(num_frames * num_channels);
+    for (size_t f = 0; f < num_frames; ++f) {
+        for (unsigned c = 0; c < num_channels; ++c) {
+            Vec4f q = quatFromEulerXYZ(raw[f * stride + 1 + c] * FW_PI / 180.0f);
+            if (f > 0 && dot(q, rotations[(f - 1) * num_channels + c]) < 0.0f)
+                q = -q;
+            rotations[f * num_channels + c] = q;
+        }
+    }
+
+    reduceKeys(rotations, options.max_key_error);
+    storeKeys(rotations, options.quantize);
+
+    positions_.shrink_to_fit();
+    keys_.shrink_to_fit();
+}
+
+void AnimClip::reduceKeys(const vector<Vec4f> &rotations, float max_error) {
+    const size_t num_frames = positions_.size();
+    if (!num_frames)
+        return;
+
+    // Every frame is a key.
+    if (max_error < 0.0f || num_frames < 3) {
+        keys_.resize(num_frames);
+        for (size_t f = 0; f < num_frames; ++f)
+            keys_[f] = unsigned(f);
+        return;
+    }
+
+    // Greedily extend the span starting at the last key for as long as interpolation
+    // between its ends reproduces all frames in between.
+    const float max_angle = max_error * FW_PI / 180.0f;
+    auto fits = [&](size_t first, size_t last) {
+        const Vec4f *a = &rotations[first * num_channels_];
+        const Vec4f *b = &rotations[last * num_channels_];
+        for (size_t f = first + 1; f < last; ++f) {
+            const float t = float(f - first) / float(last - first);
+            const Vec4f *v = &rotations[f * num_channels_];
+            for (unsigned c = 0; c < num_channels_; ++c) {
+                if (quatAngle(quatSlerp(a[c], b[c], t), v[c]) > max_angle)
+                    return false;
+            }
+        }
+        return true;
+    };
+
+    keys_.push_back(0);
+    size_t key = 0;
+    while (key + 1 < num_frames) {
+        size_t end = key + 1;
+        while (end + 1 < num_frames && end + 1 - key <= ANIM_MAX_KEY_GAP && fits(key, end + 1))
+            ++end;
+        keys_.push_back(unsigned(end));
+        key = end;
+    }
+}
+
+void AnimClip::storeKeys(const vector<Vec4f> &rotations, bool quantize) {
+    if (!quantize) {
+        rotations_.resize(keys_.size() * num_channels_);
+        for (size_t k = 0; k < keys_.size(); ++k)
+            copy_n(&rotations[keys_[k] * num_channels_], num_channels_, &rotations_[k * num_channels_]);
+        return;
+    }
+
+    // Unit quaternion components are within [-1, 1], so a fixed range suffices.
+    quantized_rotations_.resize(keys_.size() * num_channels_ * 4);
+    S16 *q = quantized_rotations_.data();
+    for (auto f : keys_) {
+        for (unsigned c = 0; c < num_channels_; ++c) {
+            const Vec4f &v = rotations[f * num_channels_ + c];
+            for (int i = 0; i < 4; ++i)
+                *q++ = S16(FW::clamp(int(FW::floor(v[i] * 32767.0f + 0.5f)), -32767, 32767));
+        }
+    }
+}
+
+size_t AnimClip::getMemoryUsage() const {
+    return positions_.size() * sizeof(Vec3f) + keys_.size() * sizeof(unsigned) +
+           rotations_.size() * sizeof(Vec4f) + quantized_rotations_.size() * sizeof(S16);
+}
+
+void AnimClip::scalePositions(float scale) {
+    for (auto &p : positions_)
+        p *= scale;
+}
+
+void AnimClip::getKey(size_t key, Vec4f *rotations) const {
+    if (quantized_rotations_.empty()) {
+        copy_n(&rotations_[key * num_channels_], num_channels_, rotations);
+        return;
+    }
+    const S16 *q = &quantized_rotations_[key * num_channels_ * 4];
+    for (unsigned c = 0; c < num_channels_; ++c, q += 4)
+        rotations[c] = Vec4f(float(q[0]), float(q[1]), float(q[2]), float(q[3])).normalized();
+}
+
+void AnimClip::sample(float time, Vec3f &position, Vec4f *rotations) const {
+    const size_t num_frames = positions_.size();
+    assert(num_frames && "cannot sample an empty clip");
+
+    // Position in frames, wrapped into [0, num_frames).
+    float u = fmod(time / frame_time_, float(num_frames));
+    if (u < 0.0f)
+        u += float(num_frames);
+    const size_t f0 = std::min(size_t(u), num_frames - 1);
+    const size_t f1 = f0 + 1 < num_frames ? f0 + 1 : 0;
+    const float frac = u - float(f0);
+    position = lerp(positions_[f0], positions_[f1], frac);
+
+    // Keys around the current time. Past the last frame the clip blends back into the first key.
+    size_t k0, k1;
+    float t;
+    if (f0 + 1 >= num_frames) {
+        k0 = keys_.size() - 1;
+        k1 = 0;
+        t = frac;
+    } else {
+        // Without reduction the key index equals the frame index.
+        k0 = keys_.size() == num_frames ? f0 : size_t(upper_bound(keys_.begin(), keys_.end(), unsigned(f0)) - keys_.begin()) - 1;
+        k1 = k0 + 1;
+        t = (u - float(keys_[k0])) / float(keys_[k1] - keys_[k0]);
+    }
+
+    // Decode the first key into the output and blend the second one in channel by channel.
+    getKey(k0, rotations);
+    if (quantized_rotations_.empty()) {
+        const Vec4f *b = &rotations_[k1 * num_channels_];
+        for (unsigned c = 0; c < num_channels_; ++c)
+            rotations[c] = quatSlerp(rotations[c], b[c], t);
+    } else {
+        const S16 *q = &quantized_rotations_[k1 * num_channels_ * 4];
+        for (unsigned c = 0; c < num_channels_; ++c, q += 4)
+            rotations[c] = quatSlerp(rotations[c], Vec4f(float(q[0]), float(q[1]), float(q[2]), float(q[3])).normalized(), t);
+    }
+}
+
+void AnimClip::sampleBatch(const float *times, size_t count, Vec3f *positions, Vec4f *rotations) const {
+    for (size_t i = 0; i < count; ++i)
+        sample(times[i], positions[i], rotations + i * num_channels_);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <base/Math.hpp>
+
+#include <vector>
+
+// Frames further apart than this are never merged by keyframe reduction,
+// which bounds the cost of the reduction pass.
+static const unsigned ANIM_MAX_KEY_GAP = 32u;
+// Used when the file does not give a frame time.
+static const float ANIM_DEFAULT_FRAME_TIME = 1.0f / 60.0f;
+
+// Storage for a motion capture clip: a root position per frame and one rotation per
+// animated joint ("channel") per keyframe.
+// Only the channels that actually exist are stored. The Euler angles of the file are
+// converted to unit quaternions once when the clip is built, so that evaluating a pose
+// needs no trigonometry. By default every frame is kept at full precision. Optionally, and
+// lossily, the quaternions are quantized to 16 bits per component, and frames that are
+// predicted by interpolation between their neighbours to within a given error are
+// dropped. The remaining keyframes are stored frame by
+// frame, so evaluating a pose touches two contiguous blocks of memory.
+class AnimClip
+{
+public:
+	// Compression settings used by build(). The defaults are lossless.
+	struct Options
+	{
+		bool	quantize = false;			// store rotations as 16 bit integers
+		float	max_key_error = -1.0f;		// tolerance of keyframe reduction in degrees, negative disables it
+
+		// Quantized rotations, and keys dropped where they are predicted to within 0.05 degrees.
+		static Options	lossy() { Options o; o.quantize = true; o.max_key_error = 0.05f; return o; }
+	};
+
+	void					clear();
+
+	// Builds the clip from num_frames * (1 + num_channels) Vec3f values: per frame,
+	// the root position followed by the Euler angles of each channel in degrees.
+	void					build(const FW::Vec3f* raw, size_t num_frames, unsigned num_channels, float frame_time, const Options& options);
+
+	size_t					getNumFrames() const { return positions_.size(); }
+	unsigned				getNumChannels() const { return num_channels_; }
+	// Seconds between consecutive frames.
+	float					getFrameTime() const { return frame_time_; }
+	// Length of one loop; the last frame blends back into the first.
+	float					getDuration() const { return frame_time_ * float(positions_.size()); }
+	size_t					getNumKeys() const { return keys_.size(); }
+	// Bytes used by the clip data.
+	size_t					getMemoryUsage() const;
+
+	void					scalePositions(float scale);
+
+	// Evaluates the clip at the given time in seconds, looping over its duration.
+	// The root position is interpolated linearly and the rotations (getNumChannels()
+	// quaternions) with slerp between the surrounding keys.
+	void					sample(float time, FW::Vec3f& position, FW::Vec4f* rotations) const;
+	// Evaluates count poses, e.g. for a crowd of characters playing the same clip.
+	// Pose i is written to positions[i] and rotations[i * getNumChannels() ...].
+	void					sampleBatch(const float* times, size_t count, FW::Vec3f* positions, FW::Vec4f* rotations) const;
+
+private:
+	void					reduceKeys(const std::vector<FW::Vec4f>& rotations, float max_error);
+	void					storeKeys(const std::vector<FW::Vec4f>& rotations, bool quantize);
+	void					getKey(size_t key, FW::Vec4f* rotations) const;
+
+	unsigned				num_channels_ = 0;
+	float					frame_time_ = ANIM_DEFAULT_FRAME_TIME;
+
+	// Root position of every frame.
+	std::vector<FW::Vec3f>	positions_;
+	// Frame index of each stored keyframe, in increasing order. The first and last frames are always keys.
+	std::vector<unsigned>	keys_;
+
+	// Rotations of the keyframes, key-major: either as floats...
+	std::vector<FW::Vec4f>	rotations_;
+	// ... or quantized, each component decoded as q / 32767.
+	std::vector<FW::S16>	quantized_rotations_;
+};
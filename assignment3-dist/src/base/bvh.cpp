@@ -0,0 +1,383 @@
+#include "bvh.hpp"
+
+#include "base/DLLImports.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <fstream>
+
+using namespace std;
+using namespace FW;
+
+namespace {
+
+    const char CACHE_MAGIC[8] = {'B', 'V', 'H', 'C', 'A', 'C', 'H', 'E'};
+    const U32 CACHE_VERSION = 1;
+
+    // Layout of a cache file: the header, num_joints CacheJoint records, the joint
+    // names as consecutive zero-terminated strings at names_offset, and the frame
+    // data at frames_offset.
+    struct CacheHeader
+    {
+        char magic[8];
+        U32 version;
+        U32 num_joints;
+        U32 num_channels;
+        F32 frame_time;
+        U64 num_frames;
+        U64 source_size;
+        U64 source_time;
+        U64 names_offset;
+        U64 frames_offset;
+    };
+
+    struct CacheJoint
+    {
+        S32 parent;
+        F32 offset[3];
+    };
+
+    bool getFileInfo(const string &filename, U64 &size, U64 &time) {
+        WIN32_FILE_ATTRIBUTE_DATA attributes;
+        if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &attributes))
+            return false;
+        size = (U64(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+        time = (U64(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+        return true;
+    }
+
+    // Position in the text being parsed.
+    struct Cursor
+    {
+        const char *p;
+        const char *end;
+    };
+
+    inline bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    inline void skipSpace(Cursor &c) {
+        while (c.p < c.end && isSpace(*c.p))
+            ++c.p;
+    }
+
+    inline bool isDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    // Next whitespace separated word. Only used for the hierarchy, which is short.
+    string nextToken(Cursor &c) {
+        skipSpace(c);
+        const char *begin = c.p;
+        while (c.p < c.end && !isSpace(*c.p))
+            ++c.p;
+        return string(begin, c.p);
+    }
+
+    void skipLine(Cursor &c) {
+        while (c.p < c.end && *c.p != '\n')
+            ++c.p;
+    }
+
+    // Decimal number with optional sign, fraction, and exponent.
+    float parseFloat(Cursor &c) {
+        static const double powers_of_ten[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+        skipSpace(c);
+        bool negative = false;
+        if (c.p < c.end && (*c.p == '-' || *c.p == '+'))
+            negative = *c.p++ == '-';
+
+        // Collect up to 19 significant digits; any further digits only affect the exponent.
+        U64 mantissa = 0;
+        int digits = 0, exponent = 0;
+        const char *start = c.p;
+        for (; c.p < c.end && isDigit(*c.p); ++c.p) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + U64(*c.p - '0');
+                digits += mantissa != 0;
+            } else {
+                ++exponent;
+            }
+        }
+        if (c.p < c.end && *c.p == '.') {
+            for (++c.p; c.p < c.end && isDigit(*c.p); ++c.p) {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + U64(*c.p - '0');
+                    digits += mantissa != 0;
+                    --exponent;
+                }
+            }
+        }
+        assert(c.p > start && "expected a number");
+        if (c.p < c.end && (*c.p == 'e' || *c.p == 'E')) {
+            ++c.p;
+            bool negative_exponent = false;
+            if (c.p < c.end && (*c.p == '-' || *c.p == '+'))
+                negative_exponent = *c.p++ == '-';
+            int e = 0;
+            for (; c.p < c.end && isDigit(*c.p); ++c.p)
+                e = FW::min(e * 10 + (*c.p - '0'), 1000);
+            exponent += negative_exponent ? -e : e;
+        }
+
+        double value = double(mantissa);
+        for (; exponent > 22; exponent -= 22)
+            value *= powers_of_ten[22];
+        for (; exponent < -22; exponent += 22)
+            value /= powers_of_ten[22];
+        value = exponent < 0 ? value / powers_of_ten[-exponent] : value * powers_of_ten[exponent];
+        return float(negative ? -value : value);
+    }
+
+    int parseInt(Cursor &c) {
+        return int(parseFloat(c));
+    }
+
+    // Reads the block of a ROOT or JOINT whose name has just been read.
+    void parseJoint(Cursor &c, int parent, const string &name, vector<BVHJoint> &joints, vector<Vec3i> &axisPermutation) {
+        string s = nextToken(c);
+        assert(s == "{" && "joint name must be followed by a block");
+
+        const int index = int(joints.size());
+        BVHJoint joint;
+        joint.name = name;
+        joint.parent = parent;
+        joints.push_back(joint);
+
+        while (c.p < c.end) {
+            s = nextToken(c);
+            if (s == "OFFSET") {
+                Vec3f offset;
+                offset.x = parseFloat(c);
+                offset.y = parseFloat(c);
+                offset.z = parseFloat(c);
+                joints[index].offset = offset;
+            } else if (s == "CHANNELS") {
+                const int channelCount = parseInt(c);
+                assert((channelCount == 3 || (channelCount == 6 && parent == -1)) && "only the root may have position channels");
+                // The root position channels come first.
+                for (int i = 3; i < channelCount; ++i)
+                    nextToken(c);
+
+                Vec3i permutation;
+                for (int i = 0; i < 3; ++i) {
+                    s = nextToken(c);
+                    if (s == "Xrotation")
+                        permutation[0] = i;
+                    else if (s == "Yrotation")
+                        permutation[1] = i;
+                    else if (s == "Zrotation")
+                        permutation[2] = i;
+                }
+                axisPermutation.push_back(permutation);
+            } else if (s == "JOINT") {
+                parseJoint(c, index, nextToken(c), joints, axisPermutation);
+            } else if (s == "End") {
+                // Skip the End Site block; it has no channels.
+                while (c.p < c.end && nextToken(c) != "}")
+                    ;
+            } else if (s == "}") {
+                return;
+            }
+        }
+    }
+
+} // namespace
+
+bool MappedFile::open(const string &filename) {
+    close();
+
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+
+    // The view keeps the file and the mapping object alive, so both handles can be closed right away.
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return false;
+    data_ = (const char *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data_)
+        return false;
+
+    size_ = size_t(size.QuadPart);
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_)
+        UnmapViewOfFile(data_);
+    data_ = nullptr;
+    size_ = 0;
+}
+
+bool BVHFile::load(const string &filename, bool use_cache) {
+    joints_.clear();
+    num_channels_ = 0;
+    num_frames_ = 0;
+    frame_time_ = 0.0f;
+    frames_ = nullptr;
+    frame_storage_.clear();
+    cache_.close();
+
+    U64 source_size, source_time;
+    if (!getFileInfo(filename, source_size, source_time))
+        return false;
+
+    const string cache_file = filename + ".cache";
+    if (use_cache && readCache(cache_file, source_size, source_time))
+        return true;
+
+    MappedFile source;
+    if (!source.open(filename))
+        return false;
+    parse(source.getData(), source.getData() + source.getSize());
+
+    if (use_cache)
+        writeCache(cache_file, source_size, source_time);
+    return true;
+}
+
+void BVHFile::parse(const char *begin, const char *end) {
+    Cursor c = {begin, end};
+    vector<Vec3i> axisPermutation;
+
+    while (c.p < c.end) {
+        const string s = nextToken(c);
+        if (s == "ROOT") {
+            parseJoint(c, -1, nextToken(c), joints_, axisPermutation);
+        } else if (s == "MOTION") {
+            break;
+        }
+    }
+    assert(axisPermutation.size() == joints_.size() && "every joint must have rotation channels");
+    num_channels_ = unsigned(axisPermutation.size());
+
+    // "Frames: n" and "Frame Time: t"
+    if (nextToken(c) == "Frames:")
+        num_frames_ = size_t(parseInt(c));
+    skipSpace(c);
+    if (nextToken(c) == "Frame" && nextToken(c) == "Time:")
+        frame_time_ = parseFloat(c);
+    skipLine(c);
+
+    // Load animation angle and position data for each frame
+    const size_t stride = 1 + num_channels_;
+    frame_storage_.resize(num_frames_ * stride);
+    Vec3f posAccum;
+    for (size_t f = 0; f < num_frames_; ++f) {
+        skipSpace(c);
+        assert(c.p < c.end && "file has fewer frames than it declares");
+        Vec3f *frame = &frame_storage_[f * stride];
+        for (int i = 0; i < 3; ++i)
+            frame[0][i] = parseFloat(c);
+        posAccum += frame[0];
+
+        // Permute angle axes
+        for (unsigned j = 0; j < num_channels_; ++j) {
+            float angles[3];
+            for (int i = 0; i < 3; ++i)
+                angles[i] = parseFloat(c);
+            const Vec3i &p = axisPermutation[j];
+            frame[1 + j] = Vec3f(angles[p.x], angles[p.y], angles[p.z]);
+        }
+    }
+
+    // Offset position so that average stays at origin
+    for (size_t f = 0; f < num_frames_; ++f)
+        frame_storage_[f * stride] -= posAccum / float(num_frames_);
+
+    frames_ = frame_storage_.data();
+}
+
+bool BVHFile::readCache(const string &cache_file, U64 source_size, U64 source_time) {
+    if (!cache_.open(cache_file))
+        return false;
+
+    const char *data = cache_.getData();
+    const size_t size = cache_.getSize();
+    CacheHeader header;
+    if (size < sizeof(header)) {
+        cache_.close();
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    // Reject caches of other versions, of a modified source file, or that were only partially written.
+    const U64 joints_end = sizeof(header) + U64(header.num_joints) * sizeof(CacheJoint);
+    const U64 frames_bytes = header.num_frames * (1 + header.num_channels) * sizeof(Vec3f);
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) || header.version != CACHE_VERSION ||
+        header.source_size != source_size || header.source_time != source_time ||
+        header.names_offset != joints_end || header.names_offset > header.frames_offset ||
+        header.frames_offset % sizeof(F32) || header.frames_offset + frames_bytes != size) {
+        cache_.close();
+        return false;
+    }
+
+    const char *names = data + header.names_offset;
+    const char *names_end = data + header.frames_offset;
+    joints_.resize(header.num_joints);
+    for (U32 j = 0; j < header.num_joints; ++j) {
+        CacheJoint record;
+        memcpy(&record, data + sizeof(header) + j * sizeof(CacheJoint), sizeof(record));
+        const char *name_end = (const char *) memchr(names, 0, names_end - names);
+        if (!name_end) {
+            joints_.clear();
+            cache_.close();
+            return false;
+        }
+        joints_[j].name.assign(names, name_end);
+        joints_[j].parent = record.parent;
+        joints_[j].offset = Vec3f(record.offset[0], record.offset[1], record.offset[2]);
+        names = name_end + 1;
+    }
+
+    num_channels_ = header.num_channels;
+    num_frames_ = size_t(header.num_frames);
+    frame_time_ = header.frame_time;
+    frames_ = (const Vec3f *) (data + header.frames_offset);
+    return true;
+}
+
+void BVHFile::writeCache(const string &cache_file, U64 source_size, U64 source_time) const {
+    ofstream out(cache_file, ios::binary | ios::trunc);
+    if (!out)
+        return;
+
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.num_joints = U32(joints_.size());
+    header.num_channels = num_channels_;
+    header.frame_time = frame_time_;
+    header.num_frames = num_frames_;
+    header.source_size = source_size;
+    header.source_time = source_time;
+    header.names_offset = sizeof(header) + joints_.size() * sizeof(CacheJoint);
+    U64 names_bytes = 0;
+    for (auto &j : joints_)
+        names_bytes += j.name.size() + 1;
+    // Keep the frame data 16 byte aligned in the mapping.
+    header.frames_offset = (header.names_offset + names_bytes + 15) & ~U64(15);
+
+    out.write((const char *) &header, sizeof(header));
+    for (auto &j : joints_) {
+        const CacheJoint record = {j.parent, {j.offset.x, j.offset.y, j.offset.z}};
+        out.write((const char *) &record, sizeof(record));
+    }
+    for (auto &j : joints_)
+        out.write(j.name.c_str(), j.name.size() + 1);
+    static const char padding[16] = {};
+    out.write(padding, header.frames_offset - header.names_offset - names_bytes);
+    out.write((const char *) frames_, num_frames_ * (1 + num_channels_) * sizeof(Vec3f));
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <base/Math.hpp>
+
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file mapped into memory.
+class MappedFile
+{
+public:
+							MappedFile() {}
+							~MappedFile() { close(); }
+
+	bool					open(const std::string& filename);
+	void					close();
+
+	bool					isOpen() const { return data_ != nullptr; }
+	const char*				getData() const { return data_; }
+	size_t					getSize() const { return size_; }
+
+private:
+							MappedFile(const MappedFile&); // forbid copy
+	MappedFile&				operator=(const MappedFile&); // forbid assignment
+
+	const char*				data_ = nullptr;
+	size_t					size_ = 0;
+};
+
+struct BVHJoint
+{
+	std::string		name;
+	// Index of parent joint (-1 for root). Parents precede their children.
+	int				parent;
+	// Origin of the joint in parent's coordinate system, in file units.
+	FW::Vec3f		offset;
+};
+
+// Contents of a BVH motion capture file.
+// The text is parsed straight from a memory mapping of the file. The result is then
+// stored next to it in "<file>.cache", and later loads of an unchanged file map the
+// cache instead of parsing anything.
+// Frames are returned as getNumFrames() * (1 + getNumChannels()) Vec3f values: per frame,
+// the root position (centered so that its average is at the origin) followed by the
+// Euler angles of each animated joint in degrees, permuted to x, y, z order.
+class BVHFile
+{
+public:
+	bool					load(const std::string& filename, bool use_cache = true);
+
+	const std::vector<BVHJoint>&	getJoints() const { return joints_; }
+	unsigned				getNumChannels() const { return num_channels_; }
+	size_t					getNumFrames() const { return num_frames_; }
+	float					getFrameTime() const { return frame_time_; }
+	const FW::Vec3f*		getFrames() const { return frames_; }
+
+private:
+	void					parse(const char* begin, const char* end);
+	bool					readCache(const std::string& cache_file, FW::U64 source_size, FW::U64 source_time);
+	void					writeCache(const std::string& cache_file, FW::U64 source_size, FW::U64 source_time) const;
+
+	std::vector<BVHJoint>	joints_;
+	unsigned				num_channels_ = 0;
+	size_t					num_frames_ = 0;
+	float					frame_time_ = 0.0f;
+
+	// Points into frame_storage_ after parsing, or into cache_ when read from the cache.
+	const FW::Vec3f*		frames_ = nullptr;
+	std::vector<FW::Vec3f>	frame_storage_;
+	MappedFile				cache_;
+};
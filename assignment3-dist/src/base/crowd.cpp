@@ -0,0 +1,106 @@
+#include "crowd.hpp"
+
+#include "base/Random.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using namespace std;
+using namespace FW;
+
+void Crowd::setSize(unsigned num_instances) {
+    const unsigned side = max(1u, unsigned(ceil(sqrt(float(num_instances)))));
+    const float spacing = 1.0f / float(side);
+
+    // Fixed seed, so that the crowd looks the same every time it is created.
+    Random random(1234u);
+    placements_.resize(num_instances);
+    time_offsets_.resize(num_instances);
+    speeds_.resize(num_instances);
+    for (unsigned i = 0; i < num_instances; ++i) {
+        // Shrink the unit cube the models live in into one grid cell, keeping its center at height 0.5.
+        const Vec3f center((float(i % side) + 0.5f) * spacing, 0.5f, (float(i / side) + 0.5f) * spacing);
+        placements_[i] = Mat4f::translate(center) * Mat4f::scale(Vec3f(spacing)) * Mat4f::translate(Vec3f(-0.5f));
+        time_offsets_[i] = random.getF32(0.0f, 10.0f);
+        speeds_[i] = random.getF32(0.8f, 1.2f);
+    }
+    times_.resize(num_instances);
+    root_positions_.resize(num_instances);
+}
+
+const vector<Vertex> &Crowd::update(Skeleton &skel, SkinningEngine &skinner, float time) {
+    const size_t num_instances = placements_.size();
+    const size_t num_joints = skel.getNumJoints();
+    to_world_.resize(num_instances * num_joints);
+    palettes_.resize(num_instances * num_joints);
+    vertices_.resize(num_instances * skinner.getNumVertices());
+
+    if (skel.getAnimation().getNumFrames()) {
+        for (size_t i = 0; i < num_instances; ++i)
+            times_[i] = time_offsets_[i] + speeds_[i] * time;
+        rotations_.resize(num_instances * skel.getAnimation().getNumChannels());
+
+        // Instances are independent, so they can be posed in parallel.
+        task_skeleton_ = &skel;
+        launcher_.push(poseTask, this, 0, int((num_instances + CROWD_POSE_BATCH - 1) / CROWD_POSE_BATCH));
+        launcher_.popAll();
+        task_skeleton_ = nullptr;
+    } else {
+        // Without an animation every instance shows the current pose of the skeleton.
+        const auto &ssd_transforms = skel.getSSDTransforms();
+        for (size_t i = 0; i < num_instances; ++i)
+            copy(ssd_transforms.begin(), ssd_transforms.end(), palettes_.begin() + i * num_joints);
+    }
+
+    // The palettes stay rigid, as DQS needs them to be, and the scaled placements are applied
+    // to the skinned vertices instead.
+    skinner.skinInstances(palettes_.data(), num_joints, num_instances, vertices_.data(), placements_.data());
+    return vertices_;
+}
+
+float Crowd::compareSkinningModes(SkinningEngine &skinner, size_t instance) {
+    assert(instance < placements_.size() && !palettes_.empty() && "pose the crowd with update() first");
+    const size_t num_joints = palettes_.size() / placements_.size();
+    const size_t num_vertices = skinner.getNumVertices();
+    if (!num_vertices || !num_joints)
+        return 0.0f;
+
+    const auto mode = skinner.getMode();
+    vector<Vertex> skinned(num_vertices);
+    Vec3f lo[2], hi[2];
+    for (int dqs = 0; dqs < 2; ++dqs) {
+        skinner.setMode(dqs ? SkinningEngine::SKINNING_DQS : SkinningEngine::SKINNING_LBS);
+        skinner.skinInstances(&palettes_[instance * num_joints], num_joints, 1, skinned.data(), &placements_[instance]);
+        lo[dqs] = hi[dqs] = skinned[0].position;
+        for (const auto &v : skinned) {
+            lo[dqs] = FW::min(lo[dqs], v.position);
+            hi[dqs] = FW::max(hi[dqs], v.position);
+        }
+    }
+    skinner.setMode(mode);
+
+    const float size = FW::max((hi[0] - lo[0]).length(), 1e-6f);
+    return FW::max((lo[1] - lo[0]).abs().max(), (hi[1] - hi[0]).abs().max()) / size;
+}
+
+void Crowd::poseTask(MulticoreLauncher::Task &task) {
+    auto &crowd = *(Crowd *) task.data;
+    const auto first = size_t(task.idx) * CROWD_POSE_BATCH;
+    const auto end = std::min(first + CROWD_POSE_BATCH, crowd.placements_.size());
+    crowd.poseInstances(first, end);
+}
+
+void Crowd::poseInstances(size_t first, size_t end) {
+    const Skeleton &skel = *task_skeleton_;
+    const AnimClip &clip = skel.getAnimation();
+    const size_t num_joints = skel.getNumJoints();
+    const size_t channels = clip.getNumChannels();
+
+    clip.sampleBatch(&times_[first], end - first, &root_positions_[first], &rotations_[first * channels]);
+    for (size_t i = first; i < end; ++i) {
+        // Posed in the space of the character: update() places the instance after skinning.
+        const Mat4f root_to_world = Mat4f::translate(root_positions_[i]);
+        skel.computePoseTransforms(root_to_world, &rotations_[i * channels], &to_world_[i * num_joints], &palettes_[i * num_joints]);
+    }
+}
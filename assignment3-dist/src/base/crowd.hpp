@@ -0,0 +1,73 @@
+#pragma once
+
+#include "skeleton.hpp"
+#include "skinning.hpp"
+
+#include "base/MulticoreLauncher.hpp"
+
+#include <vector>
+
+namespace FW {
+
+// Instances posed by one MulticoreLauncher task.
+static const unsigned CROWD_POSE_BATCH = 16u;
+
+// A crowd of characters that share one skinned mesh, skeleton (bind pose), and animation
+// clip. Each instance has its own spot on a grid and its own time offset and playback speed.
+// Every frame the poses of all instances are sampled from the clip in one batch, their
+// skinning matrices are packed into one contiguous palette buffer (getNumJoints() matrices
+// per instance), and all instances are skinned by one SkinningEngine pass into one vertex array.
+// The palettes pose the characters in their own space and stay rigid, so that DQS can use
+// them; the skinning pass then scales and moves each instance to its spot on the grid.
+class Crowd
+{
+public:
+							Crowd() {}
+
+	// Lays out num_instances characters in a square grid covering [0, 1] x [0, 1] on the xz plane.
+	void					setSize(unsigned num_instances);
+	size_t					getSize() const { return placements_.size(); }
+
+	// Poses every instance at the given time in seconds and skins the mesh of skinner for each.
+	// Instance i occupies vertices [i * skinner.getNumVertices(), (i + 1) * skinner.getNumVertices()).
+	const std::vector<Vertex>&	update(Skeleton& skel, SkinningEngine& skinner, float time);
+
+	const std::vector<Mat4f>&	getPalettes() const { return palettes_; }
+	const std::vector<Mat4f>&	getPlacements() const { return placements_; }
+
+	// Skins the given instance, as posed by the last update(), with both LBS and DQS and returns
+	// the largest distance between the corners of the two bounding boxes, relative to the
+	// diagonal of the LBS one. The two methods only differ around bent joints, so this stays
+	// small unless one of them places the instance differently.
+	float					compareSkinningModes(SkinningEngine& skinner, size_t instance);
+
+private:
+							Crowd(const Crowd&); // forbid copy
+	Crowd&					operator=(const Crowd&); // forbid assignment
+
+	void					poseInstances(size_t first, size_t end);
+	static void				poseTask(MulticoreLauncher::Task& task);
+
+	// Per-instance placement and playback parameters.
+	std::vector<Mat4f>		placements_;
+	std::vector<float>		time_offsets_;
+	std::vector<float>		speeds_;
+
+	// Per-instance animation state for the current frame: clip time, root position,
+	// and one quaternion per animated joint.
+	std::vector<float>		times_;
+	std::vector<Vec3f>		root_positions_;
+	std::vector<Vec4f>		rotations_;
+
+	// getNumJoints() matrices per instance, instance-major.
+	std::vector<Mat4f>		to_world_;
+	std::vector<Mat4f>		palettes_;
+
+	std::vector<Vertex>		vertices_;
+
+	// Skeleton being posed by the tasks currently in flight.
+	const Skeleton*			task_skeleton_ = nullptr;
+	MulticoreLauncher		launcher_;
+};
+
+} // namespace FW
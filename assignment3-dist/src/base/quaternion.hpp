@@ -0,0 +1,69 @@
+#pragma once
+
+#include <base/Math.hpp>
+
+// Unit quaternions describing rotations, stored in FW::Vec4f as (x, y, z, w).
+
+inline FW::Vec4f quatMul(const FW::Vec4f& a, const FW::Vec4f& b) {
+	const FW::Vec3f av = a.getXYZ(), bv = b.getXYZ();
+	return FW::Vec4f(a.w * bv + b.w * av + FW::cross(av, bv), a.w * b.w - FW::dot(av, bv));
+}
+
+// Rotation of "angle" radians around "axis", like Mat3f::rotation(). Axis must be unit!
+inline FW::Vec4f quatFromAxisAngle(const FW::Vec3f& axis, float angle) {
+	return FW::Vec4f(axis * FW::sin(0.5f * angle), FW::cos(0.5f * angle));
+}
+
+// Same rotation as Mat3f::rotation(x axis, e.x) * Mat3f::rotation(y axis, e.y) * Mat3f::rotation(z axis, e.z).
+inline FW::Vec4f quatFromEulerXYZ(const FW::Vec3f& e) {
+	return quatMul(quatMul(quatFromAxisAngle(FW::Vec3f(1, 0, 0), e.x), quatFromAxisAngle(FW::Vec3f(0, 1, 0), e.y)), quatFromAxisAngle(FW::Vec3f(0, 0, 1), e.z));
+}
+
+inline FW::Mat3f quatToMat3(const FW::Vec4f& q) {
+	const float x = q.x, y = q.y, z = q.z, w = q.w;
+	FW::Mat3f R;
+	R(0, 0) = 1.0f - 2.0f * (y * y + z * z);	R(0, 1) = 2.0f * (x * y - z * w);			R(0, 2) = 2.0f * (x * z + y * w);
+	R(1, 0) = 2.0f * (x * y + z * w);			R(1, 1) = 1.0f - 2.0f * (x * x + z * z);	R(1, 2) = 2.0f * (y * z - x * w);
+	R(2, 0) = 2.0f * (x * z - y * w);			R(2, 1) = 2.0f * (y * z + x * w);			R(2, 2) = 1.0f - 2.0f * (x * x + y * y);
+	return R;
+}
+
+// Rotation part of a rigid transform as a unit quaternion.
+inline FW::Vec4f quatFromMat3(const FW::Mat3f& m) {
+	FW::Vec4f q;
+	const float trace = m.m00 + m.m11 + m.m22;
+	if (trace > 0.0f) {
+		const float s = 0.5f / FW::sqrt(trace + 1.0f);
+		q = FW::Vec4f((m.m21 - m.m12) * s, (m.m02 - m.m20) * s, (m.m10 - m.m01) * s, 0.25f / s);
+	} else if (m.m00 > m.m11 && m.m00 > m.m22) {
+		const float s = 2.0f * FW::sqrt(1.0f + m.m00 - m.m11 - m.m22);
+		q = FW::Vec4f(0.25f * s, (m.m01 + m.m10) / s, (m.m02 + m.m20) / s, (m.m21 - m.m12) / s);
+	} else if (m.m11 > m.m22) {
+		const float s = 2.0f * FW::sqrt(1.0f + m.m11 - m.m00 - m.m22);
+		q = FW::Vec4f((m.m01 + m.m10) / s, 0.25f * s, (m.m12 + m.m21) / s, (m.m02 - m.m20) / s);
+	} else {
+		const float s = 2.0f * FW::sqrt(1.0f + m.m22 - m.m00 - m.m11);
+		q = FW::Vec4f((m.m02 + m.m20) / s, (m.m12 + m.m21) / s, 0.25f * s, (m.m10 - m.m01) / s);
+	}
+	return q.normalized();
+}
+
+// Spherical linear interpolation along the shorter arc.
+inline FW::Vec4f quatSlerp(const FW::Vec4f& a, FW::Vec4f b, float t) {
+	float d = FW::dot(a, b);
+	if (d < 0.0f) {
+		b = -b;
+		d = -d;
+	}
+	// Nearly parallel: normalized linear interpolation is accurate and avoids dividing by sin(0).
+	if (d > 0.9995f)
+		return FW::lerp(a, b, t).normalized();
+	const float theta = FW::acos(d);
+	const float s = 1.0f / FW::sin(theta);
+	return a * (FW::sin((1.0f - t) * theta) * s) + b * (FW::sin(t * theta) * s);
+}
+
+// Angle in radians of the rotation taking a to b.
+inline float quatAngle(const FW::Vec4f& a, const FW::Vec4f& b) {
+	return 2.0f * FW::acos(FW::min(FW::abs(FW::dot(a, b)), 1.0f));
+}
@@ -1,4 +1,6 @@
 #include "skeleton.hpp"
+#include "bvh.hpp"
+#include "quaternion.hpp"
 #include "utility.hpp"
 
 #include <cassert>
@@ -16,9 +18,11 @@ void Skeleton::setJointRotation(unsigned index, Vec3f euler_angles) {
     // For convenient reading, we store the rotation angles in the joint
     // as-is, in addition to setting the to_parent matrix to match the rotation.
     joint.rotation = euler_angles;
+    world_dirty_ = true;
 
-    joint.to_parent = Mat4f();
-    joint.to_parent.setCol(3, Vec4f(joint.position, 1.0f));
+    Mat4f &to_parent = to_parent_[index];
+    to_parent = Mat4f();
+    to_parent.setCol(3, Vec4f(joint.position, 1.0f));
 
     // YOUR CODE HERE (R2)
     // Modify the "to_parent" matrix of the joint to match
@@ -30,9 +34,21 @@ void Skeleton::setJointRotation(unsigned index, Vec3f euler_angles) {
     // Hints: You can use Mat3f::rotation() three times in a row,
     // once for each main axis, and multiply the results.
     auto rot = FW::Mat3f::rotation(Vec3f(1, 0, 0), euler_angles.x) * FW::Mat3f::rotation(Vec3f(0, 1, 0), euler_angles.y) * FW::Mat3f::rotation(Vec3f(0, 0, 1), euler_angles.z);
-    joint.to_parent.setCol(0, Vec4f(rot.getCol(0), 0));
-    joint.to_parent.setCol(1, Vec4f(rot.getCol(1), 0));
-    joint.to_parent.setCol(2, Vec4f(rot.getCol(2), 0));
+    to_parent.setCol(0, Vec4f(rot.getCol(0), 0));
+    to_parent.setCol(1, Vec4f(rot.getCol(1), 0));
+    to_parent.setCol(2, Vec4f(rot.getCol(2), 0));
+}
+
+void Skeleton::setJointOrientation(unsigned index, const Vec4f &quaternion) {
+    // Animation poses come as quaternions, which give the rotation matrix directly.
+    // The Euler angles in the joint are left as they are.
+    const Mat3f rot = quatToMat3(quaternion);
+    Mat4f &to_parent = to_parent_[index];
+    to_parent.setCol(0, Vec4f(rot.getCol(0), 0));
+    to_parent.setCol(1, Vec4f(rot.getCol(1), 0));
+    to_parent.setCol(2, Vec4f(rot.getCol(2), 0));
+    to_parent.setCol(3, Vec4f(joints_[index].position, 1.0f));
+    world_dirty_ = true;
 }
 
 void Skeleton::incrJointRotation(unsigned index, Vec3f euler_angles) {
@@ -40,83 +56,136 @@ void Skeleton::incrJointRotation(unsigned index, Vec3f euler_angles) {
 }
 
 void Skeleton::updateToWorldTransforms() {
+    // Nothing has moved since the last update.
+    if (!world_dirty_)
+        return;
+
     // Here we just initiate the hierarchical transformation from the root node (at index 0)
-    // and an identity transformation, precisely as in the lecture slides on hierarchical modeling.
+    // with an identity transformation, precisely as in the lecture slides on hierarchical modeling.
     if (!animationMode)
-        updateToWorldTransforms(0, Mat4f());
+        updateToWorldTransforms(Mat4f());
     else
         // If we're running an animation, we need to set all of the joint rotations of the current frame
         // and translate the root so it matches the animation.
         setAnimationState();
+
+    world_dirty_ = false;
+    ssd_dirty_ = true;
 }
 
-void Skeleton::updateToWorldTransforms(unsigned joint_index, const Mat4f &parent_to_world) {
+void Skeleton::updateToWorldTransforms(const Mat4f &root_to_world) {
     // YOUR CODE HERE (R1)
-    // Update transforms for joint at joint_index and its children.
-    auto &current_joint = this->joints_[joint_index];
-    current_joint.to_world = parent_to_world * current_joint.to_parent;
-    for (auto const &child : current_joint.children) {
-        updateToWorldTransforms(child, current_joint.to_world);
+    // Update transforms for all joints. Parents are stored before their children,
+    // so by the time we reach a joint its parent's to_world is already up to date.
+    const auto n = parents_.size();
+    const int *parents = parents_.data();
+    const Mat4f *to_parent = to_parent_.data();
+    Mat4f *to_world = to_world_.data();
+    for (size_t j = 0; j < n; ++j) {
+        const int parent = parents[j];
+        to_world[j] = (parent < 0 ? root_to_world : to_world[parent]) * to_parent[j];
     }
 }
 
+// Lay out the per-joint transforms into flat arrays once the joints have been loaded.
+// Both file formats list each joint after its parent, which gives us the topological
+// order the linear hierarchy update relies on.
+void Skeleton::buildHierarchy() {
+    const auto n = joints_.size();
+    parents_.resize(n);
+    for (size_t j = 0; j < n; ++j) {
+        parents_[j] = joints_[j].parent;
+        assert(parents_[j] < int(j) && "parent joints must precede their children");
+    }
+    to_parent_.assign(n, Mat4f());
+    to_world_.assign(n, Mat4f());
+    to_bind_joint_.assign(n, Mat4f());
+    ssd_transforms_.assign(n, Mat4f());
+    world_dirty_ = ssd_dirty_ = true;
+}
+
 void Skeleton::computeToBindTransforms() {
     updateToWorldTransforms();
     // YOUR CODE HERE (R4)
     // Given the current to_world transforms for each bone,
     // compute the inverse bind pose transformations (as per the lecture slides),
     // and store the results in the member to_bind_joint of each joint.
-    for (auto &joint : this->joints_) {
-        joint.to_bind_joint = FW::invert(joint.to_world);
+    for (size_t j = 0; j < to_world_.size(); ++j) {
+        to_bind_joint_[j] = FW::invert(to_world_[j]);
     }
+    ssd_dirty_ = true;
 }
 
-vector<Mat4f> Skeleton::getToWorldTransforms() {
+const vector<Mat4f> &Skeleton::getToWorldTransforms() {
     updateToWorldTransforms();
-    vector<Mat4f> transforms;
-    for (const auto &j : joints_)
-        transforms.push_back(j.to_world);
-    return transforms;
+    return to_world_;
+}
+
+void Skeleton::computePoseTransforms(const Mat4f &root_to_world, const Vec4f *rotations, Mat4f *to_world, Mat4f *ssd_transforms) const {
+    // Same forward pass as updateToWorldTransforms(), with the local rotations taken
+    // from the given quaternions. Joints without animation channels keep their current rotation.
+    const auto channels = animationData.getNumChannels();
+    for (size_t j = 0; j < parents_.size(); ++j) {
+        Mat4f to_parent = to_parent_[j];
+        if (j < channels) {
+            const Mat3f rot = quatToMat3(rotations[j]);
+            to_parent.setCol(0, Vec4f(rot.getCol(0), 0));
+            to_parent.setCol(1, Vec4f(rot.getCol(1), 0));
+            to_parent.setCol(2, Vec4f(rot.getCol(2), 0));
+        }
+        const int parent = parents_[j];
+        to_world[j] = (parent < 0 ? root_to_world : to_world[parent]) * to_parent;
+        ssd_transforms[j] = to_world[j] * to_bind_joint_[j];
+    }
 }
 
-vector<Mat4f> Skeleton::getSSDTransforms() {
+const vector<Mat4f> &Skeleton::getSSDTransforms() {
     updateToWorldTransforms();
+    if (!ssd_dirty_)
+        return ssd_transforms_;
+
     // YOUR CODE HERE (R4)
     // Compute the relative transformations between the bind pose and current pose,
     // store the results in the vector "transforms". These are the transformations
     // passed into the actual skinning code. (In the lecture slides' terms,
     // these are the T_i * inv(B_i) matrices.)
 
-    vector<Mat4f> transforms;
-    for (auto &joint : this->joints_) {
-        transforms.push_back(joint.to_world * joint.to_bind_joint);
+    for (size_t j = 0; j < to_world_.size(); ++j) {
+        ssd_transforms_[j] = to_world_[j] * to_bind_joint_[j];
     }
+    ssd_dirty_ = false;
 
-    return transforms;
+    return ssd_transforms_;
 }
 
 float Skeleton::loadBVH(string skeleton_file) {
-    ifstream in(skeleton_file);
-
-    std::vector<Vec3i> axisPermutation;
-
-    string s;
-    string line;
-    while (getline(in, line)) {
-        stringstream stream(line);
-        stream >> s;
-
-        if (s == "ROOT") {
-            string jointName;
-            stream >> jointName;
-            loadJoint(in, -1, jointName, axisPermutation);
-        } else if (s == "MOTION") {
-            loadAnim(in, axisPermutation);
-        }
+    // The file is parsed by BVHFile, which also keeps a binary cache of it.
+    BVHFile bvh;
+    const bool loaded = bvh.load(skeleton_file);
+    assert(loaded && "could not read the BVH file");
+    (void) loaded; // silence warning on release build
+
+    for (auto &b : bvh.getJoints()) {
+        Joint j;
+        j.name = b.name;
+        j.parent = b.parent;
+        j.position = b.offset;
+        joints_.push_back(j);
+
+        const int index = int(joints_.size() - 1);
+        if (b.parent != -1)
+            joints_[b.parent].children.push_back(index);
+        jointNameMap[b.name] = index;
     }
 
+    animationData.build(bvh.getFrames(), bvh.getNumFrames(), bvh.getNumChannels(), bvh.getFrameTime(), animationOptions);
+    animationRotations.resize(animationData.getNumChannels());
+
     float scale = normalizeScale();
 
+    buildHierarchy();
+    assert(animationData.getNumChannels() <= joints_.size() && "more animation channels than joints");
+
     // initially set to_parent matrices to identity
     for (auto j = 0u; j < joints_.size(); ++j)
         setJointRotation(j, Vec3f(0, 0, 0));
@@ -127,108 +196,6 @@ float Skeleton::loadBVH(string skeleton_file) {
     return scale;
 }
 
-void Skeleton::loadJoint(ifstream &in, int parent, string name, std::vector<Vec3i> &axisPermutation) {
-    Joint j;
-    j.name = name;
-    j.parent = parent;
-
-    bool pushed = false;
-
-    int curIdx = -1;
-    string s;
-    string line;
-    while (getline(in, line)) {
-        stringstream stream(line);
-        stream >> s;
-        if (s == "JOINT") {
-            string jointName;
-            stream >> jointName;
-            loadJoint(in, curIdx, jointName, axisPermutation);
-        } else if (s == "End") {
-            while (getline(in, line)) {
-                // Read End block so it doesn't get interpreted as a closing bracket or offset keyword
-                stringstream end(line);
-                end >> s;
-                if (s == "}")
-                    break;
-            }
-        } else if (s == "}") {
-            return;
-        } else if (s == "CHANNELS") {
-            int channelCount;
-            stream >> channelCount;
-            if (channelCount == 6)
-                stream >> s >> s >> s;
-
-            Vec3i permutation;
-            for (int i = 0; i < 3; ++i) {
-                stream >> s;
-                if (s == "Xrotation")
-                    permutation[0] = i;
-                else if (s == "Yrotation")
-                    permutation[1] = i;
-                else if (s == "Zrotation")
-                    permutation[2] = i;
-            }
-            axisPermutation.push_back(permutation);
-        } else if (s == "OFFSET") {
-            Vec3f pos;
-            stream >> pos.x >> pos.y >> pos.z;
-            j.position = pos;
-
-            if (!pushed) {
-                pushed = true;
-                joints_.push_back(j);
-                curIdx = int(joints_.size() - 1);
-
-                if (parent != -1)
-                    joints_[parent].children.push_back(curIdx);
-            }
-            jointNameMap[name] = curIdx;
-        }
-    }
-}
-
-void Skeleton::loadAnim(ifstream &in, std::vector<Vec3i> &axisPermutation) {
-    string word;
-    in >> word;
-    int frames;
-    in >> frames;
-
-    animationData.resize(frames);
-
-    int frameNum = 0;
-    string line;
-
-    // Discard unused lines
-    getline(in, line);
-    getline(in, line);
-
-    // Load animation angle and position data for each frame
-    while (getline(in, line)) {
-        float *frameData = (float *) (animationData.data() + frameNum);
-        stringstream stream(line);
-        int i = 0;
-        while (stream.good())
-            stream >> frameData[i++];
-        frameNum++;
-    }
-
-    // Permute angle axes
-    Vec3f posAccum;
-    for (auto &f : animationData) {
-        posAccum += f.position;
-        for (int i = 0; i < ANIM_JOINT_COUNT; ++i) {
-            Vec3f angles = f.angles[i];
-            f.angles[i] = Vec3f(angles[axisPermutation[i].x], angles[axisPermutation[i].y], angles[axisPermutation[i].z]);
-        }
-    }
-
-    // Offset position so that average stays at origin
-    for (auto &f : animationData)
-        f.position -= posAccum / float(animationData.size());
-}
-
 void Skeleton::load(string skeleton_file) {
     ifstream in(skeleton_file);
     Joint joint;
@@ -255,6 +222,8 @@ void Skeleton::load(string skeleton_file) {
         }
     }
 
+    buildHierarchy();
+
     // initially set to_parent matrices to identity
     for (auto j = 0u; j < joints_.size(); ++j)
         setJointRotation(j, Vec3f(0, 0, 0));
@@ -274,8 +243,7 @@ float Skeleton::normalizeScale() {
     scale *= 2;
     for (auto &j : joints_)
         j.position /= scale;
-    for (auto &f : animationData)
-        f.position /= scale;
+    animationData.scalePositions(1.0f / scale);
 
     return scale;
 }
@@ -296,26 +264,28 @@ int Skeleton::getJointIndex(string name) {
     return jointNameMap[name];
 }
 
-void Skeleton::setAnimationFrame(int AnimationFrame) {
-    animationFrame = AnimationFrame;
+void Skeleton::setAnimationTime(float seconds) {
+    if (!animationMode || seconds != animationTime)
+        world_dirty_ = true;
+    animationTime = seconds;
     animationMode = true;
 }
 
 void Skeleton::setAnimationState() {
     // No actual animation exists.
-    if (!animationData.size()) {
+    if (!animationData.getNumFrames()) {
         animationMode = false;
-        updateToWorldTransforms(0, Mat4f());
+        updateToWorldTransforms(Mat4f());
         return;
     }
 
     // Get the current position in the animation..
-    int frame = animationFrame % animationData.size();
-    auto &frameData = animationData[frame];
+    Vec3f position;
+    animationData.sample(animationTime, position, animationRotations.data());
     // .. and set all joint rotations accordingly.
-    for (int j = 0; j < ANIM_JOINT_COUNT; ++j)
-        setJointRotation(j, frameData.angles[j] * FW_PI / 180.0f);
+    for (unsigned j = 0; j < animationData.getNumChannels(); ++j)
+        setJointOrientation(j, animationRotations[j]);
 
     // Also translate the root to the position given in the animation description.
-    updateToWorldTransforms(0, Mat4f::translate(frameData.position));
+    updateToWorldTransforms(Mat4f::translate(position));
 }
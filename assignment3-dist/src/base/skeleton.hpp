@@ -1,5 +1,7 @@
 #pragma once
 
+#include "animclip.hpp"
+
 #include <base/Math.hpp>
 
 #include <string>
@@ -7,12 +9,6 @@
 #include <map>
 
 static const unsigned WEIGHTS_PER_VERTEX = 8u;
-static const unsigned ANIM_JOINT_COUNT = 100u;
-struct AnimFrame
-{
-	FW::Vec3f position;
-	FW::Vec3f angles[ ANIM_JOINT_COUNT ];
-};
 
 struct Joint
 {
@@ -24,18 +20,6 @@ struct Joint
 	// This always stays fixed.
 	FW::Vec3f position;
 
-	// Current transform from joint space to parent joint's space.
-	// (It is computed using the rotation and the position.)
-	FW::Mat4f to_parent;
-
-	// Current transform from joint space to world space.
-	// (This is the matrix T_i in the lecture slides' notation.)
-	FW::Mat4f to_world;
-
-	// Transform from world space to joint space for the initial "bind" configuration.
-	// (This is the matrix inv(B_i) in the lecture slides' notation)
-	FW::Mat4f to_bind_joint;
-
 	//
 	std::string name;
 
@@ -50,35 +34,74 @@ class Skeleton
 public:
 	void					load(std::string skeleton_file);
 	float					loadBVH(std::string skeleton_file);
+	// Compression applied to animation clips loaded after this call.
+	void					setAnimationOptions(const AnimClip::Options& options) { animationOptions = options; }
+	const AnimClip&			getAnimation() const { return animationData; }
 
 	int						getJointIndex(std::string name);
 	std::string				getJointName(unsigned index) const;
 	FW::Vec3f				getJointRotation(unsigned index) const;
 	int						getJointParent(unsigned index) const;
 
-	void					setAnimationFrame(int frame);
+	// Poses the skeleton as the animation clip is at the given time in seconds.
+	void					setAnimationTime(float seconds);
 	void					setJointRotation(unsigned index, FW::Vec3f euler_angles);
 	void					incrJointRotation(unsigned index, FW::Vec3f euler_angles);
 	
 	void					updateToWorldTransforms();
 	float					normalizeScale();
 
-	std::vector<FW::Mat4f>	getToWorldTransforms();
-	std::vector<FW::Mat4f>	getSSDTransforms();
+	// These return views of cached matrices that stay valid until the next call
+	// that modifies the skeleton. The hierarchy is only recomputed when a joint
+	// rotation or the animation time has changed since the last update.
+	const std::vector<FW::Mat4f>&	getToWorldTransforms();
+	const std::vector<FW::Mat4f>&	getSSDTransforms();
 
-	size_t					getNumJoints() { return joints_.size(); }
+	size_t					getNumJoints() const { return joints_.size(); }
+
+	// Computes the transforms of an arbitrary animation pose without changing the pose of
+	// the skeleton itself, e.g. for the instances of a crowd. root_to_world places the root
+	// and rotations holds one quaternion per animated joint. to_world and ssd_transforms
+	// receive getNumJoints() matrices each.
+	void					computePoseTransforms(const FW::Mat4f& root_to_world, const FW::Vec4f* rotations, FW::Mat4f* to_world, FW::Mat4f* ssd_transforms) const;
 
 private:
 	void					setAnimationState();
-	void					loadJoint(std::ifstream& in, int parent, std::string name, std::vector<FW::Vec3i>& axisPermutation);
-	void					loadAnim(std::ifstream& in, std::vector<FW::Vec3i>& axisPermutation);
-	void					updateToWorldTransforms(unsigned joint_index, const FW::Mat4f& parent_to_world);
+	void					setJointOrientation(unsigned index, const FW::Vec4f& quaternion);
+	void					updateToWorldTransforms(const FW::Mat4f& root_to_world);
 
+	void					buildHierarchy();
 	void					computeToBindTransforms();
 
 	std::vector<Joint>		joints_;
+
+	// Per-joint transforms in flat arrays, indexed by joint index. The joints are
+	// stored in topological order (every parent precedes its children), so the
+	// hierarchy can be updated with a single forward pass over these arrays.
+
+	// Index of parent joint (-1 for root).
+	std::vector<int>		parents_;
+	// Current transform from joint space to parent joint's space.
+	// (It is computed using the rotation and the position.)
+	std::vector<FW::Mat4f>	to_parent_;
+	// Current transform from joint space to world space.
+	// (This is the matrix T_i in the lecture slides' notation.)
+	std::vector<FW::Mat4f>	to_world_;
+	// Transform from world space to joint space for the initial "bind" configuration.
+	// (This is the matrix inv(B_i) in the lecture slides' notation)
+	std::vector<FW::Mat4f>	to_bind_joint_;
+	// Cached skinning transforms to_world * to_bind_joint.
+	std::vector<FW::Mat4f>	ssd_transforms_;
+
+	// Set when to_world_ (or ssd_transforms_) no longer matches the current pose.
+	bool					world_dirty_ = true;
+	bool					ssd_dirty_ = true;
+
 	std::map<std::string, int> jointNameMap;
-	std::vector<AnimFrame>  animationData;
-	int						animationFrame;
+	AnimClip				animationData;
+	AnimClip::Options		animationOptions;
+	// Rotations of the current animation pose, one quaternion per animated joint.
+	std::vector<FW::Vec4f>	animationRotations;
+	float					animationTime = 0.0f;
 	bool					animationMode = false;
 };
@@ -0,0 +1,419 @@
+#include "skinning.hpp"
+#include "quaternion.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <emmintrin.h>
+
+using namespace std;
+using namespace FW;
+
+namespace {
+
+    // Load column "col" of four column-major 4x4 matrices and transpose, so that
+    // r[i] holds element (i, col) of each matrix in the corresponding lane.
+    inline void loadColumn(const float *m0, const float *m1, const float *m2, const float *m3, int col, __m128 r[4]) {
+        r[0] = _mm_loadu_ps(m0 + 4 * col);
+        r[1] = _mm_loadu_ps(m1 + 4 * col);
+        r[2] = _mm_loadu_ps(m2 + 4 * col);
+        r[3] = _mm_loadu_ps(m3 + 4 * col);
+        _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+    }
+
+    // Lane-wise 3x3 matrix-vector product with the upper left block of four matrices.
+    inline void transformVector(const float *m0, const float *m1, const float *m2, const float *m3,
+                                __m128 x, __m128 y, __m128 z, __m128 &rx, __m128 &ry, __m128 &rz) {
+        __m128 c[4];
+        loadColumn(m0, m1, m2, m3, 0, c);
+        rx = _mm_mul_ps(c[0], x);
+        ry = _mm_mul_ps(c[1], x);
+        rz = _mm_mul_ps(c[2], x);
+        loadColumn(m0, m1, m2, m3, 1, c);
+        rx = _mm_add_ps(rx, _mm_mul_ps(c[0], y));
+        ry = _mm_add_ps(ry, _mm_mul_ps(c[1], y));
+        rz = _mm_add_ps(rz, _mm_mul_ps(c[2], y));
+        loadColumn(m0, m1, m2, m3, 2, c);
+        rx = _mm_add_ps(rx, _mm_mul_ps(c[0], z));
+        ry = _mm_add_ps(ry, _mm_mul_ps(c[1], z));
+        rz = _mm_add_ps(rz, _mm_mul_ps(c[2], z));
+    }
+
+    inline void addTranslation(const float *m0, const float *m1, const float *m2, const float *m3,
+                               __m128 &rx, __m128 &ry, __m128 &rz) {
+        __m128 c[4];
+        loadColumn(m0, m1, m2, m3, 3, c);
+        rx = _mm_add_ps(rx, c[0]);
+        ry = _mm_add_ps(ry, c[1]);
+        rz = _mm_add_ps(rz, c[2]);
+    }
+
+    // Four 16 bit fixed point weights as floats.
+    inline __m128 loadWeights(const U16 *w) {
+        const __m128i q = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *) w), _mm_setzero_si128());
+        return _mm_mul_ps(_mm_cvtepi32_ps(q), _mm_set1_ps(1.0f / float(SKIN_WEIGHT_ONE)));
+    }
+
+    // Lane-wise cross product.
+    inline void crossLanes(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz, __m128 &rx, __m128 &ry, __m128 &rz) {
+        rx = _mm_sub_ps(_mm_mul_ps(ay, bz), _mm_mul_ps(az, by));
+        ry = _mm_sub_ps(_mm_mul_ps(az, bx), _mm_mul_ps(ax, bz));
+        rz = _mm_sub_ps(_mm_mul_ps(ax, by), _mm_mul_ps(ay, bx));
+    }
+
+    // Rotate the vectors v by the unit quaternions (qx, qy, qz, qw): v + 2 q.xyz x (q.xyz x v + qw v).
+    inline void rotateLanes(__m128 qx, __m128 qy, __m128 qz, __m128 qw, __m128 &vx, __m128 &vy, __m128 &vz) {
+        __m128 tx, ty, tz, ux, uy, uz;
+        crossLanes(qx, qy, qz, vx, vy, vz, tx, ty, tz);
+        tx = _mm_add_ps(tx, _mm_mul_ps(qw, vx));
+        ty = _mm_add_ps(ty, _mm_mul_ps(qw, vy));
+        tz = _mm_add_ps(tz, _mm_mul_ps(qw, vz));
+        crossLanes(qx, qy, qz, tx, ty, tz, ux, uy, uz);
+        const __m128 two = _mm_set1_ps(2.0f);
+        vx = _mm_add_ps(vx, _mm_mul_ps(two, ux));
+        vy = _mm_add_ps(vy, _mm_mul_ps(two, uy));
+        vz = _mm_add_ps(vz, _mm_mul_ps(two, uz));
+    }
+
+} // namespace
+
+void FW::setInfluences(WeightedVertex &v, const int *joints, const float *weights) {
+    unsigned order[WEIGHTS_PER_VERTEX];
+    unsigned count = 0;
+    float sum = 0.0f;
+    for (unsigned i = 0; i < WEIGHTS_PER_VERTEX; ++i) {
+        if (weights[i] != 0.0f) {
+            assert(0 <= joints[i] && joints[i] <= 255 && "joint index does not fit in 8 bits");
+            order[count++] = i;
+            sum += weights[i];
+        }
+    }
+    stable_sort(order, order + count, [&](unsigned a, unsigned b) { return weights[a] > weights[b]; });
+
+    // Round each weight to fixed point and give the rounding error to the largest one,
+    // so that the weights still sum up to exactly one.
+    memset(v.joints, 0, sizeof(v.joints));
+    memset(v.weights, 0, sizeof(v.weights));
+    v.num_influences = U8(count);
+    unsigned total = 0;
+    for (unsigned k = 0; k < count; ++k) {
+        v.joints[k] = U8(joints[order[k]]);
+        v.weights[k] = U16(FW::min(unsigned(weights[order[k]] / sum * float(SKIN_WEIGHT_ONE) + 0.5f), SKIN_WEIGHT_ONE));
+        total += v.weights[k];
+    }
+    if (count)
+        v.weights[0] = U16(int(v.weights[0]) + int(SKIN_WEIGHT_ONE) - int(total));
+}
+
+void SkinningEngine::setSource(const vector<WeightedVertex> &source) {
+    num_vertices_ = source.size();
+    const auto num_batches = (num_vertices_ + SKIN_BATCH_SIZE - 1) / SKIN_BATCH_SIZE;
+    const auto padded = num_batches * SKIN_BATCH_SIZE;
+
+    px_.assign(padded, 0.0f);
+    py_.assign(padded, 0.0f);
+    pz_.assign(padded, 0.0f);
+    nx_.assign(padded, 0.0f);
+    ny_.assign(padded, 0.0f);
+    nz_.assign(padded, 0.0f);
+    colors_.resize(num_vertices_);
+    for (size_t i = 0; i < num_vertices_; ++i) {
+        px_[i] = source[i].position.x;
+        py_[i] = source[i].position.y;
+        pz_[i] = source[i].position.z;
+        nx_[i] = source[i].normal.x;
+        ny_[i] = source[i].normal.y;
+        nz_[i] = source[i].normal.z;
+        colors_[i] = source[i].color;
+    }
+
+    output_[0].resize(num_vertices_);
+    output_[1].resize(num_vertices_);
+    front_output_ = 0;
+
+    batch_first_.resize(num_batches);
+    batch_count_.resize(num_batches);
+    influence_joints_.clear();
+    influence_weights_.clear();
+    for (size_t b = 0; b < num_batches; ++b) {
+        // Pad all lanes to the longest influence list in the batch.
+        const WeightedVertex *lanes[SKIN_BATCH_SIZE] = {};
+        unsigned max_count = 0;
+        for (unsigned lane = 0; lane < SKIN_BATCH_SIZE; ++lane) {
+            const auto v = b * SKIN_BATCH_SIZE + lane;
+            if (v >= num_vertices_)
+                continue;
+            assert(source[v].num_influences <= WEIGHTS_PER_VERTEX);
+            lanes[lane] = &source[v];
+            max_count = std::max(max_count, unsigned(source[v].num_influences));
+        }
+
+        batch_first_[b] = unsigned(influence_weights_.size() / SKIN_BATCH_SIZE);
+        batch_count_[b] = max_count;
+        for (unsigned k = 0; k < max_count; ++k) {
+            for (unsigned lane = 0; lane < SKIN_BATCH_SIZE; ++lane) {
+                const bool used = lanes[lane] && k < lanes[lane]->num_influences;
+                influence_joints_.push_back(used ? lanes[lane]->joints[k] : U8(0));
+                influence_weights_.push_back(used ? lanes[lane]->weights[k] : U16(0));
+            }
+        }
+    }
+}
+
+void SkinningEngine::updateJointMatrices(const Mat4f *transforms, size_t count) {
+    // The normal matrix only depends on the joint, so compute it once per joint
+    // instead of once per influence.
+    joint_transforms_.resize(count);
+    normal_transforms_.resize(count);
+    for (size_t j = 0; j < count; ++j) {
+        joint_transforms_[j] = transforms[j];
+        normal_transforms_[j] = transforms[j].transposed().inverted();
+    }
+}
+
+void SkinningEngine::updateDualQuaternions(const Mat4f *transforms, size_t count) {
+    // q = r + e d with d = 1/2 (t, 0) r, where r is the rotation and t the translation.
+    joint_dual_quats_.resize(8 * count);
+    for (size_t j = 0; j < count; ++j) {
+        const Mat4f &m = transforms[j];
+        const Vec4f r = quatFromMat3(m.getXYZ());
+        const Vec3f t = Vec3f(m.m03, m.m13, m.m23);
+        const Vec3f d = 0.5f * (r.w * t + FW::cross(t, r.getXYZ()));
+        float *q = &joint_dual_quats_[8 * j];
+        q[0] = r.x;
+        q[1] = r.y;
+        q[2] = r.z;
+        q[3] = r.w;
+        q[4] = d.x;
+        q[5] = d.y;
+        q[6] = d.z;
+        q[7] = -0.5f * dot(t, r.getXYZ());
+    }
+}
+
+const vector<Vertex> &SkinningEngine::skin(const vector<Mat4f> &ssd_transforms) {
+    auto &back = output_[front_output_ ^ 1];
+    skinInstances(mode_, ssd_transforms.data(), ssd_transforms.size(), 1, back.data());
+    front_output_ ^= 1;
+    return back;
+}
+
+void SkinningEngine::skinLBS(const vector<Mat4f> &ssd_transforms, Vertex *result) {
+    skinInstances(SKINNING_LBS, ssd_transforms.data(), ssd_transforms.size(), 1, result);
+}
+
+void SkinningEngine::skinDQS(const vector<Mat4f> &ssd_transforms, Vertex *result) {
+    skinInstances(SKINNING_DQS, ssd_transforms.data(), ssd_transforms.size(), 1, result);
+}
+
+void SkinningEngine::skinInstances(const Mat4f *palettes, size_t num_joints, size_t num_instances, Vertex *result, const Mat4f *models) {
+    skinInstances(mode_, palettes, num_joints, num_instances, result, models);
+}
+
+void SkinningEngine::skinInstances(SkinningMode mode, const Mat4f *palettes, size_t num_joints, size_t num_instances, Vertex *result,
+                                   const Mat4f *models) {
+    if (!num_vertices_ || !num_instances)
+        return;
+    if (mode == SKINNING_DQS)
+        updateDualQuaternions(palettes, num_joints * num_instances);
+    else
+        updateJointMatrices(palettes, num_joints * num_instances);
+
+    const auto num_batches = batch_first_.size();
+    task_mode_ = mode;
+    task_joints_ = num_joints;
+    task_chunks_ = (num_batches + SKIN_CHUNK_BATCHES - 1) / SKIN_CHUNK_BATCHES;
+    task_result_ = result;
+    task_models_ = models;
+
+    if (multithreaded_) {
+        // Each chunk writes a disjoint range of the output, so the tasks need no synchronization.
+        launcher_.push(skinChunkTask, this, 0, int(task_chunks_ * num_instances));
+        launcher_.popAll();
+    } else {
+        for (size_t i = 0; i < num_instances; ++i)
+            skinInstanceBatches(i, 0, num_batches);
+    }
+    task_result_ = nullptr;
+    task_models_ = nullptr;
+}
+
+void SkinningEngine::skinChunkTask(MulticoreLauncher::Task &task) {
+    const auto &engine = *(const SkinningEngine *) task.data;
+    const auto instance = size_t(task.idx) / engine.task_chunks_;
+    const auto first = (size_t(task.idx) % engine.task_chunks_) * SKIN_CHUNK_BATCHES;
+    const auto end = std::min(first + SKIN_CHUNK_BATCHES, engine.batch_first_.size());
+    engine.skinInstanceBatches(instance, first, end);
+}
+
+void SkinningEngine::skinInstanceBatches(size_t instance, size_t first_batch, size_t end_batch) const {
+    Vertex *result = task_result_ + instance * num_vertices_;
+    const size_t joint = instance * task_joints_;
+    if (task_mode_ == SKINNING_DQS)
+        skinBatchesDQS(first_batch, end_batch, &joint_dual_quats_[8 * joint], result);
+    else
+        skinBatchesLBS(first_batch, end_batch, joint_transforms_[joint].getPtr(), normal_transforms_[joint].getPtr(), result);
+    // The chunk was just written, so placing it while it is still in the cache costs little.
+    if (task_models_)
+        placeBatches(first_batch, end_batch, task_models_[instance], result);
+}
+
+void SkinningEngine::placeBatches(size_t first_batch, size_t end_batch, const Mat4f &model, Vertex *result) const {
+    // A uniform scale leaves the directions of the normals as they are, so they only need to
+    // be rotated and renormalized.
+    const Mat3f rotate_scale = model.getXYZ();
+    const auto end = std::min(end_batch * SKIN_BATCH_SIZE, num_vertices_);
+    for (auto i = first_batch * SKIN_BATCH_SIZE; i < end; ++i) {
+        Vertex &v = result[i];
+        v.position = (model * Vec4f(v.position, 1.0f)).getXYZ();
+        v.normal = (rotate_scale * v.normal).normalized();
+    }
+}
+
+void SkinningEngine::skinBatchesLBS(size_t first_batch, size_t end_batch, const float *T, const float *N, Vertex *result) const {
+
+    for (size_t b = first_batch; b < end_batch; ++b) {
+        const auto base = b * SKIN_BATCH_SIZE;
+        const __m128 x = _mm_loadu_ps(&px_[base]);
+        const __m128 y = _mm_loadu_ps(&py_[base]);
+        const __m128 z = _mm_loadu_ps(&pz_[base]);
+        const __m128 nx = _mm_loadu_ps(&nx_[base]);
+        const __m128 ny = _mm_loadu_ps(&ny_[base]);
+        const __m128 nz = _mm_loadu_ps(&nz_[base]);
+
+        __m128 pos_x = _mm_setzero_ps(), pos_y = _mm_setzero_ps(), pos_z = _mm_setzero_ps();
+        __m128 nrm_x = _mm_setzero_ps(), nrm_y = _mm_setzero_ps(), nrm_z = _mm_setzero_ps();
+
+        const auto first = batch_first_[b];
+        for (unsigned k = 0; k < batch_count_[b]; ++k) {
+            const U8 *j = &influence_joints_[(first + k) * SKIN_BATCH_SIZE];
+            const __m128 w = loadWeights(&influence_weights_[(first + k) * SKIN_BATCH_SIZE]);
+
+            __m128 tx, ty, tz;
+            transformVector(T + 16 * j[0], T + 16 * j[1], T + 16 * j[2], T + 16 * j[3], x, y, z, tx, ty, tz);
+            addTranslation(T + 16 * j[0], T + 16 * j[1], T + 16 * j[2], T + 16 * j[3], tx, ty, tz);
+            pos_x = _mm_add_ps(pos_x, _mm_mul_ps(w, tx));
+            pos_y = _mm_add_ps(pos_y, _mm_mul_ps(w, ty));
+            pos_z = _mm_add_ps(pos_z, _mm_mul_ps(w, tz));
+
+            transformVector(N + 16 * j[0], N + 16 * j[1], N + 16 * j[2], N + 16 * j[3], nx, ny, nz, tx, ty, tz);
+            nrm_x = _mm_add_ps(nrm_x, _mm_mul_ps(w, tx));
+            nrm_y = _mm_add_ps(nrm_y, _mm_mul_ps(w, ty));
+            nrm_z = _mm_add_ps(nrm_z, _mm_mul_ps(w, tz));
+        }
+
+        const __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nrm_x, nrm_x), _mm_mul_ps(nrm_y, nrm_y)), _mm_mul_ps(nrm_z, nrm_z)));
+        nrm_x = _mm_div_ps(nrm_x, len);
+        nrm_y = _mm_div_ps(nrm_y, len);
+        nrm_z = _mm_div_ps(nrm_z, len);
+
+        alignas(16) float out[6][SKIN_BATCH_SIZE];
+        _mm_store_ps(out[0], pos_x);
+        _mm_store_ps(out[1], pos_y);
+        _mm_store_ps(out[2], pos_z);
+        _mm_store_ps(out[3], nrm_x);
+        _mm_store_ps(out[4], nrm_y);
+        _mm_store_ps(out[5], nrm_z);
+
+        const auto lanes = std::min<size_t>(SKIN_BATCH_SIZE, num_vertices_ - base);
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            Vertex &v = result[base + lane];
+            v.position = Vec3f(out[0][lane], out[1][lane], out[2][lane]);
+            v.normal = Vec3f(out[3][lane], out[4][lane], out[5][lane]);
+            // Colors are attributes, not geometry: they pass through unskinned.
+            v.color = colors_[base + lane];
+        }
+    }
+}
+
+void SkinningEngine::skinBatchesDQS(size_t first_batch, size_t end_batch, const float *Q, Vertex *result) const {
+
+    for (size_t b = first_batch; b < end_batch; ++b) {
+        const auto base = b * SKIN_BATCH_SIZE;
+
+        // Blend the dual quaternions of all influences. Quaternions q and -q describe the same
+        // rotation, so each one is flipped into the hemisphere of the vertex's first influence
+        // before blending.
+        __m128 rx = _mm_setzero_ps(), ry = _mm_setzero_ps(), rz = _mm_setzero_ps(), rw = _mm_setzero_ps();
+        __m128 dx = _mm_setzero_ps(), dy = _mm_setzero_ps(), dz = _mm_setzero_ps(), dw = _mm_setzero_ps();
+        __m128 pivot_x = _mm_setzero_ps(), pivot_y = _mm_setzero_ps(), pivot_z = _mm_setzero_ps(), pivot_w = _mm_setzero_ps();
+
+        const auto first = batch_first_[b];
+        for (unsigned k = 0; k < batch_count_[b]; ++k) {
+            const U8 *j = &influence_joints_[(first + k) * SKIN_BATCH_SIZE];
+            __m128 w = loadWeights(&influence_weights_[(first + k) * SKIN_BATCH_SIZE]);
+
+            __m128 qr0 = _mm_loadu_ps(Q + 8 * j[0]), qr1 = _mm_loadu_ps(Q + 8 * j[1]), qr2 = _mm_loadu_ps(Q + 8 * j[2]), qr3 = _mm_loadu_ps(Q + 8 * j[3]);
+            __m128 qd0 = _mm_loadu_ps(Q + 8 * j[0] + 4), qd1 = _mm_loadu_ps(Q + 8 * j[1] + 4), qd2 = _mm_loadu_ps(Q + 8 * j[2] + 4), qd3 = _mm_loadu_ps(Q + 8 * j[3] + 4);
+            _MM_TRANSPOSE4_PS(qr0, qr1, qr2, qr3);
+            _MM_TRANSPOSE4_PS(qd0, qd1, qd2, qd3);
+
+            if (k == 0) {
+                pivot_x = qr0;
+                pivot_y = qr1;
+                pivot_z = qr2;
+                pivot_w = qr3;
+            }
+            const __m128 pivot_dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pivot_x, qr0), _mm_mul_ps(pivot_y, qr1)),
+                                                _mm_add_ps(_mm_mul_ps(pivot_z, qr2), _mm_mul_ps(pivot_w, qr3)));
+            // Flip the sign of the weight where the dot product is negative.
+            const __m128 sign = _mm_and_ps(pivot_dot, _mm_set1_ps(-0.0f));
+            w = _mm_xor_ps(w, sign);
+
+            rx = _mm_add_ps(rx, _mm_mul_ps(w, qr0));
+            ry = _mm_add_ps(ry, _mm_mul_ps(w, qr1));
+            rz = _mm_add_ps(rz, _mm_mul_ps(w, qr2));
+            rw = _mm_add_ps(rw, _mm_mul_ps(w, qr3));
+            dx = _mm_add_ps(dx, _mm_mul_ps(w, qd0));
+            dy = _mm_add_ps(dy, _mm_mul_ps(w, qd1));
+            dz = _mm_add_ps(dz, _mm_mul_ps(w, qd2));
+            dw = _mm_add_ps(dw, _mm_mul_ps(w, qd3));
+        }
+
+        // Normalize by the length of the real part.
+        const __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rx, rx), _mm_mul_ps(ry, ry)),
+                                                  _mm_add_ps(_mm_mul_ps(rz, rz), _mm_mul_ps(rw, rw))));
+        rx = _mm_div_ps(rx, len);
+        ry = _mm_div_ps(ry, len);
+        rz = _mm_div_ps(rz, len);
+        rw = _mm_div_ps(rw, len);
+        dx = _mm_div_ps(dx, len);
+        dy = _mm_div_ps(dy, len);
+        dz = _mm_div_ps(dz, len);
+        dw = _mm_div_ps(dw, len);
+
+        // Translation: t = 2 (r.w d.xyz - d.w r.xyz + r.xyz x d.xyz).
+        __m128 tx, ty, tz;
+        crossLanes(rx, ry, rz, dx, dy, dz, tx, ty, tz);
+        const __m128 two = _mm_set1_ps(2.0f);
+        tx = _mm_mul_ps(two, _mm_add_ps(tx, _mm_sub_ps(_mm_mul_ps(rw, dx), _mm_mul_ps(dw, rx))));
+        ty = _mm_mul_ps(two, _mm_add_ps(ty, _mm_sub_ps(_mm_mul_ps(rw, dy), _mm_mul_ps(dw, ry))));
+        tz = _mm_mul_ps(two, _mm_add_ps(tz, _mm_sub_ps(_mm_mul_ps(rw, dz), _mm_mul_ps(dw, rz))));
+
+        __m128 pos_x = _mm_loadu_ps(&px_[base]), pos_y = _mm_loadu_ps(&py_[base]), pos_z = _mm_loadu_ps(&pz_[base]);
+        rotateLanes(rx, ry, rz, rw, pos_x, pos_y, pos_z);
+        pos_x = _mm_add_ps(pos_x, tx);
+        pos_y = _mm_add_ps(pos_y, ty);
+        pos_z = _mm_add_ps(pos_z, tz);
+
+        // Rotations keep unit normals unit length.
+        __m128 nrm_x = _mm_loadu_ps(&nx_[base]), nrm_y = _mm_loadu_ps(&ny_[base]), nrm_z = _mm_loadu_ps(&nz_[base]);
+        rotateLanes(rx, ry, rz, rw, nrm_x, nrm_y, nrm_z);
+
+        alignas(16) float out[6][SKIN_BATCH_SIZE];
+        _mm_store_ps(out[0], pos_x);
+        _mm_store_ps(out[1], pos_y);
+        _mm_store_ps(out[2], pos_z);
+        _mm_store_ps(out[3], nrm_x);
+        _mm_store_ps(out[4], nrm_y);
+        _mm_store_ps(out[5], nrm_z);
+
+        const auto lanes = std::min<size_t>(SKIN_BATCH_SIZE, num_vertices_ - base);
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            Vertex &v = result[base + lane];
+            v.position = Vec3f(out[0][lane], out[1][lane], out[2][lane]);
+            v.normal = Vec3f(out[3][lane], out[4][lane], out[5][lane]);
+            v.color = colors_[base + lane];
+        }
+    }
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "skeleton.hpp"
+
+#include "base/MulticoreLauncher.hpp"
+
+#include <vector>
+
+namespace FW {
+
+struct Vertex
+{
+	Vec3f position;
+	Vec3f normal;
+	Vec3f color;
+};
+
+// A vertex of the bind pose mesh with its skinning influences in compact form.
+// Only the first num_influences entries of joints and weights are used; they hold the
+// nonzero influences in order of decreasing weight, and the rest is zero. Weights are
+// stored as 16 bit fixed point (weight = weights[i] / SKIN_WEIGHT_ONE) that sum to exactly
+// SKIN_WEIGHT_ONE. The influences take 25 bytes instead of 64, and with the padding to
+// 4-byte alignment the whole vertex takes 64 bytes instead of 100. Every vertex has room for
+// WEIGHTS_PER_VERTEX influences however few it uses, since the GPU path reads them as fixed
+// vertex attributes; SkinningEngine keeps only the used ones.
+static const unsigned SKIN_WEIGHT_ONE = 65535u;
+
+struct WeightedVertex
+{
+	Vec3f	position;
+	Vec3f	normal;
+	Vec3f	color;
+	U8		joints[WEIGHTS_PER_VERTEX];
+	U16		weights[WEIGHTS_PER_VERTEX];
+	U8		num_influences;
+};
+static_assert(sizeof(WeightedVertex) == 64, "WeightedVertex is expected to pad to 64 bytes");
+
+// Packs WEIGHTS_PER_VERTEX joint indices and float weights into the compact form of v.
+// Zero weights are dropped and the rest are normalized to sum up to one.
+void setInfluences(WeightedVertex& v, const int* joints, const float* weights);
+inline float getInfluenceWeight(const WeightedVertex& v, unsigned i) { return float(v.weights[i]) * (1.0f / float(SKIN_WEIGHT_ONE)); }
+
+// CPU skinning of a weighted mesh.
+// The source vertices are converted once into a SIMD friendly layout: vertices are
+// grouped into batches of SKIN_BATCH_SIZE, positions and normals are stored as
+// separate x/y/z arrays, and the influences of each vertex (8 bit joint index and
+// 16 bit weight each) are interleaved over the lanes of its batch. Each frame the per-joint matrices
+// (and the inverse transposes used for the normals) are computed once, after which
+// every batch is skinned with 4-wide SSE arithmetic.
+//
+// Two skinning methods are available: linear blend skinning (LBS), which blends the
+// 4x4 joint matrices, and dual quaternion skinning (DQS), which blends one unit dual
+// quaternion (8 floats) per joint and therefore preserves volume around bent joints.
+static const unsigned SKIN_BATCH_SIZE = 4u;
+// In multithreaded mode the batches of each instance are split into chunks of this
+// many batches, one MulticoreLauncher task per chunk.
+static const unsigned SKIN_CHUNK_BATCHES = 512u;
+
+class SkinningEngine
+{
+public:
+	enum SkinningMode
+	{
+		SKINNING_LBS,
+		SKINNING_DQS
+	};
+
+							SkinningEngine() {}
+
+	void					setSource(const std::vector<WeightedVertex>& source);
+	size_t					getNumVertices() const { return num_vertices_; }
+
+	void					setMultithreaded(bool multithreaded) { multithreaded_ = multithreaded; }
+	bool					isMultithreaded() const { return multithreaded_; }
+
+	void					setMode(SkinningMode mode) { mode_ = mode; }
+	SkinningMode			getMode() const { return mode_; }
+
+	// Skins the mesh into the back output buffer and makes it the front one.
+	// The returned array is reused: it stays valid until the second call after
+	// this one, so it can be uploaded while the next frame is being skinned.
+	const std::vector<Vertex>&	skin(const std::vector<Mat4f>& ssd_transforms);
+
+	// Linear blend skinning with the given T_i * inv(B_i) matrices.
+	// result must have room for getNumVertices() vertices.
+	void					skinLBS(const std::vector<Mat4f>& ssd_transforms, Vertex* result);
+	// Dual quaternion skinning. The T_i * inv(B_i) matrices must be rigid.
+	void					skinDQS(const std::vector<Mat4f>& ssd_transforms, Vertex* result);
+
+	// Skins num_instances copies of the mesh with the current mode, all in one batch of tasks.
+	// Instance i uses the num_joints matrices starting at palettes + i * num_joints and writes
+	// getNumVertices() vertices starting at result + i * getNumVertices(). If models is given,
+	// the skinned vertices of instance i are then placed with models[i]. The palettes must be
+	// rigid for DQS, so any scale belongs in the models, which may scale uniformly, rotate and translate.
+	void					skinInstances(const Mat4f* palettes, size_t num_joints, size_t num_instances, Vertex* result, const Mat4f* models = nullptr);
+
+private:
+							SkinningEngine(const SkinningEngine&); // forbid copy
+	SkinningEngine&			operator=(const SkinningEngine&); // forbid assignment
+
+	void					skinInstances(SkinningMode mode, const Mat4f* palettes, size_t num_joints, size_t num_instances, Vertex* result, const Mat4f* models = nullptr);
+	void					updateJointMatrices(const Mat4f* transforms, size_t count);
+	void					updateDualQuaternions(const Mat4f* transforms, size_t count);
+	void					skinInstanceBatches(size_t instance, size_t first_batch, size_t end_batch) const;
+	void					skinBatchesLBS(size_t first_batch, size_t end_batch, const float* T, const float* N, Vertex* result) const;
+	void					skinBatchesDQS(size_t first_batch, size_t end_batch, const float* Q, Vertex* result) const;
+	void					placeBatches(size_t first_batch, size_t end_batch, const Mat4f& model, Vertex* result) const;
+
+	static void				skinChunkTask(MulticoreLauncher::Task& task);
+
+	size_t					num_vertices_ = 0;
+
+	// Bind pose positions and normals, padded to a whole number of batches.
+	std::vector<float>		px_, py_, pz_;
+	std::vector<float>		nx_, ny_, nz_;
+	std::vector<Vec3f>		colors_;
+
+	// Influences of batch b live in slots [batch_first_[b], batch_first_[b] + batch_count_[b]).
+	// Each slot holds one joint index and weight per lane; lanes with fewer influences
+	// than the longest one in their batch are padded with zero weights.
+	std::vector<unsigned>	batch_first_;
+	std::vector<unsigned>	batch_count_;
+	std::vector<U8>			influence_joints_;
+	std::vector<U16>		influence_weights_;
+
+	// Per-joint matrices of all instances for the current frame.
+	std::vector<Mat4f>		joint_transforms_;
+	std::vector<Mat4f>		normal_transforms_;
+	// Unit dual quaternion of each joint: real part (x, y, z, w) followed by dual part (x, y, z, w).
+	std::vector<float>		joint_dual_quats_;
+
+	// Double-buffered output, allocated once per mesh.
+	std::vector<Vertex>		output_[2];
+	unsigned				front_output_ = 0;
+
+	// Parameters of the skinning pass currently in flight.
+	SkinningMode			task_mode_ = SKINNING_LBS;
+	size_t					task_joints_ = 0;
+	size_t					task_chunks_ = 0;		// chunks per instance
+	Vertex*					task_result_ = nullptr;
+	const Mat4f*			task_models_ = nullptr;
+
+	SkinningMode			mode_ = SKINNING_LBS;
+	bool					multithreaded_ = true;
+	// Kept alive so that the worker threads persist between frames.
+	MulticoreLauncher		launcher_;
+};
+
+} // namespace FW
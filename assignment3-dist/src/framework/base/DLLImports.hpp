@@ -177,6 +177,7 @@ typedef unsigned int    GLhandleARB;
 #define GL_RGBA32UI                         0x8D70
 #define GL_RGBA_INTEGER                     0x8D99
 #define GL_STATIC_DRAW                      0x88E4
+#define GL_DYNAMIC_DRAW                     0x88E8
 #define GL_DYNAMIC_COPY                     0x88EA
 #define GL_TEXTURE0                         0x84C0
 #define GL_TEXTURE1                         0x84C1
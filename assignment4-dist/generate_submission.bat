@@ -9,6 +9,8 @@ xcopy /q /s shaders "%TEMP%.\cs_c3100_submit\shaders\"
 xcopy /q assignment.sln %TEMPDIR%
 xcopy /q assignment.vcxproj %TEMPDIR%
 xcopy /q assignment.vcxproj.filters %TEMPDIR%
+xcopy /q benchmark.vcxproj %TEMPDIR%
+xcopy /q benchmark.vcxproj.filters %TEMPDIR%
 xcopy /q framework.vcxproj %TEMPDIR%
 xcopy /q framework.vcxproj.filters %TEMPDIR%
 xcopy /q README.txt %TEMPDIR%
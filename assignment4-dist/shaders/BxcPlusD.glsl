@@ -41,17 +41,18 @@ layout(std140, binding=3) uniform params
 	int w, h;
 };
 
+// Step of the current dispatch
+uniform float c;
+
 void main() 
 {
 	int idx = int(gl_GlobalInvocationID.y * w + gl_GlobalInvocationID.x);
 
 	if (gl_GlobalInvocationID.y < h && gl_GlobalInvocationID.x < w)
 	{
-		// YOUR CODE HERE (compute extra):
-		// Evaluate A = B * dt + C
-
-		// A[idx].pos = ...
-		// A[idx].vel = ...
+		// Evaluate A = B * c + C. A may be the same buffer as C.
+		A[idx].pos = B[idx].pos * c + C[idx].pos;
+		A[idx].vel = B[idx].vel * c + C[idx].vel;
 
 	}
 }
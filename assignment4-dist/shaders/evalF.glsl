@@ -74,11 +74,20 @@ float springLengths[] = { 1.0f, sqrt(2.0f), 2.0f };
 // Using a shared memory block allows us to compute spring forces in parallel for all 12 springs connected to a single particle
 shared vec3 forces[SIZE_X * SIZE_Z];
 
+// Wind velocity, same as in CpuCloth
+const vec3 wind = vec3(0, 0, 20);
+
+// Position of the particle at grid point (x, y), clamped to the edges of the cloth
+vec3 clampedPos(int x, int y)
+{
+	return state[clamp(y, 0, h - 1) * w + clamp(x, 0, w - 1)].pos;
+}
+
 // The given local block sizes mean that we will have blocks of 16x1x12 threads. Each block handles 16 particles, and 
-// each particle has 12 threads assiciated with it, one thread for each spring. This shader should evaluate each spring
-// force separately and write the result into shared memory, at which point the first thread of each particle computes
-// the resulting acceleration and writes it to global memory. This may not be the fastest way to do it, and you should feel
-// free to experiment with other threading schemes.
+// each particle has 12 threads assiciated with it, one thread for each spring. Each thread evaluates one spring force
+// and writes the result into shared memory, at which point the first thread of each particle sums them up in the order
+// of the spring table, adds the other forces, and writes the derivative to global memory. The forces are the ones
+// documented in CpuCloth, which evaluates the same model on the CPU.
 void main() 
 {
 	// Shorthands for easier use
@@ -89,14 +98,19 @@ void main()
 	// Index of current particle in state table
 	int i = y * w + x;
 
-	if (x < w && y < h) // Make sure we're inside bounds
-	{
-		// Initialize force of current thread to zero
-		forces[SIZE_Z * gl_LocalInvocationID.x + z] = vec3(0);
+	// The threads past the edge of the cloth still have to reach the barrier below
+	bool inside = x < w && y < h;
 
+	vec3 pos = vec3(0), vel = vec3(0);
+
+	// Initialize force of current thread to zero
+	forces[SIZE_Z * gl_LocalInvocationID.x + z] = vec3(0);
+
+	if (inside)
+	{
 		// Read position and velocity beforehand for easy access
-		vec3 pos = state[i].pos;
-		vec3 vel = state[i].vel;
+		pos = state[i].pos;
+		vel = state[i].vel;
 
 		// spring end point coordinates
 		int end_x = x + springs[z * 2 + 0];
@@ -105,29 +119,67 @@ void main()
 		// spring end point particle index in state table
 		int end_i = end_y * w + end_x;
 
-		if (end_x >= 0 && end_x < w && end_y >= 0 && end_y < h)
+		if (end_x >= 0 && end_x < w && end_y >= 0 && end_y < h && broken[i * 12 + z] == 0)
 		{
+			float rest = springLengths[z / 4] * scale;
+			vec3 d = state[end_i].pos - pos;
+			float len = length(d);
+
+			// Break overstretched springs before they exert any force. The spring of the other
+			// end sees the same length, so it breaks at the same time.
+			if (len > springBreakThreshold * rest)
+				broken[i * 12 + z] = 1;
+			else
+			{
+				vec3 n = d / len;
+				forces[SIZE_Z * gl_LocalInvocationID.x + z] = (springK * (len - rest) + springDamp * dot(state[end_i].vel - vel, n)) * n;
+			}
+		}
+	}
 
-			// YOUR CODE HERE (compute cloth):
-			// Evaluate spring force for each spring in the cloth and write it to shared memory. 
+	// Sync our thread block. All threads in the current block will wait here until every thread has reached this point
+	// After this sync we know that all spring forces have been computed and we can proceed to write results
+	barrier();
 
-			// forces[SIZE_Z * gl_LocalInvocationID.x + z] = ...
+	// Only first thread for each particle in z-direction should write to global memory
+	if (inside && z == 0)
+	{
+		vec3 force = vec3(0, -9.81, 0) * mass; // G = g*m
 
-		}
+		for (int s = 0; s < SIZE_Z; ++s)
+			force += forces[SIZE_Z * gl_LocalInvocationID.x + s];
 
-		// Sync our thread block. All threads in the current block will wait here until every thread has reached this point
-		// After this sync we know that all spring forces have been computed and we can proceed to write results
-		barrier();
+		// Drag
+		force -= dragK * vel;
 
-		// Only first thread for each particle in z-direction should write to global memory
-		if (z == 0)
+		// Wind against the surface normal, from central differences clamped at the borders
+		vec3 normal = cross(clampedPos(x + 1, y) - clampedPos(x - 1, y), clampedPos(x, y + 1) - clampedPos(x, y - 1));
+		if (dot(normal, normal) > 0)
 		{
-			vec3 acceleration = vec3(0, -9.81, 0) * mass; // G = g*m
+			normal /= length(normal);
+			force += windStrength * dot(normal, wind - vel) * normal;
+		}
 
-			// YOUR CODE HERE (compute cloth):
-			// Sum together the forces computed earlier to get acceleration for current particle, then write derivatives of position and velocity
-			// to the results buffer.
+		// Bullet
+		vec3 d = pos - bulletPos.xyz;
+		float len2 = dot(d, d);
+		if (len2 < bulletR * bulletR && len2 > 0)
+		{
+			float len = sqrt(len2);
+			vec3 n = d / len;
+			force += (springK * (bulletR - len) + springDamp * dot(bulletVel.xyz - vel, n)) * n;
+		}
 
+		// The first row of the cloth is held in place
+		if (y == 0)
+		{
+			result[i].pos = vec3(0);
+			result[i].vel = vec3(0);
+		}
+		else
+		{
+			result[i].pos = vel;
+			result[i].vel = force / mass;
 		}
 	}
 }
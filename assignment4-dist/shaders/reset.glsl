@@ -36,11 +36,11 @@ void main()
 
 	if (gl_GlobalInvocationID.y < h && gl_GlobalInvocationID.x < w)
 	{
-		// YOUR CODE HERE (compute extra):
-		// Write the initial state of the cloth system into the state buffer.
-
-		// state[idx].pos = ...
-		// state[idx].vel = ...
+		// Grid laid out like ClothSystem, same as CpuCloth::Reset. The first row is held in place by evalF.
+		int x = int(gl_GlobalInvocationID.x);
+		int y = int(gl_GlobalInvocationID.y);
+		state[idx].pos = vec3((x - 0.5f * (w - 1)) * scale, 0, -y * scale);
+		state[idx].vel = vec3(0);
 
 	}
 }
@@ -0,0 +1,61 @@
+#ifdef ComputeShader
+
+
+layout (local_size_x = 16, local_size_y = 16) in;
+
+struct clothState
+{
+	vec3 pos, vel;
+};
+
+layout (std430, binding=0) buffer state_a
+{ 
+	clothState A[];
+};
+
+layout (std430, binding=1) buffer state_b
+{ 
+	clothState B[];
+};
+
+layout (std430, binding=2) buffer state_d
+{ 
+	clothState C[];
+};
+
+layout(std140, binding=3) uniform params
+{
+	float springK;
+	float springDamp;
+	float dragK;
+	float windStrength;
+	float springBreakThreshold;
+	float scale;
+	float dt;
+
+	// Bullet projectile data
+	float bulletR;
+	vec4 bulletPos;
+	vec4 bulletVel;
+	
+	int w, h;
+};
+
+// Step of the current dispatch
+uniform float c;
+
+void main() 
+{
+	int idx = int(gl_GlobalInvocationID.y * w + gl_GlobalInvocationID.x);
+
+	if (gl_GlobalInvocationID.y < h && gl_GlobalInvocationID.x < w)
+	{
+		// Symplectic Euler step from state C with derivative B: the position moves with the new velocity.
+		// A may be the same buffer as C.
+		A[idx].vel = B[idx].vel * c + C[idx].vel;
+		A[idx].pos = A[idx].vel * c + C[idx].pos;
+
+	}
+}
+
+#endif
@@ -35,18 +35,35 @@ App::App(void)
       camera_rotation_angle_(0.0f),
       step_(0.0001f),
       steps_per_update_(5),
+      cloth_substeps_(1),
+      xpbd_iterations_(10),
+      adaptive_tolerance_(1e-3f),
+      matrix_free_(false),
       integrator_(MIDPOINT_INTEGRATOR),
+      previous_integrator_(MIDPOINT_INTEGRATOR),
+      previous_step_(0.0f), // differs from step_, so that the first event applies the settings
       ps_type_(SIMPLE_SYSTEM),
       ps_(&simple_system_),
+      indexed_system_(nullptr),
+      indexed_topology_(0),
       timer_(true),
       simple_system_(),
       spring_system_(),
       pendulum_system_(10),
       cloth_system_(20, 20),
       sprinkler_(),
+      fluid_system_(4096),
       wind_(false),
       wind_changed_(false),
-      initial_implicit_(false) {
+      cloth_collisions_(false),
+      cloth_collisions_changed_(false),
+      parallel_(false),
+      parallel_changed_(false),
+      realtime_(false),
+      realtime_changed_(false),
+      initial_implicit_(false),
+      simulated_system_(SIMPLE_SYSTEM),
+      simulated_integrator_(MIDPOINT_INTEGRATOR) {
     static_assert(is_standard_layout<Vertex>::value, "struct Vertex must be standard layout to use offsetof");
     initRendering();
 
@@ -56,6 +73,8 @@ App::App(void)
     common_ctrl_.addToggle((S32 *) &ps_type_, PENDULUM_SYSTEM, FW_KEY_3, "R4 Pendulum system (3)", &system_changed_);
     common_ctrl_.addToggle((S32 *) &ps_type_, CLOTH_SYSTEM, FW_KEY_4, "R5 Cloth system (4)", &system_changed_);
     common_ctrl_.addToggle((S32 *) &ps_type_, SPRINKLER_SYSTEM, FW_KEY_5, "Extra Sprinkler system (5)", &system_changed_);
+    common_ctrl_.addToggle((S32 *) &ps_type_, FLUID_SYSTEM, FW_KEY_NONE, "EXTRA: SPH fluid", &system_changed_);
+    common_ctrl_.addToggle((S32 *) &ps_type_, CPU_CLOTH, FW_KEY_NONE, "EXTRA: CPU version of compute cloth", &system_changed_);
 #ifdef COMPUTE_CLOTH_MODULE
     common_ctrl_.addToggle((S32 *) &ps_type_, COMPUTE_CLOTH, FW_KEY_NONE, "EXTRA: Compute cloth", &system_changed_);
 #endif
@@ -69,18 +88,29 @@ App::App(void)
     common_ctrl_.addToggle((S32 *) &integrator_, IMPLICIT_EULER_INTEGRATOR, FW_KEY_9, "EXTRA: Implicit Euler integrator (9)");
     common_ctrl_.addToggle((S32 *) &integrator_, IMPLICIT_MIDPOINT_INTEGRATOR, FW_KEY_0, "EXTRA: Implicit midpoint integrator (0)");
     common_ctrl_.addToggle((S32 *) &integrator_, CRANK_NICOLSON_INTEGRATOR, FW_KEY_PLUS, "EXTRA: Crank-Nicolson integrator (+)");
+    common_ctrl_.addToggle((S32 *) &integrator_, XPBD_INTEGRATOR, FW_KEY_X, "EXTRA: XPBD integrator for springs (X)");
+    common_ctrl_.addToggle((S32 *) &integrator_, ADAPTIVE_INTEGRATOR, FW_KEY_D, "EXTRA: Adaptive Dormand-Prince integrator (D)");
+#ifdef EIGEN_SPARSECORE_MODULE_H
+    common_ctrl_.addToggle(&matrix_free_, FW_KEY_M, "EXTRA: Matrix-free conjugate gradients for implicit springs (M)");
+#endif
 #ifdef COMPUTE_CLOTH_MODULE
     common_ctrl_.addToggle((S32 *) &integrator_, COMPUTE_CLOTH_INTEGRATOR, FW_KEY_NONE, "EXTRA: Compute integrator for cloth");
 #endif
     common_ctrl_.addSeparator();
     common_ctrl_.addToggle(&shading_toggle_, FW_KEY_T, "Toggle cloth rendering mode (T)", &shading_mode_changed_);
     common_ctrl_.addToggle(&wind_, FW_KEY_W, "Toggle wind (W)", &wind_changed_);
+    common_ctrl_.addToggle(&cloth_collisions_, FW_KEY_C, "EXTRA: Toggle cloth collisions (C)", &cloth_collisions_changed_);
+    common_ctrl_.addToggle(&parallel_, FW_KEY_P, "Toggle multithreaded evaluation (P)", &parallel_changed_);
+    common_ctrl_.addToggle(&realtime_, FW_KEY_R, "EXTRA: Simulate in real time on a separate thread (R)", &realtime_changed_);
 #ifdef COMPUTE_CLOTH_MODULE
     common_ctrl_.addButton(&fireBullet, FW_KEY_SPACE, "EXTRA: Fire bullet from mouse position (SPACE)");
 #endif
     common_ctrl_.beginSliderStack();
     common_ctrl_.addSlider((F32 *) &step_, 0.00001, 0.05, true, FW_KEY_NONE, FW_KEY_NONE, "Step size: %.4f", 0.0f);
     common_ctrl_.addSlider((S32 *) &steps_per_update_, 1, 100, false, FW_KEY_NONE, FW_KEY_NONE, "Steps per update: %d");
+    common_ctrl_.addSlider((S32 *) &cloth_substeps_, 1, 16, false, FW_KEY_NONE, FW_KEY_NONE, "EXTRA: Cloth sub-steps per step: %d");
+    common_ctrl_.addSlider((S32 *) &xpbd_iterations_, 1, 50, false, FW_KEY_NONE, FW_KEY_NONE, "EXTRA: XPBD iterations per sub-step: %d");
+    common_ctrl_.addSlider((F32 *) &adaptive_tolerance_, 1e-6f, 1e-1f, true, FW_KEY_NONE, FW_KEY_NONE, "EXTRA: Adaptive integrator tolerance: %.1e");
     common_ctrl_.endSliderStack();
     window_.setTitle("Assignment 4");
 
@@ -95,11 +125,23 @@ App::App(void)
 #endif
 
 #ifdef EIGEN_SPARSECORE_MODULE_H
-    ps_J_ = Eigen::SparseMatrix<float>(int(ps_->state().size() * 3), int(ps_->state().size() * 3));
+    ps_J_ = SparseMatrix(ps_->state().size() * 3, ps_->state().size() * 3);
 #endif
 }
 
-bool App::handleEvent(const Window::Event &ev) {
+bool App::settingsChanged() const {
+    // The controls change the members on this thread; the copies the simulation reads only change
+    // in applySettings().
+    return system_changed_ || wind_changed_ || cloth_collisions_changed_ || parallel_changed_ || integrator_ != previous_integrator_ ||
+           step_ != previous_step_ || cloth_substeps_ != integrator_workspace_.xpbd.substeps ||
+           xpbd_iterations_ != integrator_workspace_.xpbd.iterations || adaptive_tolerance_ != integrator_workspace_.adaptive.tolerance
+#ifdef EIGEN_SPARSECORE_MODULE_H
+           || matrix_free_ != integrator_workspace_.matrix_free
+#endif
+        ;
+}
+
+void App::applySettings() {
     if (system_changed_) {
         system_changed_ = false;
         switch (ps_type_) {
@@ -118,6 +160,13 @@ bool App::handleEvent(const Window::Event &ev) {
             case SPRINKLER_SYSTEM:
                 ps_ = &sprinkler_;
                 break;
+            case FLUID_SYSTEM:
+                ps_ = &fluid_system_;
+                break;
+            case CPU_CLOTH:
+                integrator_ = CPU_CLOTH_INTEGRATOR;
+                cpu_cloth_.Reset(); // CpuCloth doesn't inherit from ParticleSystem either
+                break;
 #ifdef COMPUTE_CLOTH_MODULE
             case COMPUTE_CLOTH:
                 integrator_ = COMPUTE_CLOTH_INTEGRATOR;
@@ -128,17 +177,14 @@ bool App::handleEvent(const Window::Event &ev) {
                 assert(false && "invalid system type");
         }
         ps_->reset();
+        simulated_system_ = ps_type_;
         initial_implicit_ = true;
+        integrator_workspace_.adaptive = AdaptiveStepControl();
 #ifdef EIGEN_SPARSECORE_MODULE_H
         ps_J_ = SparseMatrix(ps_->state().size() * 3, ps_->state().size() * 3);
 #endif
     }
 
-    if (shading_mode_changed_) {
-        common_ctrl_.message(shading_toggle_ ? "EXTRA: Surface rendering" : "Wireframe rendering");
-        shading_mode_changed_ = false;
-    }
-
     // EXTRA: Wind
     if (wind_changed_) {
         common_ctrl_.message(wind_ ? "It's a windy day!" : "Where did all the wind go?");
@@ -150,6 +196,84 @@ bool App::handleEvent(const Window::Event &ev) {
         wind_changed_ = false;
     }
 
+    // EXTRA: Collisions
+    if (cloth_collisions_changed_) {
+        common_ctrl_.message(cloth_collisions_ ? "Cloth collides with itself and the scene" : "Cloth collisions off");
+        this->cloth_system_.setCollisions(cloth_collisions_);
+        cloth_collisions_changed_ = false;
+    }
+
+    if (parallel_changed_) {
+        common_ctrl_.message(parallel_ ? "Multithreaded evaluation" : "Single-threaded evaluation");
+        for (ParticleSystem *ps : {(ParticleSystem *) &simple_system_, (ParticleSystem *) &spring_system_, (ParticleSystem *) &pendulum_system_,
+                                   (ParticleSystem *) &cloth_system_, (ParticleSystem *) &sprinkler_, (ParticleSystem *) &fluid_system_})
+            ps->setParallel(parallel_);
+        cpu_cloth_.SetParallel(parallel_);
+        parallel_changed_ = false;
+    }
+
+    if (integrator_ != previous_integrator_ || step_ != previous_step_) {
+        initial_implicit_ = true;
+        integrator_workspace_.adaptive = AdaptiveStepControl();
+#ifdef EIGEN_SPARSECORE_MODULE_H
+        ps_J_ = SparseMatrix(ps_->state().size() * 3, ps_->state().size() * 3);
+#endif
+    }
+    previous_integrator_ = integrator_;
+    previous_step_ = step_;
+    simulated_integrator_ = integrator_;
+    cpu_cloth_.substeps = cloth_substeps_;
+#ifdef COMPUTE_CLOTH_MODULE
+    compute_cloth_.substeps = cloth_substeps_;
+#endif
+    integrator_workspace_.xpbd.substeps = cloth_substeps_;
+    integrator_workspace_.xpbd.iterations = xpbd_iterations_;
+    integrator_workspace_.adaptive.tolerance = adaptive_tolerance_;
+#ifdef EIGEN_SPARSECORE_MODULE_H
+    integrator_workspace_.matrix_free = matrix_free_;
+#endif
+    scheduler_.setTimeStep(step_);
+}
+
+bool App::handleEvent(const Window::Event &ev) {
+    if (shading_mode_changed_) {
+        common_ctrl_.message(shading_toggle_ ? "EXTRA: Surface rendering" : "Wireframe rendering");
+        shading_mode_changed_ = false;
+    }
+
+    // EXTRA: The simulation thread, when running, waits between two batches of steps while the
+    // systems and its settings change. Events that change none of them, paints included, leave it
+    // running and take no lock.
+    if (settingsChanged()) {
+        scheduler_.enter();
+        applySettings();
+        scheduler_.leave();
+    }
+    if (scheduler_.isRunning())
+        common_ctrl_.message(sprintf("Simulating %d steps per second", scheduler_.getStepsPerSecond()), "simulation rate");
+    if (integrator_ == ADAPTIVE_INTEGRATOR) {
+        // The simulation thread copies its statistics into the snapshots.
+        const auto &adaptive = scheduler_.isRunning() ? scheduler_.acquire().adaptive : integrator_workspace_.adaptive;
+        common_ctrl_.message(sprintf("Adaptive steps: %d accepted, %d rejected, %d evaluations, next %.2e", adaptive.accepted, adaptive.rejected,
+                                     adaptive.evaluations, adaptive.next_step),
+                             "adaptive stats");
+    }
+
+    // EXTRA: Real-time simulation on a separate thread
+    if (realtime_changed_) {
+        common_ctrl_.message(realtime_ ? "Simulating in real time on a separate thread" : "Simulating a fixed number of steps per update");
+        if (realtime_)
+            scheduler_.start(
+                [this](float step) {
+                    if (simulated_integrator_ != COMPUTE_CLOTH_INTEGRATOR)
+                        advance(simulated_integrator_, step);
+                },
+                [this](SimulationScheduler::Snapshot &snapshot) { capture(snapshot); });
+        else
+            scheduler_.stop();
+        realtime_changed_ = false;
+    }
+
     if (ev.type == Window::EventType_KeyDown) {
         if (ev.key == FW_KEY_HOME)
             camera_rotation_angle_ -= 0.05 * FW_PI;
@@ -175,50 +299,20 @@ bool App::handleEvent(const Window::Event &ev) {
 
     window_.setVisible(true);
     if (ev.type == Window::EventType_Paint) {
-        if (integrator_ != previous_integrator_ || step_ != previous_step_) {
-            initial_implicit_ = true;
-#ifdef EIGEN_SPARSECORE_MODULE_H
-            ps_J_ = SparseMatrix(ps_->state().size() * 3, ps_->state().size() * 3);
-#endif
+        // EXTRA: In real time the simulation thread takes the steps, except for the compute
+        // cloth, whose steps need the GL context of this thread. They go straight to the compute
+        // cloth, which the simulation thread leaves alone, and not through advance(), whose other
+        // state it shares.
+        if (!scheduler_.isRunning()) {
+            for (int i = 0; i < steps_per_update_; ++i)
+                advance(integrator_, step_);
         }
-
-        for (int i = 0; i < steps_per_update_; ++i) {
-            switch (integrator_) {
-                case EULER_INTEGRATOR:
-                    eulerStep(*ps_, step_);
-                    break;
-                case TRAPEZOID_INTEGRATOR:
-                    trapezoidStep(*ps_, step_);
-                    break;
-                case MIDPOINT_INTEGRATOR:
-                    midpointStep(*ps_, step_);
-                    break;
-                case RK4_INTEGRATOR:
-                    rk4Step(*ps_, step_);
-                    break;
-#ifdef EIGEN_SPARSECORE_MODULE_H
-                case IMPLICIT_EULER_INTEGRATOR:
-                    implicit_euler_step(*ps_, step_, ps_J_, implicit_solver_, initial_implicit_);
-                    break;
-                case IMPLICIT_MIDPOINT_INTEGRATOR:
-                    implicit_midpoint_step(*ps_, step_, ps_J_, implicit_solver_, initial_implicit_);
-                    break;
-                case CRANK_NICOLSON_INTEGRATOR:
-                    crank_nicolson_step(*ps_, step_, ps_J_, implicit_solver_, initial_implicit_);
-                    break;
-#endif
 #ifdef COMPUTE_CLOTH_MODULE
-                case COMPUTE_CLOTH_INTEGRATOR:
-                    compute_cloth_.Advance(step_);
-                    break;
-#endif
-                default:
-                    assert(false && " invalid integrator type");
-            }
-            initial_implicit_ = false;
+        else if (integrator_ == COMPUTE_CLOTH_INTEGRATOR) {
+            for (int i = 0; i < steps_per_update_; ++i)
+                compute_cloth_.Advance(step_);
         }
-        previous_integrator_ = integrator_;
-        previous_step_ = step_;
+#endif
 
         render();
     }
@@ -228,6 +322,75 @@ bool App::handleEvent(const Window::Event &ev) {
     return false;
 }
 
+void App::advance(IntegratorType integrator, float step) {
+    switch (integrator) {
+        case EULER_INTEGRATOR:
+            eulerStep(*ps_, step, integrator_workspace_);
+            break;
+        case TRAPEZOID_INTEGRATOR:
+            trapezoidStep(*ps_, step, integrator_workspace_);
+            break;
+        case MIDPOINT_INTEGRATOR:
+            midpointStep(*ps_, step, integrator_workspace_);
+            break;
+        case RK4_INTEGRATOR:
+            rk4Step(*ps_, step, integrator_workspace_);
+            break;
+        case XPBD_INTEGRATOR:
+            xpbdStep(*ps_, step, integrator_workspace_);
+            break;
+        case ADAPTIVE_INTEGRATOR:
+            adaptiveStep(*ps_, step, integrator_workspace_);
+            break;
+#ifdef EIGEN_SPARSECORE_MODULE_H
+        case IMPLICIT_EULER_INTEGRATOR:
+            implicit_euler_step(*ps_, step, ps_J_, implicit_solver_, initial_implicit_, integrator_workspace_);
+            break;
+        case IMPLICIT_MIDPOINT_INTEGRATOR:
+            implicit_midpoint_step(*ps_, step, ps_J_, implicit_solver_, initial_implicit_, integrator_workspace_);
+            break;
+        case CRANK_NICOLSON_INTEGRATOR:
+            crank_nicolson_step(*ps_, step, ps_J_, implicit_solver_, initial_implicit_, integrator_workspace_);
+            break;
+#endif
+        case CPU_CLOTH_INTEGRATOR:
+            cpu_cloth_.Advance(step);
+            break;
+#ifdef COMPUTE_CLOTH_MODULE
+        case COMPUTE_CLOTH_INTEGRATOR:
+            compute_cloth_.Advance(step);
+            break;
+#endif
+        default:
+            assert(false && " invalid integrator type");
+    }
+    initial_implicit_ = false;
+}
+
+void App::capture(SimulationScheduler::Snapshot &snapshot) {
+    // The points and lines that render() draws, copied into the storage of the snapshot.
+    snapshot.adaptive = integrator_workspace_.adaptive;
+    RenderView view;
+    if (simulated_system_ == CPU_CLOTH) {
+        cpu_cloth_.GetPositions(snapshot.points);
+        snapshot.lines.clear();
+    } else if (ps_->getRenderView(view)) {
+        snapshot.points.resize(view.num_points);
+        for (unsigned i = 0; i < view.num_points; ++i)
+            snapshot.points[i] = view.position(i);
+        snapshot.lines.clear();
+        if (view.line_indices) {
+            for (auto i : *view.line_indices)
+                snapshot.lines.push_back(view.position(i));
+        }
+        if (view.static_lines)
+            snapshot.lines.insert(snapshot.lines.end(), view.static_lines->begin(), view.static_lines->end());
+    } else {
+        snapshot.points = ps_->getPoints();
+        snapshot.lines = ps_->getLines();
+    }
+}
+
 void App::initRendering() {
     // Ask the Nvidia framework for the GLContext object associated with the window.
     // As a side effect, this initializes the OpenGL context and lets us call GL functions.
@@ -249,6 +412,14 @@ void App::initRendering() {
     glBindVertexArray(gl_.point_vao);
     glEnableVertexAttribArray(ATTRIB_POSITION);
     glVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, sizeof(Vec3f), (GLvoid *) 0);
+
+    // Rendering straight from the state of a particle system. The stride of the positions is set
+    // for each frame, and the element buffer holds the line topology.
+    glGenBuffers(1, &gl_.line_index_buffer);
+    glGenVertexArrays(1, &gl_.state_vao);
+    glBindVertexArray(gl_.state_vao);
+    glEnableVertexAttribArray(ATTRIB_POSITION);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gl_.line_index_buffer);
     glBindVertexArray(0);
 
     auto shader_program = new GLContext::Program(
@@ -326,17 +497,67 @@ void App::render() {
 
         glBindVertexArray(gl_.point_vao);
         glBindBuffer(GL_ARRAY_BUFFER, gl_.vertex_buffer);
-        auto p = ps_->getPoints();
-        glBufferData(GL_ARRAY_BUFFER, sizeof(Vec3f) * p.size(), p.data(), GL_STATIC_DRAW);
-        glEnable(GL_POINT_SMOOTH);
-        glPointSize(10.0f);
-        glDrawArrays(GL_POINTS, 0, (GLsizei) p.size());
-
-        auto l = ps_->getLines();
-        glBufferData(GL_ARRAY_BUFFER, sizeof(Vec3f) * l.size(), l.data(), GL_STATIC_DRAW);
-        glEnable(GL_LINE_SMOOTH);
-        glLineWidth(1);
-        glDrawArrays(GL_LINES, 0, (GLsizei) l.size());
+        if (scheduler_.isRunning()) {
+            // EXTRA: Draw the latest snapshot of the simulation thread.
+            const auto &snapshot = scheduler_.acquire();
+            glBufferData(GL_ARRAY_BUFFER, sizeof(Vec3f) * snapshot.points.size(), snapshot.points.data(), GL_STREAM_DRAW);
+            glEnable(GL_POINT_SMOOTH);
+            glPointSize(ps_type_ == CPU_CLOTH ? 2.0f : 10.0f);
+            glDrawArrays(GL_POINTS, 0, (GLsizei) snapshot.points.size());
+            glBufferData(GL_ARRAY_BUFFER, sizeof(Vec3f) * snapshot.lines.size(), snapshot.lines.data(), GL_STREAM_DRAW);
+            glEnable(GL_LINE_SMOOTH);
+            glLineWidth(1);
+            glDrawArrays(GL_LINES, 0, (GLsizei) snapshot.lines.size());
+        } else {
+            RenderView view;
+            const auto has_view = ps_type_ != CPU_CLOTH && ps_->getRenderView(view);
+            if (has_view) {
+                // EXTRA: Upload the positions straight from the state, and the line topology only
+                // when it changes.
+                glBindVertexArray(gl_.state_vao);
+                const auto bytes = view.num_points ? (view.num_points - 1) * size_t(view.stride) + sizeof(Vec3f) : 0;
+                glBufferData(GL_ARRAY_BUFFER, bytes, view.positions, GL_STREAM_DRAW);
+                glVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, view.stride, (GLvoid *) 0);
+                glEnable(GL_POINT_SMOOTH);
+                glPointSize(10.0f);
+                glDrawArrays(GL_POINTS, 0, (GLsizei) view.num_points);
+                glEnable(GL_LINE_SMOOTH);
+                glLineWidth(1);
+                if (view.line_indices) {
+                    if (ps_ != indexed_system_ || view.topology != indexed_topology_) {
+                        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned) * view.line_indices->size(), view.line_indices->data(), GL_STATIC_DRAW);
+                        indexed_system_ = ps_;
+                        indexed_topology_ = view.topology;
+                    }
+                    glDrawElements(GL_LINES, (GLsizei) view.line_indices->size(), GL_UNSIGNED_INT, (GLvoid *) 0);
+                }
+                if (view.static_lines) {
+                    glBindVertexArray(gl_.point_vao);
+                    glBufferData(GL_ARRAY_BUFFER, sizeof(Vec3f) * view.static_lines->size(), view.static_lines->data(), GL_STREAM_DRAW);
+                    glDrawArrays(GL_LINES, 0, (GLsizei) view.static_lines->size());
+                }
+            } else if (ps_type_ == CPU_CLOTH) {
+                vector<Vec3f> p;
+                cpu_cloth_.GetPositions(p);
+                glBufferData(GL_ARRAY_BUFFER, sizeof(Vec3f) * p.size(), p.data(), GL_STREAM_DRAW);
+                glPointSize(2.0f);
+                glDrawArrays(GL_POINTS, 0, (GLsizei) p.size());
+            } else {
+                auto p = ps_->getPoints();
+                glBufferData(GL_ARRAY_BUFFER, sizeof(Vec3f) * p.size(), p.data(), GL_STATIC_DRAW);
+                glEnable(GL_POINT_SMOOTH);
+                glPointSize(10.0f);
+                glDrawArrays(GL_POINTS, 0, (GLsizei) p.size());
+            }
+
+            if (ps_type_ != CPU_CLOTH && !has_view) {
+                auto l = ps_->getLines();
+                glBufferData(GL_ARRAY_BUFFER, sizeof(Vec3f) * l.size(), l.data(), GL_STATIC_DRAW);
+                glEnable(GL_LINE_SMOOTH);
+                glLineWidth(1);
+                glDrawArrays(GL_LINES, 0, (GLsizei) l.size());
+            }
+        }
     }
 
     // Undo our bindings.
@@ -1,6 +1,9 @@
 #pragma once
 
+#include "integrators.hpp"
 #include "particle_systems.hpp"
+#include "CpuCloth.hpp"
+#include "simulation_scheduler.hpp"
 
 #include "gui/Window.hpp"
 #include "gui/CommonControls.hpp"
@@ -20,9 +23,9 @@ struct Vertex
 
 struct glGeneratedIndices
 {
-	GLuint point_vao, mesh_vao;
+	GLuint point_vao, mesh_vao, state_vao;
 	GLuint shader_program;
-	GLuint vertex_buffer;
+	GLuint vertex_buffer, line_index_buffer;
 	GLuint model_to_world_uniform, world_to_clip_uniform;
 };
 
@@ -35,6 +38,8 @@ private:
 		PENDULUM_SYSTEM,
 		CLOTH_SYSTEM,
 		SPRINKLER_SYSTEM,
+		FLUID_SYSTEM,
+		CPU_CLOTH,
 		COMPUTE_CLOTH
 	};
 	enum IntegratorType {
@@ -45,6 +50,9 @@ private:
 		IMPLICIT_EULER_INTEGRATOR,
 		IMPLICIT_MIDPOINT_INTEGRATOR,
 		CRANK_NICOLSON_INTEGRATOR,
+		XPBD_INTEGRATOR,
+		ADAPTIVE_INTEGRATOR,
+		CPU_CLOTH_INTEGRATOR,
 		COMPUTE_CLOTH_INTEGRATOR
 	};
 public:
@@ -54,6 +62,10 @@ public:
 private:
 	void			initRendering		(void);
 	void			render				(void);
+	void			advance				(IntegratorType integrator, float step);
+	void			capture				(SimulationScheduler::Snapshot& snapshot);
+	bool			settingsChanged		(void) const;
+	void			applySettings		(void);
 
 private:
 					App             (const App&); // forbid copy
@@ -67,6 +79,12 @@ private:
 	bool			shading_mode_changed_;
 	bool			wind_;
 	bool			wind_changed_;
+	bool			cloth_collisions_;
+	bool			cloth_collisions_changed_;
+	bool			parallel_;
+	bool			parallel_changed_;
+	bool			realtime_;
+	bool			realtime_changed_;
 	bool			system_changed_;
 	bool			fireBullet = false;
 
@@ -78,17 +96,29 @@ private:
 	ParticleSystemType	ps_type_;
 	IntegratorType		integrator_, previous_integrator_;
 	ParticleSystem*		ps_;
+	// The system and topology whose line indices are in gl_.line_index_buffer
+	const ParticleSystem*	indexed_system_;
+	unsigned			indexed_topology_;
 	
 	float			step_, previous_step_;
 	int				steps_per_update_;
+	int				cloth_substeps_;
+	int				xpbd_iterations_;
+	float			adaptive_tolerance_;
+	bool			matrix_free_;
 	SimpleSystem	simple_system_;
 	SpringSystem	spring_system_;
 	PendulumSystem	pendulum_system_;
 	ClothSystem		cloth_system_;
 	Sprinkler		sprinkler_;
+	FluidSystem		fluid_system_;
+
+	IntegratorWorkspace	integrator_workspace_;
 
 	bool			initial_implicit_;
 
+	CpuCloth		cpu_cloth_;
+
 #ifdef COMPUTE_CLOTH_MODULE
 	ComputeCloth	compute_cloth_;
 #endif
@@ -97,6 +127,14 @@ private:
 	SparseMatrix ps_J_;
 	SparseLU implicit_solver_;
 #endif
+
+	// EXTRA: Real-time simulation on a thread of its own. The thread reads the system and the
+	// integrator chosen as of the last applySettings(), not the controls, which change without
+	// the lock.
+	ParticleSystemType	simulated_system_;
+	IntegratorType		simulated_integrator_;
+	// Declared last so that it stops before the systems go away.
+	SimulationScheduler	scheduler_;
 };
 
 } // namespace FW
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "base/Math.hpp"
+
+namespace FW {
+
+	// Speed of a fired bullet
+	static const float BULLET_SPEED = 10.0f;
+
+	// Integrators of ComputeCloth and CpuCloth
+	enum ClothIntegrator
+	{
+		CLOTH_RK4,
+		CLOTH_SYMPLECTIC_EULER
+	};
+
+	// Cloth simulation parameters shared by ComputeCloth and CpuCloth. The layout matches the std140
+	// uniform block "params" of the compute shaders, so don't add data members without updating them.
+	struct ClothParams
+	{
+		float springK = 30;
+		float springDamp = 1.48f;
+		float dragK = 1.7f;
+		float windStrength = .2f;
+		float springBreakThreshold = 1.27f;
+		float scale = 1.0f;
+		float dt = .1f;
+
+		float bulletR = .2f;
+		Vec4f bulletPos = 99;
+		Vec4f bulletVel = 0;
+
+		int w = 60, h = 60;
+
+		// Fire the bullet from origin towards dir
+		void FireBullet(Vec4f origin, Vec4f dir)
+		{
+			bulletPos = Vec4f(origin.getXYZ(), 1.0f);
+			bulletVel = Vec4f(dir.getXYZ().normalized() * BULLET_SPEED, 0.0f);
+		}
+
+		// Move the bullet along by one time step
+		void AdvanceBullet(float dt)
+		{
+			bulletPos += bulletVel * dt;
+		}
+	};
+
+} // namespace FW
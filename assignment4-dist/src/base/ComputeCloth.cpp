@@ -35,6 +35,7 @@ void FW::ComputeCloth::InitGL()
 	resetProg = Shader("reset", true, ctx);
 	evalFProg = Shader("evalF", true, ctx);
 	BxcPlusDProg = Shader("BxcPlusD", true, ctx);
+	symplecticEulerProg = Shader("symplecticEuler", true, ctx);
 
 	// Generate storage buffers
 	glGenBuffers(1, &state);
@@ -49,8 +50,10 @@ void FW::ComputeCloth::InitGL()
 	// Generate VAOs
 	glGenVertexArrays(1, &particleVAO);
 
-	// Generate uniform buffer
+	// Generate uniform buffer. Its storage is allocated once here and only updated afterwards
 	glGenBuffers(1, &clothUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, clothUBO);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(ClothParams), &params, GL_DYNAMIC_DRAW);
 
 	// Fill in VAO data
 	glBindVertexArray(particleVAO);
@@ -68,7 +71,7 @@ void FW::ComputeCloth::InitGL()
 void FW::ComputeCloth::UploadClothUBO()
 {
 	glBindBuffer(GL_UNIFORM_BUFFER, clothUBO);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(ClothParams), &params, GL_STATIC_DRAW);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(ClothParams), &params);
 }
 
 void FW::ComputeCloth::Resize(int w, int h)
@@ -123,17 +126,21 @@ void FW::ComputeCloth::Reset()
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, state);
 	glBindBufferBase(GL_UNIFORM_BUFFER, 3, clothUBO);
 	glDispatchCompute(x, y, 1);
+	Barrier();
 }
 
 void FW::ComputeCloth::FireBullet(Vec4f origin, Vec4f dir)
 {
-	// YOUR CODE HERE (bullet extra):
-	// Initialize bullet position and velocity here in case you want to do the bullet firing extra.
+	params.FireBullet(origin, dir);
+}
 
+void FW::ComputeCloth::Barrier()
+{
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 }
 
 // Evaluate derivative of state B: A = dB/dt;
-void FW::ComputeCloth::EvalF(float dt, GLuint A, GLuint B)
+void FW::ComputeCloth::EvalF(GLuint A, GLuint B)
 {
 	evalFProg.program->use();
 
@@ -144,11 +151,9 @@ void FW::ComputeCloth::EvalF(float dt, GLuint A, GLuint B)
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, B);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, brokenSprings);
 
-	params.dt = dt;
-	UploadClothUBO();
-
 	glBindBufferBase(GL_UNIFORM_BUFFER, 3, clothUBO);
 	glDispatchCompute(x, y, 1);
+	Barrier();
 }
 
 // For states A, B, D, and float c, compute: A = B * dt + C (used for Euler step with flexibility of destination state)
@@ -163,35 +168,67 @@ void FW::ComputeCloth::BxcPlusD(GLuint A, GLuint B, float dt, GLuint C)
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, B);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, C);
 
-	params.dt = dt;
-	UploadClothUBO();
+	// The step changes from one dispatch to the next, so it goes in a plain uniform instead of the UBO
+	glUniform1f(BxcPlusDProg.program->getUniformLoc("c"), dt);
 
 	glBindBufferBase(GL_UNIFORM_BUFFER, 3, clothUBO);
 	glDispatchCompute(x, y, 1);
+	Barrier();
 }
 
-// Copy size bytes from read to write
-void CopyBuffer(GLuint read, GLuint write, int size)
+// For state C and its derivative B: A.vel = B.vel * dt + C.vel, A.pos = A.vel * dt + C.pos
+void FW::ComputeCloth::SymplecticEuler(GLuint A, GLuint B, float dt, GLuint C)
 {
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, write);
-	glBindBuffer(GL_ARRAY_BUFFER, read);
-	glCopyBufferSubData(GL_ARRAY_BUFFER, GL_SHADER_STORAGE_BUFFER, 0, 0, size);
-}
+	symplecticEulerProg.program->use();
 
-void FW::ComputeCloth::Advance(float dt)
-{
-	// Size of state object in bytes (note that due to alignment, it takes up two vec4's worth of space even though it contains only two vec3's)
-	int bytes = 8 * params.w * params.h * sizeof(float);
+	int x = (params.w + RESET_X - 1) / RESET_X;
+	int y = (params.h + RESET_Y - 1) / RESET_Y;
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, A);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, B);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, C);
 
-	// Your code here (compute extra):
-	// Implement an integrator of your choice. RK4 or some other higher-order method is recommended, otherwise you'll likely run into stability issues
-	// Use evalF to evaluate the derivative of a state, and BxcPlusD to take Euler steps with evaluated derivatives. You can think of the GLuints as
-	// opaque pointers to data arrays, and treat this like any other CPU-side algorithm. Below is an Euler integrator to give you an idea of how the
-	// methods work.
+	glUniform1f(symplecticEulerProg.program->getUniformLoc("c"), dt);
 
-	//EvalF(dt, tempStateA, state);							// A = evalF(state)
-	//BxcPlusD(state, tempStateA, dt, state);				// state = A * dt + state
+	glBindBufferBase(GL_UNIFORM_BUFFER, 3, clothUBO);
+	glDispatchCompute(x, y, 1);
+	Barrier();
+}
 
+void FW::ComputeCloth::Advance(float dt)
+{
+	// All sub-steps go out as one stream of dispatches with nothing read back to the CPU. The
+	// states trade places by swapping their handles, so no buffer is copied or allocated.
+	const float h = dt / substeps;
+	for (int i = 0; i < substeps; ++i)
+	{
+		params.dt = h;
+		UploadClothUBO();
+
+		if (integrator == CLOTH_SYMPLECTIC_EULER)
+		{
+			EvalF(tempStateA, state);								// A = evalF(state)
+			SymplecticEuler(state, tempStateA, h, state);			// state.vel += A.vel * h, then state.pos += state.vel * h
+		}
+		else
+		{
+			// RK4: nextState accumulates the result, tempStateA holds the derivatives and tempStateB the midpoints
+			EvalF(tempStateA, state);								// k1
+			BxcPlusD(nextState, tempStateA, h / 6, state);
+			BxcPlusD(tempStateB, tempStateA, h / 2, state);
+			EvalF(tempStateA, tempStateB);							// k2
+			BxcPlusD(nextState, tempStateA, h / 3, nextState);
+			BxcPlusD(tempStateB, tempStateA, h / 2, state);
+			EvalF(tempStateA, tempStateB);							// k3
+			BxcPlusD(nextState, tempStateA, h / 3, nextState);
+			BxcPlusD(tempStateB, tempStateA, h, state);
+			EvalF(tempStateA, tempStateB);							// k4
+			BxcPlusD(nextState, tempStateA, h / 6, nextState);
+			swap(state, nextState);
+		}
+
+		params.AdvanceBullet(h);
+	}
 }
 
 void FW::ComputeCloth::Render(bool shading_toggle, const Mat4f& worldToClip)
@@ -209,6 +246,7 @@ void FW::ComputeCloth::Render(bool shading_toggle, const Mat4f& worldToClip)
 	glBindBufferBase(GL_UNIFORM_BUFFER, 3, clothUBO);
 
 	glDispatchCompute(x, y, 1);
+	glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
 
 	// Set triangle draw program as active and set its uniforms
 	pointProg.program->use();
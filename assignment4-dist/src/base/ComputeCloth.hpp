@@ -3,29 +3,13 @@
 #include "base/Math.hpp"
 #include "gpu/GLContext.hpp"
 #include "Shader.hpp"
+#include "ClothParams.hpp"
 #include <string>
 
 #define COMPUTE_CLOTH_MODULE
 
 namespace FW {
 
-	struct ClothParams
-	{
-		float springK = 30;
-		float springDamp = 1.48f;
-		float dragK = 1.7f;
-		float windStrength = .2f;
-		float springBreakThreshold = 1.27f;
-		float scale = 1.0f;
-		float dt = .1f;
-
-		float bulletR = .2f;
-		Vec4f bulletPos = 99;
-		Vec4f bulletVel = 0;
-
-		int w = 60, h = 60;
-	};
-
 	class ComputeCloth
 	{
 		
@@ -48,7 +32,7 @@ namespace FW {
 		// Reset cloth state
 		void Reset();
 
-		// Take one time step
+		// Take one time step, in substeps steps of the chosen integrator
 		void Advance(float dt);
 
 		// Render cloth
@@ -60,20 +44,30 @@ namespace FW {
 		// Private methods
 
 		// Evaluate derivative of state B: A = dB/dt;
-		void EvalF(float dt, GLuint A, GLuint B);
+		void EvalF(GLuint A, GLuint B);
 
 		// For states A, B, D, and float c, compute: A = B * dt + C (used for Euler step with flexibility of destination state)
 		void BxcPlusD(GLuint A, GLuint B, float dt, GLuint D);
 
+		// For state C and its derivative B, take a symplectic Euler step into A: the velocity first, then the position with the new velocity
+		void SymplecticEuler(GLuint A, GLuint B, float dt, GLuint C);
+
+		// Make the storage buffer writes of the last dispatch visible to the next one
+		void Barrier();
+
 	public:
 		// Public members
 
 		// Cloth simulation parameters
 		ClothParams params;
 
+		// Integrator and number of sub-steps per call to Advance
+		ClothIntegrator integrator = CLOTH_RK4;
+		int substeps = 1;
+
 		// Storage buffers
 		GLuint state; // Stores current state of cloth system
-		GLuint nextState, tempStateA, tempStateB; // Temporary states used for RK4 in example solution
+		GLuint nextState, tempStateA, tempStateB; // Temporary states used by the integrators
 		GLuint brokenSprings; // Stores brokenness status for each spring
 
 		// Vertex buffers used in rendering
@@ -86,7 +80,7 @@ namespace FW {
 		Shader triangleProg, lineProg, pointProg;
 
 		// Compute program handles
-		Shader genRenderDataProg, resetProg, evalFProg, BxcPlusDProg;
+		Shader genRenderDataProg, resetProg, evalFProg, BxcPlusDProg, symplecticEulerProg;
 
 		// Uniform buffer containing cloth parameters etc.
 		GLuint clothUBO;
@@ -0,0 +1,356 @@
+#include "CpuCloth.hpp"
+#include "parallel_for.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+using namespace FW;
+using namespace std;
+
+namespace {
+
+	const float CLOTH_MASS = 1.0f;
+	const float GRAVITY = -9.81f;
+	const float WIND_SPEED = 20.0f;
+
+	// Table containing grid offsets for each spring connected to a particle, same as in evalF.glsl
+	const int SPRING_OFFSETS[CpuCloth::SPRINGS][2] = {
+		{ 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 },
+		{ 1, 1 }, { -1, -1 }, { 1, -1 }, { -1, 1 },
+		{ 2, 0 }, { -2, 0 }, { 0, 2 }, { 0, -2 }
+	};
+
+	// Spring rest lengths before taking scale into account
+	float springLength(int z)
+	{
+		return z < 4 ? 1.0f : z < 8 ? FW::sqrt(2.0f) : 2.0f;
+	}
+
+	inline __m128 loadMask(const unsigned* p)
+	{
+		return _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) p));
+	}
+
+	inline void storeMask(unsigned* p, __m128 m)
+	{
+		_mm_storeu_si128((__m128i*) p, _mm_castps_si128(m));
+	}
+
+	inline __m128 dot3(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+	{
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+	}
+
+} // namespace
+
+FW::CpuCloth::CpuCloth()
+{
+	Resize(params.w, params.h);
+}
+
+void FW::CpuCloth::Resize(int w, int h)
+{
+	assert(w > 0 && h > 0 && "cloth must have particles");
+	params.w = w;
+	params.h = h;
+
+	params.springK = 30.f * w * h;
+	params.scale = 2.0f / h;
+
+	// Enough halo on the right for the neighbours of the last group of lanes in a row
+	stride = (w + LANES - 1) / LANES * LANES + 2 * HALO;
+	rows = h + 2 * HALO;
+	const auto size = size_t(stride) * rows;
+	for (auto s : { &state, &nextState, &tempStateA, &tempStateB })
+	{
+		for (auto a : { &s->px, &s->py, &s->pz, &s->vx, &s->vy, &s->vz })
+			a->assign(size, 0.0f);
+	}
+	for (auto& mask : springMask)
+		mask.assign(size, 0u);
+	freeMask.assign(size, 0u);
+	Reset();
+}
+
+void FW::CpuCloth::Reset()
+{
+	const int w = params.w, h = params.h;
+	for (int y = 0; y < h; ++y)
+	{
+		for (int x = 0; x < w; ++x)
+		{
+			const auto i = Index(x, y);
+			state.px[i] = (x - 0.5f * (w - 1)) * params.scale;
+			state.py[i] = 0.0f;
+			state.pz[i] = -y * params.scale;
+			state.vx[i] = state.vy[i] = state.vz[i] = 0.0f;
+			freeMask[i] = y == 0 ? 0u : ~0u;
+			for (int z = 0; z < SPRINGS; ++z)
+			{
+				const auto end_x = x + SPRING_OFFSETS[z][0], end_y = y + SPRING_OFFSETS[z][1];
+				springMask[z][i] = end_x >= 0 && end_x < w && end_y >= 0 && end_y < h ? ~0u : 0u;
+			}
+		}
+	}
+	FillHalo(state);
+}
+
+void FW::CpuCloth::FireBullet(Vec4f origin, Vec4f dir)
+{
+	params.FireBullet(origin, dir);
+}
+
+void FW::CpuCloth::GetPositions(vector<Vec3f>& positions) const
+{
+	positions.resize(size_t(params.w) * params.h);
+	for (int y = 0; y < params.h; ++y)
+	{
+		for (int x = 0; x < params.w; ++x)
+		{
+			const auto i = Index(x, y);
+			positions[y * params.w + x] = Vec3f(state.px[i], state.py[i], state.pz[i]);
+		}
+	}
+}
+
+void FW::CpuCloth::GetBrokenSprings(vector<int>& broken) const
+{
+	broken.assign(size_t(params.w) * params.h * SPRINGS, 0);
+	for (int y = 0; y < params.h; ++y)
+	{
+		for (int x = 0; x < params.w; ++x)
+		{
+			for (int z = 0; z < SPRINGS; ++z)
+			{
+				const auto end_x = x + SPRING_OFFSETS[z][0], end_y = y + SPRING_OFFSETS[z][1];
+				const auto exists = end_x >= 0 && end_x < params.w && end_y >= 0 && end_y < params.h;
+				broken[(y * params.w + x) * SPRINGS + z] = exists && !springMask[z][Index(x, y)];
+			}
+		}
+	}
+}
+
+void FW::CpuCloth::FillHalo(ClothState& s) const
+{
+	const int w = params.w, h = params.h;
+	for (auto a : { &s.px, &s.py, &s.pz, &s.vx, &s.vy, &s.vz })
+	{
+		auto& v = *a;
+		// Clamp to the edges: first along the rows, then whole rows above and below
+		for (int y = 0; y < h; ++y)
+		{
+			const auto row = (y + HALO) * stride;
+			fill(v.begin() + row, v.begin() + row + HALO, v[row + HALO]);
+			fill(v.begin() + row + HALO + w, v.begin() + row + stride, v[row + HALO + w - 1]);
+		}
+		for (int y = 0; y < HALO; ++y)
+		{
+			copy(v.begin() + HALO * stride, v.begin() + (HALO + 1) * stride, v.begin() + y * stride);
+			copy(v.begin() + (h + HALO - 1) * stride, v.begin() + (h + HALO) * stride, v.begin() + (h + HALO + y) * stride);
+		}
+	}
+}
+
+// Evaluate derivative of state B: A = dB/dt;
+void FW::CpuCloth::EvalF(ClothState& A, ClothState& B)
+{
+	FillHalo(B);
+	if (parallel)
+		parallelFor(launcher, size_t(params.h), ROW_GRAIN, [&](size_t first, size_t end) { EvalRows(int(first), int(end), A, B); });
+	else
+		EvalRows(0, params.h, A, B);
+}
+
+void FW::CpuCloth::EvalRows(int first, int end, ClothState& A, const ClothState& B)
+{
+	const auto zero = _mm_setzero_ps();
+	const auto spring_k = _mm_set1_ps(params.springK);
+	const auto spring_damp = _mm_set1_ps(params.springDamp);
+	const auto drag_k = _mm_set1_ps(params.dragK);
+	const auto wind_strength = _mm_set1_ps(params.windStrength);
+	const auto wind_z = _mm_set1_ps(WIND_SPEED);
+	const auto gravity = _mm_set1_ps(GRAVITY * CLOTH_MASS);
+	const auto inv_mass = _mm_set1_ps(1.0f / CLOTH_MASS);
+	const auto bullet_x = _mm_set1_ps(params.bulletPos.x), bullet_y = _mm_set1_ps(params.bulletPos.y), bullet_z = _mm_set1_ps(params.bulletPos.z);
+	const auto bullet_vx = _mm_set1_ps(params.bulletVel.x), bullet_vy = _mm_set1_ps(params.bulletVel.y), bullet_vz = _mm_set1_ps(params.bulletVel.z);
+	const auto bullet_r = _mm_set1_ps(params.bulletR);
+	const auto bullet_r2 = _mm_set1_ps(params.bulletR * params.bulletR);
+
+	int offsets[SPRINGS];
+	__m128 rest[SPRINGS], break_length[SPRINGS];
+	for (int z = 0; z < SPRINGS; ++z)
+	{
+		offsets[z] = SPRING_OFFSETS[z][1] * stride + SPRING_OFFSETS[z][0];
+		rest[z] = _mm_set1_ps(springLength(z) * params.scale);
+		break_length[z] = _mm_set1_ps(params.springBreakThreshold * springLength(z) * params.scale);
+	}
+
+	for (int y = first; y < end; ++y)
+	{
+		// The lanes past the end of the row are halo; their springs are masked out and they aren't free
+		for (int x = 0; x < params.w; x += LANES)
+		{
+			const auto i = Index(x, y);
+			const auto px = _mm_loadu_ps(&B.px[i]), py = _mm_loadu_ps(&B.py[i]), pz = _mm_loadu_ps(&B.pz[i]);
+			const auto vx = _mm_loadu_ps(&B.vx[i]), vy = _mm_loadu_ps(&B.vy[i]), vz = _mm_loadu_ps(&B.vz[i]);
+			auto fx = zero, fy = gravity, fz = zero;
+
+			for (int z = 0; z < SPRINGS; ++z)
+			{
+				auto mask = loadMask(&springMask[z][i]);
+				const auto j = i + offsets[z];
+				const auto dx = _mm_sub_ps(_mm_loadu_ps(&B.px[j]), px);
+				const auto dy = _mm_sub_ps(_mm_loadu_ps(&B.py[j]), py);
+				const auto dz = _mm_sub_ps(_mm_loadu_ps(&B.pz[j]), pz);
+				const auto len = _mm_sqrt_ps(dot3(dx, dy, dz, dx, dy, dz));
+
+				// Break overstretched springs before they exert any force
+				mask = _mm_andnot_ps(_mm_cmpgt_ps(len, break_length[z]), mask);
+				storeMask(&springMask[z][i], mask);
+
+				const auto nx = _mm_div_ps(dx, len), ny = _mm_div_ps(dy, len), nz = _mm_div_ps(dz, len);
+				const auto dvx = _mm_sub_ps(_mm_loadu_ps(&B.vx[j]), vx);
+				const auto dvy = _mm_sub_ps(_mm_loadu_ps(&B.vy[j]), vy);
+				const auto dvz = _mm_sub_ps(_mm_loadu_ps(&B.vz[j]), vz);
+				const auto magnitude = _mm_add_ps(_mm_mul_ps(spring_k, _mm_sub_ps(len, rest[z])),
+				                                  _mm_mul_ps(spring_damp, dot3(dvx, dvy, dvz, nx, ny, nz)));
+				// The masked lanes may be NaN (zero length), and the mask clears them to zero
+				fx = _mm_add_ps(fx, _mm_and_ps(mask, _mm_mul_ps(magnitude, nx)));
+				fy = _mm_add_ps(fy, _mm_and_ps(mask, _mm_mul_ps(magnitude, ny)));
+				fz = _mm_add_ps(fz, _mm_and_ps(mask, _mm_mul_ps(magnitude, nz)));
+			}
+
+			// Drag
+			fx = _mm_sub_ps(fx, _mm_mul_ps(drag_k, vx));
+			fy = _mm_sub_ps(fy, _mm_mul_ps(drag_k, vy));
+			fz = _mm_sub_ps(fz, _mm_mul_ps(drag_k, vz));
+
+			// Wind against the surface normal, from central differences clamped at the borders
+			{
+				const auto ux = _mm_sub_ps(_mm_loadu_ps(&B.px[i + 1]), _mm_loadu_ps(&B.px[i - 1]));
+				const auto uy = _mm_sub_ps(_mm_loadu_ps(&B.py[i + 1]), _mm_loadu_ps(&B.py[i - 1]));
+				const auto uz = _mm_sub_ps(_mm_loadu_ps(&B.pz[i + 1]), _mm_loadu_ps(&B.pz[i - 1]));
+				const auto wx = _mm_sub_ps(_mm_loadu_ps(&B.px[i + stride]), _mm_loadu_ps(&B.px[i - stride]));
+				const auto wy = _mm_sub_ps(_mm_loadu_ps(&B.py[i + stride]), _mm_loadu_ps(&B.py[i - stride]));
+				const auto wz = _mm_sub_ps(_mm_loadu_ps(&B.pz[i + stride]), _mm_loadu_ps(&B.pz[i - stride]));
+				auto nx = _mm_sub_ps(_mm_mul_ps(uy, wz), _mm_mul_ps(uz, wy));
+				auto ny = _mm_sub_ps(_mm_mul_ps(uz, wx), _mm_mul_ps(ux, wz));
+				auto nz = _mm_sub_ps(_mm_mul_ps(ux, wy), _mm_mul_ps(uy, wx));
+				const auto len2 = dot3(nx, ny, nz, nx, ny, nz);
+				const auto valid = _mm_cmpgt_ps(len2, zero);
+				const auto len = _mm_sqrt_ps(len2);
+				nx = _mm_div_ps(nx, len);
+				ny = _mm_div_ps(ny, len);
+				nz = _mm_div_ps(nz, len);
+				const auto pressure = _mm_mul_ps(wind_strength, dot3(nx, ny, nz, _mm_sub_ps(zero, vx), _mm_sub_ps(zero, vy), _mm_sub_ps(wind_z, vz)));
+				fx = _mm_add_ps(fx, _mm_and_ps(valid, _mm_mul_ps(pressure, nx)));
+				fy = _mm_add_ps(fy, _mm_and_ps(valid, _mm_mul_ps(pressure, ny)));
+				fz = _mm_add_ps(fz, _mm_and_ps(valid, _mm_mul_ps(pressure, nz)));
+			}
+
+			// Bullet
+			{
+				const auto dx = _mm_sub_ps(px, bullet_x), dy = _mm_sub_ps(py, bullet_y), dz = _mm_sub_ps(pz, bullet_z);
+				const auto len2 = dot3(dx, dy, dz, dx, dy, dz);
+				const auto inside = _mm_and_ps(_mm_cmplt_ps(len2, bullet_r2), _mm_cmpgt_ps(len2, zero));
+				// Skip the rest for the usual case of a bullet that touches none of the four particles
+				if (_mm_movemask_ps(inside))
+				{
+					const auto len = _mm_sqrt_ps(len2);
+					const auto nx = _mm_div_ps(dx, len), ny = _mm_div_ps(dy, len), nz = _mm_div_ps(dz, len);
+					const auto dvn = dot3(_mm_sub_ps(bullet_vx, vx), _mm_sub_ps(bullet_vy, vy), _mm_sub_ps(bullet_vz, vz), nx, ny, nz);
+					const auto magnitude = _mm_add_ps(_mm_mul_ps(spring_k, _mm_sub_ps(bullet_r, len)), _mm_mul_ps(spring_damp, dvn));
+					fx = _mm_add_ps(fx, _mm_and_ps(inside, _mm_mul_ps(magnitude, nx)));
+					fy = _mm_add_ps(fy, _mm_and_ps(inside, _mm_mul_ps(magnitude, ny)));
+					fz = _mm_add_ps(fz, _mm_and_ps(inside, _mm_mul_ps(magnitude, nz)));
+				}
+			}
+
+			const auto free_mask = loadMask(&freeMask[i]);
+			_mm_storeu_ps(&A.px[i], _mm_and_ps(free_mask, vx));
+			_mm_storeu_ps(&A.py[i], _mm_and_ps(free_mask, vy));
+			_mm_storeu_ps(&A.pz[i], _mm_and_ps(free_mask, vz));
+			_mm_storeu_ps(&A.vx[i], _mm_and_ps(free_mask, _mm_mul_ps(fx, inv_mass)));
+			_mm_storeu_ps(&A.vy[i], _mm_and_ps(free_mask, _mm_mul_ps(fy, inv_mass)));
+			_mm_storeu_ps(&A.vz[i], _mm_and_ps(free_mask, _mm_mul_ps(fz, inv_mass)));
+		}
+	}
+}
+
+// For states A, B, C, and float dt, compute: A = B * dt + C
+void FW::CpuCloth::BxcPlusD(ClothState& A, const ClothState& B, float dt, const ClothState& C)
+{
+	auto run = [&](size_t first, size_t end) {
+		auto axpy = [&](vector<float>& a, const vector<float>& b, const vector<float>& c) {
+			for (auto k = first; k < end; ++k)
+				a[k] = b[k] * dt + c[k];
+		};
+		axpy(A.px, B.px, C.px);
+		axpy(A.py, B.py, C.py);
+		axpy(A.pz, B.pz, C.pz);
+		axpy(A.vx, B.vx, C.vx);
+		axpy(A.vy, B.vy, C.vy);
+		axpy(A.vz, B.vz, C.vz);
+	};
+	if (parallel)
+		parallelFor(launcher, state.px.size(), ELEMENT_GRAIN, run);
+	else
+		run(size_t(0), state.px.size());
+}
+
+// For state C and its derivative B: A.vel = B.vel * dt + C.vel, A.pos = A.vel * dt + C.pos
+void FW::CpuCloth::SymplecticEuler(ClothState& A, const ClothState& B, float dt, const ClothState& C)
+{
+	auto run = [&](size_t first, size_t end) {
+		auto step = [&](vector<float>& ap, vector<float>& av, const vector<float>& bv, const vector<float>& cp, const vector<float>& cv) {
+			for (auto k = first; k < end; ++k)
+			{
+				av[k] = bv[k] * dt + cv[k];
+				ap[k] = av[k] * dt + cp[k];
+			}
+		};
+		step(A.px, A.vx, B.vx, C.px, C.vx);
+		step(A.py, A.vy, B.vy, C.py, C.vy);
+		step(A.pz, A.vz, B.vz, C.pz, C.vz);
+	};
+	if (parallel)
+		parallelFor(launcher, state.px.size(), ELEMENT_GRAIN, run);
+	else
+		run(size_t(0), state.px.size());
+}
+
+void FW::CpuCloth::Advance(float dt)
+{
+	const float h = dt / substeps;
+	for (int i = 0; i < substeps; ++i)
+	{
+		params.dt = h;
+
+		if (integrator == CLOTH_SYMPLECTIC_EULER)
+		{
+			EvalF(tempStateA, state);
+			SymplecticEuler(state, tempStateA, h, state);
+		}
+		else
+		{
+			// RK4 from the same two kernels as the compute shaders:
+			// nextState accumulates the result, tempStateA holds the derivatives and tempStateB the midpoints.
+			EvalF(tempStateA, state);                          // k1
+			BxcPlusD(nextState, tempStateA, h / 6, state);
+			BxcPlusD(tempStateB, tempStateA, h / 2, state);
+			EvalF(tempStateA, tempStateB);                     // k2
+			BxcPlusD(nextState, tempStateA, h / 3, nextState);
+			BxcPlusD(tempStateB, tempStateA, h / 2, state);
+			EvalF(tempStateA, tempStateB);                     // k3
+			BxcPlusD(nextState, tempStateA, h / 3, nextState);
+			BxcPlusD(tempStateB, tempStateA, h, state);
+			EvalF(tempStateA, tempStateB);                     // k4
+			BxcPlusD(nextState, tempStateA, h / 6, nextState);
+			swap(state, nextState);
+		}
+
+		params.AdvanceBullet(h);
+	}
+}
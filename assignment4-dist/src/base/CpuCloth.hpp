@@ -0,0 +1,110 @@
+#pragma once
+
+#include "base/Math.hpp"
+#include "base/MulticoreLauncher.hpp"
+#include "ClothParams.hpp"
+#include <vector>
+
+namespace FW {
+
+	// CPU implementation of the ComputeCloth simulation, for machines without GL compute shaders.
+	// It takes the same ClothParams and evaluates the same model as the compute shaders, one
+	// particle at a time with the 12 springs of each particle summed in the order of the spring table:
+	//
+	//   - particles of mass 1 on a w x h grid, laid out like ClothSystem but hanging from its whole
+	//     first row, and springs to the particles 1, sqrt(2) and 2 grid steps away
+	//   - spring force springK * (len - rest) * n plus damping springDamp * dot(v_end - v, n) * n
+	//   - a spring breaks for good once it is longer than springBreakThreshold times its rest length
+	//   - gravity, drag -dragK * v, and wind windStrength * dot(n, wind - v) * n against the surface
+	//     normal n, with the wind blowing along +z
+	//   - the bullet pushes the particles inside it out of its sphere with a stiffness of springK
+	//
+	// The state is kept as structure of arrays, padded with two cells of halo around the grid so
+	// that the kernel needs no bounds checks, and the springs are evaluated for four particles at a
+	// time with SSE. Every spring has a mask per particle that is cleared for springs that leave
+	// the grid or have broken. Rows are evaluated in parallel on the MulticoreLauncher threads.
+	class CpuCloth
+	{
+	public:
+		// Public methods
+
+		CpuCloth();
+
+		// Resize cloth system to new dimensions
+		void Resize(int w, int h);
+
+		// Reset cloth state
+		void Reset();
+
+		// Take one time step, in substeps steps of the chosen integrator
+		void Advance(float dt);
+
+		void FireBullet(Vec4f origin, Vec4f dir);
+
+		// Spread the evaluation over the MulticoreLauncher threads
+		void SetParallel(bool parallel) { this->parallel = parallel; }
+
+		// Positions of the particles, row by row
+		void GetPositions(std::vector<Vec3f>& positions) const;
+
+		// Brokenness flags in the layout of the brokenSprings buffer: 12 per particle
+		void GetBrokenSprings(std::vector<int>& broken) const;
+
+	private:
+		// Private methods
+
+		struct ClothState
+		{
+			std::vector<float> px, py, pz, vx, vy, vz;
+		};
+
+		// Index of grid point (x, y) in the padded arrays
+		int Index(int x, int y) const { return (y + HALO) * stride + x + HALO; }
+
+		// Copy the borders of the grid into the halo of s
+		void FillHalo(ClothState& s) const;
+
+		// Evaluate derivative of state B: A = dB/dt;
+		void EvalF(ClothState& A, ClothState& B);
+		void EvalRows(int first, int end, ClothState& A, const ClothState& B);
+
+		// For states A, B, C, and float dt, compute: A = B * dt + C
+		void BxcPlusD(ClothState& A, const ClothState& B, float dt, const ClothState& C);
+
+		// For state C and its derivative B, take a symplectic Euler step into A: the velocity first, then the position with the new velocity
+		void SymplecticEuler(ClothState& A, const ClothState& B, float dt, const ClothState& C);
+
+	public:
+		// Public members
+
+		static const int LANES = 4;
+		static const int SPRINGS = 12;
+		static const int HALO = 2;
+		// Work per task of the parallel evaluation
+		static const int ROW_GRAIN = 8;
+		static const int ELEMENT_GRAIN = 16384;
+
+		// Cloth simulation parameters
+		ClothParams params;
+
+		// Integrator and number of sub-steps per call to Advance
+		ClothIntegrator integrator = CLOTH_RK4;
+		int substeps = 1;
+
+	private:
+		// Private members
+
+		ClothState state; // Current state of cloth system
+		ClothState nextState, tempStateA, tempStateB; // Temporary states used by the integrators
+
+		// springMask[z][i] has all bits set if spring z of particle i exists and is intact
+		std::vector<unsigned> springMask[SPRINGS];
+		// All bits set for the particles that are not fixed
+		std::vector<unsigned> freeMask;
+
+		int stride = 0, rows = 0;
+		bool parallel = false;
+		MulticoreLauncher launcher;
+	};
+
+} // namespace FW
@@ -0,0 +1,347 @@
+// EXTRA: Headless benchmark of the particle systems and integrators, built as its own console
+// program by benchmark.vcxproj. It steps every chosen system with every chosen integrator for a
+// fixed number of steps and prints, as JSON on stdout, the time per particle per step, the heap
+// allocations made by the steps, and how far the energy of the system drifted. Before the runs
+// it checks that the adaptive integrator returns from a state that has gone non-finite.
+//
+// Allocations are counted through operators new and delete. Eigen allocates its vectors and the
+// work storage of SparseLU with malloc, which is not counted, so the implicit integrators report
+// null allocations rather than a count that leaves those out.
+//
+//   benchmark [--steps N] [--step DT] [--pendulum N] [--cloth X Y] [--sprinkler CAPACITY]
+//             [--fluid N] [--systems a,b,...] [--integrators a,b,...] [--parallel]
+
+#include "integrators.hpp"
+#include "particle_systems.hpp"
+
+#include "base/Main.hpp"
+#include "base/Timer.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace FW;
+
+// The projects define FW_DO_NOT_OVERRIDE_NEW_DELETE, so the global operators are free to be
+// replaced here to count the allocations, including those of std::vector.
+#ifndef FW_DO_NOT_OVERRIDE_NEW_DELETE
+#error "the benchmark counts allocations with operators new and delete of its own"
+#endif
+
+namespace {
+    atomic<size_t> s_allocations(0);
+}
+
+void *operator new(size_t size) {
+    ++s_allocations;
+    if (void *ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+namespace {
+
+    struct Options {
+        int steps = 1000;
+        float step = 0.001f;
+        unsigned pendulum = 10u;
+        unsigned cloth_x = 20u, cloth_y = 20u;
+        unsigned sprinkler = 4096u;
+        unsigned fluid = 4096u;
+        vector<string> systems, integrators; // all when empty
+        bool parallel = false;
+    };
+
+    // A system and integrator under test, with the state the integrators keep between steps.
+    struct Run {
+        explicit Run(ParticleSystem &system) : ps(system) {}
+        ParticleSystem &ps;
+        IntegratorWorkspace ws;
+#ifdef EIGEN_SPARSECORE_MODULE_H
+        SparseMatrix J;
+        SparseLU solver;
+#endif
+        bool initial = true;
+    };
+
+    struct Integrator {
+        const char *name;
+        void (*step)(Run &run, float step);
+        bool counts_allocations; // false when the steps allocate through Eigen
+    };
+
+    const Integrator INTEGRATORS[] = {
+        {"euler", [](Run &r, float h) { eulerStep(r.ps, h, r.ws); }, true},
+        {"trapezoid", [](Run &r, float h) { trapezoidStep(r.ps, h, r.ws); }, true},
+        {"midpoint", [](Run &r, float h) { midpointStep(r.ps, h, r.ws); }, true},
+        {"rk4", [](Run &r, float h) { rk4Step(r.ps, h, r.ws); }, true},
+        {"xpbd", [](Run &r, float h) { xpbdStep(r.ps, h, r.ws); }, true},
+        {"adaptive", [](Run &r, float h) { adaptiveStep(r.ps, h, r.ws); }, true},
+#ifdef EIGEN_SPARSECORE_MODULE_H
+        {"implicit_euler", [](Run &r, float h) { implicit_euler_step(r.ps, h, r.J, r.solver, r.initial, r.ws); }, false},
+        {"implicit_midpoint", [](Run &r, float h) { implicit_midpoint_step(r.ps, h, r.J, r.solver, r.initial, r.ws); }, false},
+        {"crank_nicolson", [](Run &r, float h) { crank_nicolson_step(r.ps, h, r.J, r.solver, r.initial, r.ws); }, false},
+#endif
+    };
+
+    const char *const SYSTEMS[] = {"pendulum", "cloth", "sprinkler", "fluid"};
+
+    unique_ptr<ParticleSystem> makeSystem(const string &name, const Options &options) {
+        if (name == "pendulum")
+            return unique_ptr<ParticleSystem>(new PendulumSystem(options.pendulum));
+        if (name == "cloth")
+            return unique_ptr<ParticleSystem>(new ClothSystem(options.cloth_x, options.cloth_y));
+        if (name == "sprinkler")
+            return unique_ptr<ParticleSystem>(new Sprinkler(options.sprinkler));
+        if (name == "fluid")
+            return unique_ptr<ParticleSystem>(new FluidSystem(options.fluid));
+        return nullptr;
+    }
+
+    // Mechanical energy of a system whose state is (position, velocity) pairs: the kinetic energy,
+    // the potential energy in the gravity of -9.8 along y, and that of the springs, if any. The
+    // fluid has no MassSpring description and gets the kinetic and potential energy of particles of
+    // unit mass, without the energy stored in its pressure. The sprinkler, whose particles come and
+    // go, has none. Drag, and the viscosity of the fluid, take energy out of the systems as they should.
+    bool energy(const string &system, ParticleSystem &ps, double &result) {
+        MassSpring description;
+        const vector<Spring> *springs = nullptr;
+        auto mass = 1.0f;
+        if (ps.getMassSpring(description)) {
+            springs = description.springs;
+            mass = description.mass;
+        } else if (system != "fluid") {
+            return false;
+        }
+        const auto &state = ps.state();
+        auto e = 0.0;
+        for (size_t i = 0; i + 1 < state.size(); i += 2)
+            e += mass * (0.5 * state[i + 1].lenSqr() + 9.8 * state[i].y);
+        if (springs)
+            for (const auto &spring : *springs) {
+                const auto stretch = double((state[2 * spring.i1] - state[2 * spring.i2]).length()) - spring.rlen;
+                e += 0.5 * spring.k * stretch * stretch;
+            }
+        result = e;
+        return true;
+    }
+
+    bool finite(const State &state) {
+        for (const auto &v : state)
+            if (!std::isfinite(v.x) || !std::isfinite(v.y) || !std::isfinite(v.z))
+                return false;
+        return true;
+    }
+
+    // A run that blows up must still finish its steps. The adaptive integrator has to give up on
+    // a step from a non-finite state after one trial rather than shrink its sub-steps forever.
+    bool adaptiveStopsWhenNonFinite() {
+        PendulumSystem ps(4);
+        State state = ps.state();
+        state[2].x = NAN;
+        ps.set_state(state);
+        IntegratorWorkspace ws;
+        adaptiveStep(ps, 0.01f, ws);
+        return !finite(ps.state()) && ws.adaptive.evaluations == 7 && ws.adaptive.accepted == 0;
+    }
+
+    // JSON has no NaN or infinity.
+    string number(double x) {
+        char buffer[32];
+        if (!std::isfinite(x))
+            return "null";
+        std::snprintf(buffer, sizeof(buffer), "%.6g", x);
+        return buffer;
+    }
+
+    bool selected(const vector<string> &names, const char *name) {
+        if (names.empty())
+            return true;
+        for (const auto &n : names)
+            if (n == name)
+                return true;
+        return false;
+    }
+
+    vector<string> splitList(const char *list) {
+        vector<string> names;
+        string name;
+        for (auto c = list;; ++c) {
+            if (*c == ',' || !*c) {
+                if (!name.empty())
+                    names.push_back(name);
+                name.clear();
+                if (!*c)
+                    return names;
+            } else {
+                name += *c;
+            }
+        }
+    }
+
+    bool parseOptions(Options &options) {
+        for (int i = 1; i < FW::argc; ++i) {
+            const char *arg = FW::argv[i];
+            const auto remaining = FW::argc - 1 - i;
+            if (!strcmp(arg, "--steps") && remaining >= 1)
+                options.steps = atoi(FW::argv[++i]);
+            else if (!strcmp(arg, "--step") && remaining >= 1)
+                options.step = float(atof(FW::argv[++i]));
+            else if (!strcmp(arg, "--pendulum") && remaining >= 1)
+                options.pendulum = unsigned(atoi(FW::argv[++i]));
+            else if (!strcmp(arg, "--cloth") && remaining >= 2) {
+                options.cloth_x = unsigned(atoi(FW::argv[++i]));
+                options.cloth_y = unsigned(atoi(FW::argv[++i]));
+            } else if (!strcmp(arg, "--sprinkler") && remaining >= 1)
+                options.sprinkler = unsigned(atoi(FW::argv[++i]));
+            else if (!strcmp(arg, "--fluid") && remaining >= 1)
+                options.fluid = unsigned(atoi(FW::argv[++i]));
+            else if (!strcmp(arg, "--systems") && remaining >= 1)
+                options.systems = splitList(FW::argv[++i]);
+            else if (!strcmp(arg, "--integrators") && remaining >= 1)
+                options.integrators = splitList(FW::argv[++i]);
+            else if (!strcmp(arg, "--parallel"))
+                options.parallel = true;
+            else {
+                std::fprintf(stderr, "Unknown or incomplete option: %s\n", arg);
+                return false;
+            }
+        }
+        if (options.steps < 1 || !(options.step > 0.0f) || options.pendulum < 2 || options.cloth_x < 2 || options.cloth_y < 2 ||
+            options.sprinkler < 1 || options.fluid < 1) {
+            std::fprintf(stderr, "Need at least one step, a positive step size, at least 2 pendulum particles, "
+                                 "a cloth of at least 2 by 2 and at least one sprinkler and fluid particle\n");
+            return false;
+        }
+        for (const auto &name : options.systems)
+            if (!makeSystem(name, options)) {
+                std::fprintf(stderr, "Unknown system: %s\n", name.c_str());
+                return false;
+            }
+        for (const auto &name : options.integrators) {
+            auto known = false;
+            for (const auto &integrator : INTEGRATORS)
+                known = known || name == integrator.name;
+            if (!known) {
+                std::fprintf(stderr, "Unknown integrator: %s\n", name.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    string sizeOf(const string &system, const Options &options) {
+        char buffer[32];
+        if (system == "cloth")
+            std::snprintf(buffer, sizeof(buffer), "[%u, %u]", options.cloth_x, options.cloth_y);
+        else
+            std::snprintf(buffer, sizeof(buffer), "[%u]",
+                          system == "pendulum" ? options.pendulum : system == "sprinkler" ? options.sprinkler : options.fluid);
+        return buffer;
+    }
+
+    // Steps one system with one integrator and returns the JSON object of the results. The first
+    // step is reported apart, since it sizes the buffers of the workspace, and is not timed.
+    string benchmark(const string &system, const Integrator &integrator, const Options &options) {
+        auto ps = makeSystem(system, options);
+        ps->setParallel(options.parallel);
+        unique_ptr<Run> run(new Run(*ps));
+#ifdef EIGEN_SPARSECORE_MODULE_H
+        run->J = SparseMatrix(ps->state().size() * 3, ps->state().size() * 3);
+#endif
+        // Particles are counted as (position, velocity) pairs of state, so the sprinkler counts
+        // its whole capacity.
+        const auto particles = ps->state().size() / 2;
+
+        double initial_energy = 0.0, final_energy = 0.0;
+        const auto has_energy = energy(system, *ps, initial_energy);
+
+        const size_t first_allocations_before = s_allocations;
+        integrator.step(*run, options.step);
+        run->initial = false;
+        const size_t first_allocations = s_allocations - first_allocations_before;
+
+        const size_t allocations_before = s_allocations;
+        Timer timer(true);
+        for (int s = 1; s < options.steps; ++s) {
+            integrator.step(*run, options.step);
+            run->initial = false;
+        }
+        const auto seconds = double(timer.getElapsed());
+        const size_t allocations = s_allocations - allocations_before;
+
+        const auto timed_steps = options.steps - 1;
+        const auto ns = timed_steps > 0 ? 1e9 * seconds / (double(timed_steps) * double(particles)) : 0.0;
+        const auto stable = finite(ps->state());
+        if (has_energy)
+            energy(system, *ps, final_energy);
+
+        string json = "{\"system\": \"" + system + "\", \"size\": " + sizeOf(system, options) + ", \"particles\": " + to_string(particles) +
+                      ", \"integrator\": \"" + integrator.name + "\", \"seconds\": " + number(seconds) + ", \"ns_per_particle_step\": " + number(ns) +
+                      ", \"allocations\": " +
+                      (integrator.counts_allocations
+                           ? "{\"first_step\": " + to_string(first_allocations) + ", \"later_steps\": " + to_string(allocations) + "}"
+                           : string("null")) +
+                      ", \"finite\": " + (stable ? "true" : "false") + ", \"energy\": ";
+        // The drift is absolute: the potential energy is zero at an arbitrary height, y = 0, where
+        // the cloth starts out, so the energy the drift would be relative to means nothing.
+        if (has_energy)
+            json += "{\"initial\": " + number(initial_energy) + ", \"final\": " + number(final_energy) +
+                    ", \"drift\": " + number(final_energy - initial_energy) + "}";
+        else
+            json += "null";
+        if (!strcmp(integrator.name, "adaptive")) {
+            const auto &adaptive = run->ws.adaptive;
+            json += ", \"adaptive\": {\"accepted\": " + to_string(adaptive.accepted) + ", \"rejected\": " + to_string(adaptive.rejected) +
+                    ", \"evaluations\": " + to_string(adaptive.evaluations) + "}";
+        }
+        return json + "}";
+    }
+
+} // namespace
+
+void FW::init(void) {
+    // No window is opened, so Main returns as soon as this does.
+    Options options;
+    if (!parseOptions(options)) {
+        exitCode = 1;
+        return;
+    }
+    if (!adaptiveStopsWhenNonFinite()) {
+        std::fprintf(stderr, "The adaptive integrator kept stepping a non-finite state\n");
+        exitCode = 1;
+        return;
+    }
+
+    std::printf("{\"steps\": %d, \"step\": %s, \"parallel\": %s, \"runs\": [", options.steps, number(options.step).c_str(),
+                options.parallel ? "true" : "false");
+    auto first = true;
+    for (const auto system : SYSTEMS) {
+        if (!selected(options.systems, system))
+            continue;
+        for (const auto &integrator : INTEGRATORS) {
+            if (!selected(options.integrators, integrator.name))
+                continue;
+            std::printf("%s\n  %s", first ? "" : ",", benchmark(system, integrator, options).c_str());
+            std::fflush(stdout);
+            first = false;
+        }
+    }
+    std::printf("\n]}\n");
+}
@@ -2,97 +2,347 @@
 #include "particle_systems.hpp"
 #include "utility.hpp"
 
-auto takeStep(const State &state, const State &f, float step) {
-    auto next_state = State(state.size());
-    int idx = 0;
-    for (auto &particle_state : next_state) {
-        particle_state = state[idx] + f[idx] * step;
-        idx++;
+#include <cmath>
+
+namespace {
+
+    // y = x + a * d, reusing the storage of y.
+    void axpy(const State &x, float a, const State &d, State &y) {
+        const auto n = x.size();
+        y.resize(n);
+        for (size_t i = 0; i < n; ++i)
+            y[i] = x[i] + a * d[i];
     }
-    return next_state;
-}
 
-auto eulerHelper(ParticleSystem &ps, float step) {
-    auto const &current_state = ps.state();
-    auto f = ps.evalF(current_state);
-    auto next_state = State(current_state.size());
-    int idx = 0;
-    for (auto &particle_state : next_state) {
-        particle_state = current_state[idx] + f[idx] * step;
-        idx++;
+    // y = x + h * (a[0] * k[0] + ... + a[stages - 1] * k[stages - 1]), reusing the storage of y.
+    void combine(const State &x, float h, const float *a, const State *const *k, int stages, State &y) {
+        const auto n = x.size();
+        y.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            auto sum = a[0] * (*k[0])[i];
+            for (int s = 1; s < stages; ++s)
+                sum += a[s] * (*k[s])[i];
+            y[i] = x[i] + h * sum;
+        }
+    }
+
+    bool isFinite(const State &x) {
+        for (const auto &v : x)
+            if (!std::isfinite(v.x) || !std::isfinite(v.y) || !std::isfinite(v.z))
+                return false;
+        return true;
     }
-    return next_state;
-};
 
-void eulerStep(ParticleSystem &ps, float step) {
+} // namespace
+
+void eulerStep(ParticleSystem &ps, float step, IntegratorWorkspace &ws) {
     // YOUR CODE HERE (R1)
     // Implement an Euler integrator.
-    ps.set_state(eulerHelper(ps, step));
+    const auto &x0 = ps.state();
+    ps.evalF(x0, ws.k1);
+    axpy(x0, step, ws.k1, ws.next);
+    ps.swap_state(ws.next);
 };
 
-void trapezoidStep(ParticleSystem &ps, float step) {
+void trapezoidStep(ParticleSystem &ps, float step, IntegratorWorkspace &ws) {
     // YOUR CODE HERE (R3)
     // Implement a trapezoid integrator.
-    auto const &current_state = ps.state();
-    auto const f0 = ps.evalF(current_state);
-    auto f1 = ps.evalF(eulerHelper(ps, step));
-    auto next_state = State(f0.size());
-    int idx = 0;
-    for (auto &particle_state : next_state) {
-        particle_state = current_state[idx] + step * 0.5f * (f0[idx] + f1[idx]);
-        idx++;
-    }
-    ps.set_state(next_state);
+    const auto &x0 = ps.state();
+    ps.evalF(x0, ws.k1);
+    axpy(x0, step, ws.k1, ws.temp);
+    ps.evalF(ws.temp, ws.k2);
+    const auto n = x0.size();
+    ws.next.resize(n);
+    for (size_t i = 0; i < n; ++i)
+        ws.next[i] = x0[i] + step * 0.5f * (ws.k1[i] + ws.k2[i]);
+    ps.swap_state(ws.next);
 }
 
-void midpointStep(ParticleSystem &ps, float step) {
+void midpointStep(ParticleSystem &ps, float step, IntegratorWorkspace &ws) {
     const auto &x0 = ps.state();
-    auto n = x0.size();
-    auto f0 = ps.evalF(x0);
-    auto xm = State(n), x1 = State(n);
-    for (auto i = 0u; i < n; ++i) {
-        xm[i] = x0[i] + (0.5f * step) * f0[i];
-    }
-    auto fm = ps.evalF(xm);
-    for (auto i = 0u; i < n; ++i) {
-        x1[i] = x0[i] + step * fm[i];
-    }
-    ps.set_state(x1);
+    ps.evalF(x0, ws.k1);
+    axpy(x0, 0.5f * step, ws.k1, ws.temp);
+    ps.evalF(ws.temp, ws.k2);
+    axpy(x0, step, ws.k2, ws.next);
+    ps.swap_state(ws.next);
 }
 
-void rk4Step(ParticleSystem &ps, float step) {
+void rk4Step(ParticleSystem &ps, float step, IntegratorWorkspace &ws) {
     // EXTRA: Implement the RK4 Runge-Kutta integrator.
     const auto &x0 = ps.state();
-    auto k1 = ps.evalF(x0);
-    auto n = x0.size();
-
-    auto state_for_k2 = takeStep(x0, k1, step / 2);
-    auto k2 = ps.evalF(state_for_k2);
-    auto state_for_k3 = takeStep(x0, k2, step / 2);
-    auto k3 = ps.evalF(state_for_k3);
-    auto state_for_k4 = takeStep(x0, k3, step);
-    auto k4 = ps.evalF(state_for_k4);
-
-    auto next_state = State(n);
-    int idx = 0;
-    for (auto &particle_state : next_state) {
-        particle_state = x0[idx] + step * 0.1667f * (k1[idx] + 2.0f * k2[idx] + 2.0f * k3[idx] + k4[idx]);
-        idx++;
+    ps.evalF(x0, ws.k1);
+    axpy(x0, step / 2, ws.k1, ws.temp);
+    ps.evalF(ws.temp, ws.k2);
+    axpy(x0, step / 2, ws.k2, ws.temp);
+    ps.evalF(ws.temp, ws.k3);
+    axpy(x0, step, ws.k3, ws.temp);
+    ps.evalF(ws.temp, ws.k4);
+
+    const auto n = x0.size();
+    ws.next.resize(n);
+    for (size_t i = 0; i < n; ++i)
+        ws.next[i] = x0[i] + (step / 6.0f) * (ws.k1[i] + 2.0f * ws.k2[i] + 2.0f * ws.k3[i] + ws.k4[i]);
+    ps.swap_state(ws.next);
+}
+
+void adaptiveStep(ParticleSystem &ps, float step, IntegratorWorkspace &ws) {
+    // EXTRA: Adaptive step length. The Dormand-Prince tableau, from Hairer, Norsett and Wanner,
+    // Solving Ordinary Differential Equations I.
+    static const float a2[] = {1.0f / 5};
+    static const float a3[] = {3.0f / 40, 9.0f / 40};
+    static const float a4[] = {44.0f / 45, -56.0f / 15, 32.0f / 9};
+    static const float a5[] = {19372.0f / 6561, -25360.0f / 2187, 64448.0f / 6561, -212.0f / 729};
+    static const float a6[] = {9017.0f / 3168, -355.0f / 33, 46732.0f / 5247, 49.0f / 176, -5103.0f / 18656};
+    static const float b[] = {35.0f / 384, 0.0f, 500.0f / 1113, 125.0f / 192, -2187.0f / 6784, 11.0f / 84};
+    // 5th minus 4th order weights. The 4th order solution also weighs the derivative at the end.
+    static const float e[] = {71.0f / 57600, 0.0f, -71.0f / 16695, 71.0f / 1920, -17253.0f / 339200, 22.0f / 525, -1.0f / 40};
+
+    // The derivative at the end of a sub-step is not reused as the first of the next one,
+    // because swap_state may reorder the state, as the fluid does.
+    auto &control = ws.adaptive;
+    const State *const k[] = {&ws.k1, &ws.k2, &ws.k3, &ws.k4, &ws.k5, &ws.k6, &ws.k7};
+    if (control.next_step <= 0.0f)
+        control.next_step = step;
+    auto remaining = step;
+    while (remaining > 0.0f) {
+        const auto &x0 = ps.state();
+        const auto trial = FW::max(control.next_step, control.min_step);
+        // Stretch the last sub-step a little rather than leave a sliver of the step for another.
+        const auto last = trial >= 0.999f * remaining;
+        const auto h = last ? remaining : trial;
+
+        ps.evalF(x0, ws.k1);
+        combine(x0, h, a2, k, 1, ws.temp);
+        ps.evalF(ws.temp, ws.k2);
+        combine(x0, h, a3, k, 2, ws.temp);
+        ps.evalF(ws.temp, ws.k3);
+        combine(x0, h, a4, k, 3, ws.temp);
+        ps.evalF(ws.temp, ws.k4);
+        combine(x0, h, a5, k, 4, ws.temp);
+        ps.evalF(ws.temp, ws.k5);
+        combine(x0, h, a6, k, 5, ws.temp);
+        ps.evalF(ws.temp, ws.k6);
+        combine(x0, h, b, k, 6, ws.next);
+        ps.evalF(ws.next, ws.k7);
+        control.evaluations += 7;
+
+        const auto n = x0.size();
+        auto sum = 0.0f;
+        for (size_t i = 0; i < n; ++i) {
+            auto d = e[0] * ws.k1[i];
+            for (int s = 1; s < 7; ++s)
+                d += e[s] * (*k[s])[i];
+            for (int c = 0; c < 3; ++c) {
+                const auto scale = control.tolerance * (1.0f + FW::max(FW::abs(x0[i][c]), FW::abs(ws.next[i][c])));
+                sum += FW::pow(h * d[c] / scale, 2.0f);
+            }
+        }
+        const auto error = n ? FW::sqrt(sum / float(3 * n)) : 0.0f;
+        if (!std::isfinite(error) && !isFinite(x0)) {
+            // No step length gets a state that has already blown up back to finite values, and
+            // shrinking the sub-steps towards min_step would only stall the caller. Give up on
+            // the rest of the step and leave the state as it is.
+            ++control.rejected;
+            break;
+        }
+        // The error estimate is of 4th order, so the step length scales with its 1/5th power.
+        // The usual safety factor and limits keep the controller from overshooting. An error
+        // that overflowed, or is NaN, from a finite state counts as the worst case.
+        const auto factor = !std::isfinite(error) ? 0.2f : error > 0.0f ? FW::clamp(0.9f * FW::pow(error, -0.2f), 0.2f, 5.0f) : 5.0f;
+
+        if (error <= 1.0f || h <= control.min_step) {
+            ++control.accepted;
+            remaining = last ? 0.0f : remaining - h;
+            // A last sub-step that was cut short to end the step is no reason to try shorter ones
+            // next, unless its error asks for them.
+            control.next_step = last && factor >= 1.0f ? FW::max(trial, h * factor) : h * factor;
+            ps.swap_state(ws.next);
+        } else {
+            ++control.rejected;
+            control.next_step = h * FW::min(factor, 1.0f);
+        }
     }
-    ps.set_state(next_state);
+}
+
+void xpbdStep(ParticleSystem &ps, float step, IntegratorWorkspace &ws) {
+    MassSpring mass_spring;
+    if (ps.getMassSpring(mass_spring))
+        ws.xpbd.step(ps, mass_spring, step, ws.k1, ws.next);
+    else
+        rk4Step(ps, step, ws);
 }
 
 #ifdef EIGEN_SPARSECORE_MODULE_H
 
-void implicit_euler_step(ParticleSystem &ps, float step, SparseMatrix &J, SparseLU &solver, bool initial) {
+namespace {
+
+    // Newton iterations run after the first linear solve. Each one evaluates the Jacobian again and
+    // refactorizes the matrix numerically, reusing the symbolic analysis of its pattern.
+    const int IMPLICIT_NEWTON_ITERATIONS = 1;
+
+    enum ImplicitMethod { IMPLICIT_EULER, IMPLICIT_MIDPOINT, CRANK_NICOLSON };
+
+    static_assert(sizeof(FW::Vec3f) == 3 * sizeof(float), "states are viewed as flat float arrays");
+
+    Eigen::Map<Eigen::VectorXf> asVector(State &s) {
+        return Eigen::Map<Eigen::VectorXf>(&s[0].x, Eigen::Index(3 * s.size()));
+    }
+
+    Eigen::Map<const Eigen::VectorXf> asVector(const State &s) {
+        return Eigen::Map<const Eigen::VectorXf>(&s[0].x, Eigen::Index(3 * s.size()));
+    }
+
+    // Builds system = I - scale * J with the union of the patterns of I and J, and records where each
+    // value of J and each diagonal entry ends up in the values of system. Both matrices are compressed,
+    // so the row indices within each column are sorted.
+    void buildSystem(const SparseMatrix &J, float scale, IntegratorWorkspace &ws) {
+        SparseMatrix identity(J.rows(), J.cols());
+        identity.setIdentity();
+        ws.system = identity - scale * J;
+        ws.system.makeCompressed();
+
+        ws.jacobian_slots.resize(size_t(J.nonZeros()));
+        ws.diagonal_slots.resize(size_t(J.cols()));
+        for (Eigen::Index col = 0; col < J.cols(); ++col) {
+            auto slot = ws.system.outerIndexPtr()[col];
+            for (auto k = J.outerIndexPtr()[col]; k < J.outerIndexPtr()[col + 1]; ++k) {
+                while (ws.system.innerIndexPtr()[slot] != J.innerIndexPtr()[k])
+                    ++slot;
+                ws.jacobian_slots[size_t(k)] = slot;
+            }
+            slot = ws.system.outerIndexPtr()[col];
+            while (ws.system.innerIndexPtr()[slot] != col)
+                ++slot;
+            ws.diagonal_slots[size_t(col)] = slot;
+        }
+    }
+
+    // Refreshes the values of system = I - scale * J without touching its pattern.
+    void updateSystem(const SparseMatrix &J, float scale, IntegratorWorkspace &ws) {
+        ws.system.coeffs().setZero();
+        auto *values = ws.system.valuePtr();
+        const auto *jacobian = J.valuePtr();
+        for (size_t k = 0; k < ws.jacobian_slots.size(); ++k)
+            values[ws.jacobian_slots[k]] -= scale * jacobian[k];
+        for (auto slot : ws.diagonal_slots)
+            values[slot] += 1.0f;
+    }
+
+    // Matrix-free counterpart of implicitStep for mass-spring systems, with the same Newton
+    // iterations. k3 holds the step and k4 its corrections.
+    void implicitStepMatrixFree(ParticleSystem &ps, const MassSpring &system, float step, IntegratorWorkspace &ws, ImplicitMethod method) {
+        const auto &x0 = ps.state();
+        const auto n = x0.size();
+        const auto scale = method == IMPLICIT_EULER ? step : 0.5f * step;
+        const auto evaluation_point = method == IMPLICIT_MIDPOINT ? 0.5f : 1.0f;
+        auto &solver = ws.mass_spring_solver;
+        auto &delta = ws.k3;
+
+        ps.evalF(x0, ws.k1);
+        ws.k2.resize(n);
+        for (size_t i = 0; i < n; ++i)
+            ws.k2[i] = step * ws.k1[i];
+        solver.setup(system, x0, scale);
+        solver.solve(ws.k2, delta);
+
+        for (int iteration = 0; iteration < IMPLICIT_NEWTON_ITERATIONS; ++iteration) {
+            axpy(x0, evaluation_point, delta, ws.temp);
+            ps.evalF(ws.temp, ws.k2);
+            solver.setup(system, ws.temp, scale);
+            for (size_t i = 0; i < n; ++i) {
+                const auto f = method == CRANK_NICOLSON ? 0.5f * (ws.k1[i] + ws.k2[i]) : ws.k2[i];
+                ws.k2[i] = step * f - delta[i];
+            }
+            solver.solve(ws.k2, ws.k4);
+            for (size_t i = 0; i < n; ++i)
+                delta[i] += ws.k4[i];
+        }
+
+        axpy(x0, 1.0f, delta, ws.next);
+        ps.swap_state(ws.next);
+    }
+
+    // Solves for the step dY of the given implicit method with Newton's method:
+    //   implicit Euler:    dY = h f(Y + dY)
+    //   implicit midpoint: dY = h f(Y + dY / 2)
+    //   Crank-Nicolson:    dY = h / 2 (f(Y) + f(Y + dY))
+    // Each iteration solves (I - c h J) d = residual, with J evaluated where f is evaluated
+    // and c = 1 for implicit Euler and 1/2 otherwise. The first one starts from dY = 0, where
+    // all three methods have the residual h f(Y). Freezing J at Y for the later iterations
+    // would save the refactorizations, but makes large steps of stiff cloth diverge.
+    void implicitStep(ParticleSystem &ps, float step, SparseMatrix &J, SparseLU &solver, bool initial, IntegratorWorkspace &ws, ImplicitMethod method) {
+        const auto &x0 = ps.state();
+        const auto n = x0.size();
+        if (!n) {
+            // Nothing to solve, but systems such as the sprinkler still need to see the step.
+            ws.next.clear();
+            ps.swap_state(ws.next);
+            return;
+        }
+        MassSpring mass_spring;
+        if (ws.matrix_free && ps.getMassSpring(mass_spring)) {
+            implicitStepMatrixFree(ps, mass_spring, step, ws, method);
+            return;
+        }
+        const auto dim = Eigen::Index(3 * n);
+
+        // Particle systems with a varying number of particles need a new pattern whenever the size changes.
+        initial = initial || J.rows() != dim || J.cols() != dim;
+        if (initial)
+            J = SparseMatrix(dim, dim);
+        ps.evalJ(x0, J, initial);
+        J.makeCompressed();
+
+        // The implicit midpoint and Crank-Nicolson methods see half of the Jacobian.
+        const auto scale = method == IMPLICIT_EULER ? step : 0.5f * step;
+        if (initial || size_t(J.nonZeros()) != ws.jacobian_slots.size()) {
+            buildSystem(J, scale, ws);
+            solver.analyzePattern(ws.system);
+        } else {
+            updateSystem(J, scale, ws);
+        }
+        solver.factorize(ws.system);
+        assert(solver.info() == Eigen::Success && "factorization of the implicit system failed");
+
+        ps.evalF(x0, ws.k1);
+        ws.rhs = step * asVector(ws.k1);
+        ws.delta = solver.solve(ws.rhs);
+
+        const auto evaluation_point = method == IMPLICIT_MIDPOINT ? 0.5f : 1.0f;
+        ws.temp.resize(n);
+        for (int iteration = 0; iteration < IMPLICIT_NEWTON_ITERATIONS; ++iteration) {
+            asVector(ws.temp) = asVector(x0) + evaluation_point * ws.delta;
+            ps.evalF(ws.temp, ws.k2);
+            ps.evalJ(ws.temp, J, false);
+            updateSystem(J, scale, ws);
+            solver.factorize(ws.system);
+            assert(solver.info() == Eigen::Success && "factorization of the implicit system failed");
+            if (method == CRANK_NICOLSON)
+                ws.rhs = 0.5f * step * (asVector(ws.k1) + asVector(ws.k2)) - ws.delta;
+            else
+                ws.rhs = step * asVector(ws.k2) - ws.delta;
+            ws.delta += solver.solve(ws.rhs);
+        }
+
+        ws.next.resize(n);
+        asVector(ws.next) = asVector(x0) + ws.delta;
+        ps.swap_state(ws.next);
+    }
+
+} // namespace
+
+void implicit_euler_step(ParticleSystem &ps, float step, SparseMatrix &J, SparseLU &solver, bool initial, IntegratorWorkspace &ws) {
     // EXTRA: Implement the implicit Euler integrator. (Note that the related formula on page 134 on the lecture slides is missing a 'h'; the formula should be (I-h*Jf(Yi))DY=-F(Yi))
+    implicitStep(ps, step, J, solver, initial, ws, IMPLICIT_EULER);
 }
 
-void implicit_midpoint_step(ParticleSystem &ps, float step, SparseMatrix &J, SparseLU &solver, bool initial) {
+void implicit_midpoint_step(ParticleSystem &ps, float step, SparseMatrix &J, SparseLU &solver, bool initial, IntegratorWorkspace &ws) {
     // EXTRA: Implement the implicit midpoint integrator.
+    implicitStep(ps, step, J, solver, initial, ws, IMPLICIT_MIDPOINT);
 }
 
-void crank_nicolson_step(ParticleSystem &ps, float step, SparseMatrix &J, SparseLU &solver, bool initial) {
+void crank_nicolson_step(ParticleSystem &ps, float step, SparseMatrix &J, SparseLU &solver, bool initial, IntegratorWorkspace &ws) {
     // EXTRA: Implement the crank-nicolson integrator.
+    implicitStep(ps, step, J, solver, initial, ws, CRANK_NICOLSON);
 }
 #endif
@@ -1,19 +1,74 @@
 #pragma once
 
-class ParticleSystem;
+#include "mass_spring_solver.hpp"
+#include "particle_systems.hpp"
+#include "xpbd_solver.hpp"
 
-void eulerStep(ParticleSystem& ps, float step);
+// Error control of adaptiveStep. A sub-step is accepted when the root mean square of its error
+// estimate, with every component divided by tolerance * (1 + its magnitude), is at most 1.
+struct AdaptiveStepControl
+{
+	float	tolerance = 1e-3f;
+	float	min_step = 1e-6f;	// sub-steps this short are accepted whatever their error
+	float	next_step = 0.0f;	// length of the next trial sub-step, 0 before the first step
 
-void trapezoidStep(ParticleSystem& ps, float step);
+	// Totals since the last reset, for display
+	int		accepted = 0, rejected = 0, evaluations = 0;
+	void	resetStats() { accepted = rejected = evaluations = 0; }
+};
 
-void midpointStep(ParticleSystem& ps, float step);
+// Scratch states owned by the caller of the integrators. The buffers keep their storage
+// between steps, and the finished step is swapped into the particle system, so stepping
+// a system of constant size allocates no memory after the first step.
+struct IntegratorWorkspace
+{
+	State	k1, k2, k3, k4;		// derivatives
+	State	k5, k6, k7;			// more derivatives for adaptiveStep
+	State	temp;				// intermediate state
+	State	next;				// next state, holds the previous state after a step
 
-void rk4Step(ParticleSystem& ps, float step);
+	// Position-based solver of xpbdStep, with its sub-step and iteration counts.
+	XpbdSolver	xpbd;
+
+	// Step length control of adaptiveStep.
+	AdaptiveStepControl	adaptive;
+
+#ifdef EIGEN_SPARSECORE_MODULE_H
+	// The matrix I - c * step * J of the implicit integrators, and where each value of the
+	// compressed Jacobian and each diagonal entry lives in its value array. Kept so that the
+	// matrix only needs its values refreshed while the sparsity pattern stays the same.
+	SparseMatrix				system;
+	std::vector<Eigen::Index>	jacobian_slots;
+	std::vector<Eigen::Index>	diagonal_slots;
+	Eigen::VectorXf				rhs, delta;
+
+	// Solve systems that provide a MassSpring description with conjugate gradients instead of SparseLU.
+	bool						matrix_free = false;
+	MassSpringSolver			mass_spring_solver;
+#endif
+};
+
+void eulerStep(ParticleSystem& ps, float step, IntegratorWorkspace& ws);
+
+void trapezoidStep(ParticleSystem& ps, float step, IntegratorWorkspace& ws);
+
+void midpointStep(ParticleSystem& ps, float step, IntegratorWorkspace& ws);
+
+void rk4Step(ParticleSystem& ps, float step, IntegratorWorkspace& ws);
+
+// Advances by step in as many sub-steps of the Dormand-Prince 5(4) embedded Runge-Kutta method
+// as ws.adaptive demands. The sub-step length carries over from call to call.
+void adaptiveStep(ParticleSystem& ps, float step, IntegratorWorkspace& ws);
+
+// Steps systems that provide a MassSpring description with XPBD, see XpbdSolver, and other systems with RK4.
+void xpbdStep(ParticleSystem& ps, float step, IntegratorWorkspace& ws);
 
 #ifdef EIGEN_SPARSECORE_MODULE_H
 
 // These enable us to pass in the Jacobian and solver in order to save some state and avoid memory reallocations.
-void implicit_euler_step(ParticleSystem& ps, float step, SparseMatrix& J, SparseLU& solver, bool initial);
-void implicit_midpoint_step(ParticleSystem& ps, float step, SparseMatrix& J, SparseLU& solver, bool initial);
-void crank_nicolson_step(ParticleSystem& ps, float step, SparseMatrix& J, SparseLU& solver, bool initial);
+// When initial is set (or the size of the system has changed), the sparsity pattern of the Jacobian is rebuilt
+// and the solver analyzes it again; otherwise only the numerical factorization is redone.
+void implicit_euler_step(ParticleSystem& ps, float step, SparseMatrix& J, SparseLU& solver, bool initial, IntegratorWorkspace& ws);
+void implicit_midpoint_step(ParticleSystem& ps, float step, SparseMatrix& J, SparseLU& solver, bool initial, IntegratorWorkspace& ws);
+void crank_nicolson_step(ParticleSystem& ps, float step, SparseMatrix& J, SparseLU& solver, bool initial, IntegratorWorkspace& ws);
 #endif
@@ -0,0 +1,146 @@
+#include "mass_spring_solver.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+using namespace FW;
+
+const float MassSpringSolver::TOLERANCE = 1e-4f;
+
+namespace {
+
+    float dotStates(const State &a, const State &b) {
+        float sum = 0.0f;
+        for (size_t i = 0; i < a.size(); ++i)
+            sum += dot(a[i], b[i]);
+        return sum;
+    }
+
+} // namespace
+
+void MassSpringSolver::setup(const MassSpring &system, const State &state, float scale) {
+    const auto &springs = *system.springs;
+    num_particles_ = unsigned(state.size() / 2);
+    mass_ = system.mass;
+    damped_mass_ = system.mass + scale * system.drag_k;
+    scale_ = scale;
+    fixed_.assign(system.fixed, system.fixed + system.num_fixed);
+
+    const auto num_springs = springs.size();
+    spring_i1_.resize(num_springs);
+    spring_i2_.resize(num_springs);
+    direction_.resize(num_springs);
+    across_.resize(num_springs);
+    along_.resize(num_springs);
+    preconditioner_.resize(num_particles_);
+    for (auto &block : preconditioner_) {
+        block.setZero();
+        for (int i = 0; i < 3; ++i)
+            block(i, i) = damped_mass_;
+    }
+
+    const auto scale2 = scale * scale;
+    for (size_t s = 0; s < num_springs; ++s) {
+        const auto &spring = springs[s];
+        assert(spring.i1 < num_particles_ && spring.i2 < num_particles_ && "spring endpoint out of range");
+        const auto d = state[2 * spring.i1] - state[2 * spring.i2];
+        const auto len = d.length();
+        spring_i1_[s] = spring.i1;
+        spring_i2_[s] = spring.i2;
+        if (len <= 0.0f) {
+            direction_[s] = Vec3f(0.0f);
+            across_[s] = along_[s] = 0.0f;
+            continue;
+        }
+        // -K = k (stretch (I - n n^T) + n n^T), with compressed springs treated as if they were at rest length.
+        const auto stretch = FW::max(0.0f, 1.0f - spring.rlen / len);
+        direction_[s] = d / len;
+        across_[s] = spring.k * stretch;
+        along_[s] = spring.k * (1.0f - stretch);
+
+        Mat3f block;
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j)
+                block(i, j) = scale2 * (along_[s] * direction_[s][i] * direction_[s][j] + (i == j ? across_[s] : 0.0f));
+        }
+        preconditioner_[spring.i1] += block;
+        preconditioner_[spring.i2] += block;
+    }
+    for (auto &block : preconditioner_)
+        block = block.inverted();
+}
+
+void MassSpringSolver::multiplyStiffness(const State &u, State &out) const {
+    out.assign(num_particles_, Vec3f(0.0f));
+    for (size_t s = 0; s < spring_i1_.size(); ++s) {
+        const auto i1 = spring_i1_[s], i2 = spring_i2_[s];
+        const auto du = u[i1] - u[i2];
+        const auto &n = direction_[s];
+        const auto f = across_[s] * du + along_[s] * dot(n, du) * n;
+        out[i1] += f;
+        out[i2] -= f;
+    }
+}
+
+void MassSpringSolver::multiplySystem(const State &u, State &out) const {
+    multiplyStiffness(u, out);
+    const auto scale2 = scale_ * scale_;
+    for (unsigned i = 0; i < num_particles_; ++i)
+        out[i] = damped_mass_ * u[i] + scale2 * out[i];
+    clearFixed(out);
+}
+
+void MassSpringSolver::clearFixed(State &u) const {
+    for (auto i : fixed_)
+        u[i] = Vec3f(0.0f);
+}
+
+void MassSpringSolver::solve(const State &r, State &d) {
+    assert(r.size() == 2 * size_t(num_particles_) && "right hand side does not match the system");
+
+    // Right hand side m r_v + scale K r_x of the velocity system.
+    rx_.resize(num_particles_);
+    for (unsigned i = 0; i < num_particles_; ++i)
+        rx_[i] = r[2 * i];
+    multiplyStiffness(rx_, rhs_);
+    for (unsigned i = 0; i < num_particles_; ++i)
+        rhs_[i] = mass_ * r[2 * i + 1] - scale_ * rhs_[i];
+    clearFixed(rhs_);
+
+    // Preconditioned conjugate gradients from zero, restricted to the free particles.
+    x_.assign(num_particles_, Vec3f(0.0f));
+    residual_ = rhs_;
+    z_.resize(num_particles_);
+    for (unsigned i = 0; i < num_particles_; ++i)
+        z_[i] = preconditioner_[i] * residual_[i];
+    p_ = z_;
+    auto rz = dotStates(residual_, z_);
+    const auto threshold = TOLERANCE * TOLERANCE * dotStates(rhs_, rhs_);
+    iterations_ = 0;
+    while (iterations_ < MAX_ITERATIONS && dotStates(residual_, residual_) > threshold) {
+        multiplySystem(p_, q_);
+        const auto alpha = rz / dotStates(p_, q_);
+        for (unsigned i = 0; i < num_particles_; ++i) {
+            x_[i] += alpha * p_[i];
+            residual_[i] -= alpha * q_[i];
+            z_[i] = preconditioner_[i] * residual_[i];
+        }
+        const auto rz_next = dotStates(residual_, z_);
+        const auto beta = rz_next / rz;
+        rz = rz_next;
+        for (unsigned i = 0; i < num_particles_; ++i)
+            p_[i] = z_[i] + beta * p_[i];
+        ++iterations_;
+    }
+
+    d.resize(r.size());
+    for (unsigned i = 0; i < num_particles_; ++i) {
+        d[2 * i] = r[2 * i] + scale_ * x_[i];
+        d[2 * i + 1] = x_[i];
+    }
+    for (auto i : fixed_) {
+        d[2 * i] = r[2 * i];
+        d[2 * i + 1] = r[2 * i + 1];
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "particle_systems.hpp"
+
+#include <vector>
+
+// Solves the linear systems (I - scale * J) d = r of the implicit integrators for a MassSpring
+// system without assembling J, with memory linear in the number of particles and springs.
+//
+// Substituting the position rows d_x = r_x + scale * d_v into the velocity rows and multiplying
+// them by the mass leaves one equation for the velocity part:
+//   ((m + scale * drag_k) I - scale^2 K) d_v = m r_v + scale K r_x,
+// where K is the derivative of the spring forces with respect to the positions. The part of
+// each spring's K block that pushes compressed springs apart is dropped, which keeps -K
+// positive semidefinite, so the matrix is symmetric positive definite and conjugate gradients
+// apply. K is applied to vectors spring by spring, and the 3x3 diagonal blocks of the matrix
+// serve as a block-Jacobi preconditioner. Fixed particles keep d = r.
+class MassSpringSolver {
+public:
+    static const int MAX_ITERATIONS = 500;
+    // Relative residual at which the iteration stops.
+    static const float TOLERANCE;
+
+    // Linearizes the springs at "state" for solving with the given scale (step length times
+    // the weight of the Jacobian in the implicit method).
+    void setup(const MassSpring &system, const State &state, float scale);
+    // Solves for d, which is resized to the size of r.
+    void solve(const State &r, State &d);
+    // Conjugate gradient iterations taken by the last solve.
+    int getIterations() const { return iterations_; }
+
+private:
+    // out = -K u, accumulated spring by spring.
+    void multiplyStiffness(const State &u, State &out) const;
+    // out = A u for the velocity system, with the rows of fixed particles cleared.
+    void multiplySystem(const State &u, State &out) const;
+    void clearFixed(State &u) const;
+
+    unsigned num_particles_ = 0;
+    float mass_ = 1.0f;
+    float damped_mass_ = 1.0f; // m + scale * drag_k
+    float scale_ = 0.0f;
+    std::vector<unsigned> fixed_;
+    int iterations_ = 0;
+
+    // Springs linearized at the state: -K = a I + b n n^T for the unit direction n from i2 to i1.
+    std::vector<unsigned> spring_i1_, spring_i2_;
+    std::vector<FW::Vec3f> direction_;
+    std::vector<float> across_, along_;
+
+    // Inverses of the 3x3 diagonal blocks of the velocity system.
+    std::vector<FW::Mat3f> preconditioner_;
+
+    // Conjugate gradient vectors, one entry per particle.
+    State rx_, rhs_, x_, residual_, z_, p_, q_;
+};
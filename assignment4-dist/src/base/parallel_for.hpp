@@ -0,0 +1,32 @@
+#pragma once
+
+#include "base/MulticoreLauncher.hpp"
+
+#include <algorithm>
+
+// Calls body(begin, end) for consecutive ranges of at most grain indices that cover [0, count),
+// one MulticoreLauncher task per range, and returns once all of them are done. A single range
+// runs directly on the calling thread. The launcher should outlive the call: the threads of
+// MulticoreLauncher are shut down whenever its last instance is destroyed.
+template <typename Body>
+void parallelFor(FW::MulticoreLauncher &launcher, size_t count, size_t grain, const Body &body) {
+    if (count <= grain) {
+        if (count)
+            body(size_t(0), count);
+        return;
+    }
+
+    struct Ranges {
+        const Body *body;
+        size_t count, grain;
+
+        static void run(FW::MulticoreLauncher::Task &task) {
+            const auto &ranges = *(const Ranges *) task.data;
+            const auto begin = size_t(task.idx) * ranges.grain;
+            (*ranges.body)(begin, std::min(begin + ranges.grain, ranges.count));
+        }
+    };
+    Ranges ranges = {&body, count, grain};
+    launcher.push(Ranges::run, &ranges, 0, int((count + grain - 1) / grain));
+    launcher.popAll();
+}
@@ -0,0 +1,289 @@
+#include "particle_collisions.hpp"
+#include "parallel_for.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+using namespace FW;
+
+namespace {
+
+    // Penalty acceleration per unit of penetration, damping of the approach, and friction of
+    // sliding, all per unit of mass.
+    const float COLLISION_STIFFNESS = 20000.0f;
+    const float COLLISION_DAMPING = 20.0f;
+    const float COLLISION_FRICTION = 5.0f;
+
+    // A power of two of at least twice as many buckets as entries, so few cells share a bucket.
+    unsigned bucketCount(size_t entries) {
+        unsigned n = 1u;
+        while (n < 2 * entries)
+            n <<= 1;
+        return n;
+    }
+
+    // Closest point to p on the triangle abc, after Ericson, "Real-Time Collision Detection", 5.1.5.
+    Vec3f closestPointOnTriangle(const Vec3f &p, const Vec3f &a, const Vec3f &b, const Vec3f &c) {
+        const auto ab = b - a, ac = c - a, ap = p - a;
+        const auto d1 = dot(ab, ap), d2 = dot(ac, ap);
+        if (d1 <= 0.0f && d2 <= 0.0f)
+            return a;
+        const auto bp = p - b;
+        const auto d3 = dot(ab, bp), d4 = dot(ac, bp);
+        if (d3 >= 0.0f && d4 <= d3)
+            return b;
+        const auto vc = d1 * d4 - d3 * d2;
+        if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+            return a + d1 / (d1 - d3) * ab;
+        const auto cp = p - c;
+        const auto d5 = dot(ab, cp), d6 = dot(ac, cp);
+        if (d6 >= 0.0f && d5 <= d6)
+            return c;
+        const auto vb = d5 * d2 - d1 * d6;
+        if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+            return a + d2 / (d2 - d6) * ac;
+        const auto va = d3 * d6 - d5 * d4;
+        if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+            return b + (d4 - d3) / ((d4 - d3) + (d5 - d6)) * (c - b);
+        const auto denom = 1.0f / (va + vb + vc);
+        return a + ab * (vb * denom) + ac * (vc * denom);
+    }
+
+    // Acceleration of a contact that penetrates depth along the unit normal n, for the velocity
+    // v relative to the other side.
+    inline Vec3f contact(const Vec3f &n, float depth, const Vec3f &v) {
+        const auto vn = dot(v, n);
+        const auto vt = v - vn * n;
+        return (COLLISION_STIFFNESS * depth - COLLISION_DAMPING * FW::min(vn, 0.0f)) * n - COLLISION_FRICTION * vt;
+    }
+
+} // namespace
+
+void ParticleCollisions::clear() {
+    spheres_.clear();
+    planes_.clear();
+    vertices_.clear();
+    triangles_.clear();
+    triangle_bucket_start_.clear();
+    triangle_entries_.clear();
+}
+
+void ParticleCollisions::addSphere(const Vec3f &center, float radius) {
+    spheres_.push_back({center, radius});
+}
+
+void ParticleCollisions::addPlane(const Vec3f &normal, float offset) {
+    const auto len = normal.length();
+    assert(len > 0.0f && "plane normal must not be zero");
+    planes_.push_back({normal / len, offset / len});
+}
+
+void ParticleCollisions::addMesh(const vector<Vec3f> &vertices, const vector<Vec3i> &triangles) {
+    const auto base = int(vertices_.size());
+    vertices_.insert(vertices_.end(), vertices.begin(), vertices.end());
+    for (const auto &t : triangles) {
+        assert(t.min() >= 0 && t.max() < int(vertices.size()) && "triangle vertex out of range");
+        triangles_.push_back(t + base);
+    }
+    // The grid depends on the particle radius, so it is built by the next addForces.
+    triangle_bucket_start_.clear();
+}
+
+Vec3i ParticleCollisions::cellOf(const Vec3f &p, float cell_size) const {
+    return Vec3i(int(FW::floor(p.x / cell_size)), int(FW::floor(p.y / cell_size)), int(FW::floor(p.z / cell_size)));
+}
+
+unsigned ParticleCollisions::hashCell(const Vec3i &c, unsigned mask) {
+    return (unsigned(c.x) * 73856093u ^ unsigned(c.y) * 19349663u ^ unsigned(c.z) * 83492791u) & mask;
+}
+
+void ParticleCollisions::sortParticles(const State &state) {
+    // Counting sort: count the particles of each bucket, turn the counts into the first index of
+    // each bucket, and place the particles.
+    const auto n = unsigned(state.size() / 2);
+    const auto buckets = bucketCount(n);
+    const auto mask = buckets - 1;
+    const auto cell_size = 2.0f * radius_;
+    bucket_start_.assign(buckets + 1, 0u);
+    bucket_cursor_.resize(buckets + 1);
+    bucket_of_.resize(n);
+    sorted_.resize(n);
+    for (unsigned i = 0; i < n; ++i) {
+        bucket_of_[i] = hashCell(cellOf(state[2 * i], cell_size), mask);
+        ++bucket_start_[bucket_of_[i] + 1];
+    }
+    for (size_t b = 1; b < bucket_start_.size(); ++b)
+        bucket_start_[b] += bucket_start_[b - 1];
+    copy(bucket_start_.begin(), bucket_start_.end(), bucket_cursor_.begin());
+    for (unsigned i = 0; i < n; ++i)
+        sorted_[bucket_cursor_[bucket_of_[i]]++] = i;
+}
+
+void ParticleCollisions::buildTriangleGrid() {
+    // Cells about the size of a triangle keep both the copies per triangle and the triangles per
+    // cell low. Each triangle goes into every bucket its bounding box, grown by the particle radius,
+    // touches, once even if several of those cells share the bucket.
+    auto edges = 0.0f;
+    for (const auto &t : triangles_)
+        edges += (vertices_[t.y] - vertices_[t.x]).length() + (vertices_[t.z] - vertices_[t.y]).length() + (vertices_[t.x] - vertices_[t.z]).length();
+    triangle_cell_size_ = FW::max(2.0f * radius_, edges / (3.0f * float(triangles_.size())));
+
+    vector<pair<unsigned, unsigned>> entries; // (cell, triangle), hashed with the final mask below
+    for (unsigned t = 0; t < triangles_.size(); ++t) {
+        const auto &a = vertices_[triangles_[t].x], &b = vertices_[triangles_[t].y], &c = vertices_[triangles_[t].z];
+        const auto lo = cellOf(a.min(b).min(c) - radius_, triangle_cell_size_);
+        const auto hi = cellOf(a.max(b).max(c) + radius_, triangle_cell_size_);
+        for (int z = lo.z; z <= hi.z; ++z)
+            for (int y = lo.y; y <= hi.y; ++y)
+                for (int x = lo.x; x <= hi.x; ++x)
+                    entries.emplace_back(hashCell(Vec3i(x, y, z), ~0u), t);
+    }
+    const auto buckets = bucketCount(entries.size());
+    const auto mask = buckets - 1;
+    for (auto &e : entries)
+        e.first &= mask;
+    sort(entries.begin(), entries.end());
+    entries.erase(unique(entries.begin(), entries.end()), entries.end());
+
+    triangle_bucket_start_.assign(buckets + 1, 0u);
+    triangle_entries_.resize(entries.size());
+    for (size_t k = 0; k < entries.size(); ++k) {
+        ++triangle_bucket_start_[entries[k].first + 1];
+        triangle_entries_[k] = entries[k].second;
+    }
+    for (size_t b = 1; b < triangle_bucket_start_.size(); ++b)
+        triangle_bucket_start_[b] += triangle_bucket_start_[b - 1];
+}
+
+void ParticleCollisions::addForces(const State &state, State &f, bool parallel) {
+    assert(f.size() == state.size() && "derivative does not match the state");
+    if (self_collision_)
+        sortParticles(state);
+    if (!triangles_.empty() && triangle_bucket_start_.empty())
+        buildTriangleGrid();
+
+    const auto n = state.size() / 2;
+    if (parallel)
+        parallelFor(launcher_, n, PARALLEL_GRAIN, [&](size_t first, size_t end) { evalParticles(state, f, first, end); });
+    else
+        evalParticles(state, f, 0, n);
+}
+
+void ParticleCollisions::evalParticles(const State &state, State &f, size_t first, size_t end) const {
+    const auto r = radius_;
+    const auto diameter = 2.0f * r;
+    const auto particle_mask = unsigned(bucket_start_.size()) - 2u;
+    const auto triangle_mask = unsigned(triangle_bucket_start_.size()) - 2u;
+
+    for (auto i = first; i < end; ++i) {
+        const auto p = state[2 * i], v = state[2 * i + 1];
+        Vec3f a(0.0f);
+
+        for (const auto &plane : planes_) {
+            const auto d = dot(plane.normal, p) - plane.offset;
+            if (d < r)
+                a += contact(plane.normal, r - d, v);
+        }
+
+        for (const auto &sphere : spheres_) {
+            const auto d = p - sphere.center;
+            const auto len = d.length();
+            if (len < sphere.radius + r && len > 0.0f)
+                a += contact(d / len, sphere.radius + r - len, v);
+        }
+
+        // Only the nearest triangle pushes, so that the triangles that share an edge or a vertex
+        // don't push twice.
+        if (!triangles_.empty()) {
+            const auto bucket = hashCell(cellOf(p, triangle_cell_size_), triangle_mask);
+            auto nearest = r * r;
+            Vec3f nearest_d;
+            int nearest_t = -1;
+            for (auto k = triangle_bucket_start_[bucket]; k < triangle_bucket_start_[bucket + 1]; ++k) {
+                const auto &t = triangles_[triangle_entries_[k]];
+                const auto d = p - closestPointOnTriangle(p, vertices_[t.x], vertices_[t.y], vertices_[t.z]);
+                if (d.lenSqr() < nearest) {
+                    nearest = d.lenSqr();
+                    nearest_d = d;
+                    nearest_t = int(triangle_entries_[k]);
+                }
+            }
+            if (nearest_t >= 0) {
+                const auto len = FW::sqrt(nearest);
+                auto normal = nearest_d / len;
+                if (len <= 0.0f) {
+                    const auto &t = triangles_[nearest_t];
+                    normal = cross(vertices_[t.y] - vertices_[t.x], vertices_[t.z] - vertices_[t.x]).normalized();
+                }
+                a += contact(normal, r - len, v);
+            }
+        }
+
+        if (self_collision_) {
+            // The 27 cells around the particle, each bucket once even if several cells share it.
+            const auto c = cellOf(p, diameter);
+            unsigned buckets[27];
+            int num_buckets = 0;
+            for (int z = -1; z <= 1; ++z) {
+                for (int y = -1; y <= 1; ++y) {
+                    for (int x = -1; x <= 1; ++x) {
+                        const auto b = hashCell(c + Vec3i(x, y, z), particle_mask);
+                        if (find(buckets, buckets + num_buckets, b) == buckets + num_buckets)
+                            buckets[num_buckets++] = b;
+                    }
+                }
+            }
+            for (int k = 0; k < num_buckets; ++k) {
+                for (auto s = bucket_start_[buckets[k]]; s < bucket_start_[buckets[k] + 1]; ++s) {
+                    const auto j = sorted_[s];
+                    const auto d = p - state[2 * j];
+                    const auto len2 = d.lenSqr();
+                    if (j != i && len2 < diameter * diameter && len2 > 0.0f) {
+                        const auto len = FW::sqrt(len2);
+                        a += contact(d / len, diameter - len, v - state[2 * j + 1]);
+                    }
+                }
+            }
+        }
+
+        f[2 * i + 1] += a;
+    }
+}
+
+void ParticleCollisions::getLines(Lines &lines) const {
+    static const auto segments = 32;
+    const auto angle_incr = 2 * FW_PI / segments;
+    for (const auto &sphere : spheres_) {
+        // Three great circles.
+        for (int axis = 0; axis < 3; ++axis) {
+            for (int s = 0; s < segments; ++s) {
+                for (int e = s; e <= s + 1; ++e) {
+                    Vec3f q(0.0f);
+                    q[(axis + 1) % 3] = sphere.radius * FW::cos(angle_incr * e);
+                    q[(axis + 2) % 3] = sphere.radius * FW::sin(angle_incr * e);
+                    lines.push_back(sphere.center + q);
+                }
+            }
+        }
+    }
+    for (const auto &plane : planes_) {
+        // A grid of 2x2 units around the point of the plane closest to the origin.
+        const auto o = plane.normal * plane.offset;
+        const auto t1 = cross(plane.normal, FW::abs(plane.normal.x) < 0.9f ? Vec3f(1, 0, 0) : Vec3f(0, 1, 0)).normalized();
+        const auto t2 = cross(plane.normal, t1);
+        for (int k = -4; k <= 4; ++k) {
+            const auto s = 0.25f * k;
+            lines.push_back(o + s * t1 - t2);
+            lines.push_back(o + s * t1 + t2);
+            lines.push_back(o - t1 + s * t2);
+            lines.push_back(o + t1 + s * t2);
+        }
+    }
+    for (const auto &t : triangles_) {
+        for (int e = 0; e < 3; ++e) {
+            lines.push_back(vertices_[t[e]]);
+            lines.push_back(vertices_[t[(e + 1) % 3]]);
+        }
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "particle_systems.hpp"
+
+#include "base/MulticoreLauncher.hpp"
+
+#include <vector>
+
+// Collision of particles with each other and with static spheres, planes and triangle meshes,
+// for particle systems whose state is stored the usual way, as interleaved (position, velocity)
+// pairs of particles of equal mass. Every particle is a small sphere of the given radius, and
+// contacts push the particles out with a stiff penalty acceleration, damp their approach, and
+// brake their sliding with a little friction.
+//
+// The broad phase is a hashed uniform grid with cells one particle diameter wide, so it needs
+// no bounds and takes memory in proportion to the particle count alone. Every evaluation
+// counting-sorts the particles by hash bucket and each particle then tests the particles in the
+// buckets of the 27 cells around it. Triangles go into a second hashed grid under every cell
+// their bounding box touches, built by the first evaluation after the meshes change. Each
+// particle only writes its own acceleration, so the particles can be processed on multiple threads.
+class ParticleCollisions {
+public:
+    // Particles handled by one task of the parallel evaluation.
+    static const size_t PARALLEL_GRAIN = 1024u;
+
+    void setParticleRadius(float radius) {
+        radius_ = radius;
+        triangle_bucket_start_.clear();
+    }
+    float getParticleRadius() const { return radius_; }
+    void setSelfCollision(bool self_collision) { self_collision_ = self_collision; }
+
+    // Removes all colliders.
+    void clear();
+    void addSphere(const FW::Vec3f &center, float radius);
+    // Points p with dot(normal, p) >= offset are outside the plane.
+    void addPlane(const FW::Vec3f &normal, float offset);
+    void addMesh(const std::vector<FW::Vec3f> &vertices, const std::vector<FW::Vec3i> &triangles);
+
+    // Adds the collision accelerations of "state" to the velocity derivatives in f.
+    void addForces(const State &state, State &f, bool parallel = false);
+
+    // Appends a wireframe of the colliders to lines.
+    void getLines(Lines &lines) const;
+
+private:
+    struct Sphere {
+        FW::Vec3f center;
+        float radius;
+    };
+    struct Plane {
+        FW::Vec3f normal;
+        float offset;
+    };
+
+    FW::Vec3i cellOf(const FW::Vec3f &p, float cell_size) const;
+    static unsigned hashCell(const FW::Vec3i &c, unsigned mask);
+    void sortParticles(const State &state);
+    void buildTriangleGrid();
+    void evalParticles(const State &state, State &f, size_t first, size_t end) const;
+
+    float radius_ = 0.01f;
+    bool self_collision_ = true;
+
+    std::vector<Sphere> spheres_;
+    std::vector<Plane> planes_;
+    std::vector<FW::Vec3f> vertices_;
+    std::vector<FW::Vec3i> triangles_;
+
+    // Particles by hash bucket: bucket b holds particles sorted_[bucket_start_[b]] up to
+    // sorted_[bucket_start_[b + 1]]. The number of buckets is a power of two.
+    std::vector<unsigned> bucket_start_, bucket_cursor_, bucket_of_, sorted_;
+
+    // Triangles by hash bucket, the same way, in cells of triangle_cell_size_.
+    float triangle_cell_size_ = 1.0f;
+    std::vector<unsigned> triangle_bucket_start_, triangle_entries_;
+
+    FW::MulticoreLauncher launcher_;
+};
@@ -1,9 +1,12 @@
 #include "particle_systems.hpp"
+#include "parallel_for.hpp"
+#include "particle_collisions.hpp"
+#include "sph_fluid.hpp"
+#include "spring_forces.hpp"
 
 #include <algorithm>
 #include <cassert>
 #include <iostream>
-#include <list>
 #include <numeric>
 
 using namespace std;
@@ -11,6 +14,31 @@ using namespace FW;
 
 namespace {
 
+    const float PENDULUM_MASS = 0.5f;
+    const float PENDULUM_DRAG_K = 0.5f;
+    const float CLOTH_MASS = 0.025f;
+    const float CLOTH_DRAG_K = 0.08f;
+
+    // Sprinkler slots evaluated by one task of the parallel evaluation.
+    const size_t SPRINKLER_PARALLEL_GRAIN = 4096u;
+    // Simulated seconds a sprinkler particle lives.
+    const float SPRINKLER_LIFETIME = 5.0f;
+
+    // The fluid lives in the box [-FLUID_BOX_HALF_SIZE, FLUID_BOX_HALF_SIZE]^3 and fills this
+    // fraction of it.
+    const float FLUID_BOX_HALF_SIZE = 0.5f;
+    const float FLUID_FILL = 0.4f;
+
+    // The endpoints of each spring, in the order of the springs, as line indices of a RenderView.
+    void springIndices(const vector<Spring> &springs, vector<unsigned> &indices) {
+        indices.clear();
+        indices.reserve(2 * springs.size());
+        for (const auto &s : springs) {
+            indices.push_back(s.i1);
+            indices.push_back(s.i2);
+        }
+    }
+
     inline Vec3f fGravity(float mass) {
         return Vec3f(0, -9.8f * mass, 0);
     }
@@ -27,73 +55,183 @@ namespace {
         return -v * k;
     }
 
+#ifdef EIGEN_SPARSECORE_MODULE_H
+
+    // Derivative of fSpring(pos1, pos2, ...) with respect to pos1. The derivative with respect
+    // to pos2 is its negation, and the force on pos2 has the opposite sign.
+    // With n = (pos1 - pos2) / |pos1 - pos2|: -k ((1 - rest_length / |pos1 - pos2|) (I - n n^T) + n n^T).
+    inline Mat3f dSpring(const Vec3f &pos1, const Vec3f &pos2, float k, float rest_length) {
+        const auto d = pos1 - pos2;
+        const auto len = d.length();
+        Mat3f J;
+        J.setZero();
+        // Coincident endpoints define no direction for the spring, which then exerts no force.
+        if (len <= 0.0f)
+            return J;
+        const auto n = d / len;
+        const auto stretch = 1.0f - rest_length / len;
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                const auto nn = n[i] * n[j];
+                J(i, j) = -k * (stretch * ((i == j ? 1.0f : 0.0f) - nn) + nn);
+            }
+        }
+        return J;
+    }
+
+    // Starts the evaluation of a Jacobian: on the initial call reserve room for the pattern,
+    // on later ones clear the values of the existing entries.
+    inline void beginJacobian(SparseMatrix &J, bool initial, int entries_per_column) {
+        if (initial)
+            J.reserve(Eigen::VectorXi::Constant(J.cols(), entries_per_column));
+        else
+            J.coeffs().setZero();
+    }
+
+    // Adds scale * block to the 3x3 block of J that maps state[col] to the derivative of state[row].
+    inline void addBlock(SparseMatrix &J, int row, int col, const Mat3f &block, float scale) {
+        for (int j = 0; j < 3; ++j) {
+            for (int i = 0; i < 3; ++i)
+                J.coeffRef(3 * row + i, 3 * col + j) += scale * block(i, j);
+        }
+    }
+
+    // Adds value * I to the 3x3 block of J that maps state[col] to the derivative of state[row].
+    inline void addDiagonalBlock(SparseMatrix &J, int row, int col, float value) {
+        for (int i = 0; i < 3; ++i)
+            J.coeffRef(3 * row + i, 3 * col + i) += value;
+    }
+
+    // Jacobian of a system of particles of equal mass, with the state stored as (position, velocity)
+    // pairs, under springs, linear drag, and forces that do not depend on the state. Particles for
+    // which is_fixed(i) holds have a zero derivative.
+    template <typename IsFixed>
+    void springSystemJacobian(const State &state, const vector<Spring> &springs, unsigned num_particles, float mass, float drag_k,
+                              IsFixed is_fixed, int max_springs_per_particle, SparseMatrix &J, bool initial) {
+        beginJacobian(J, initial, 3 * (1 + max_springs_per_particle));
+        for (unsigned i = 0; i < num_particles; ++i) {
+            if (is_fixed(i))
+                continue;
+            addDiagonalBlock(J, 2 * i, 2 * i + 1, 1.0f);
+            addDiagonalBlock(J, 2 * i + 1, 2 * i + 1, -drag_k / mass);
+        }
+        for (const auto &s : springs) {
+            const auto K = dSpring(state[2 * s.i1], state[2 * s.i2], s.k, s.rlen);
+            if (!is_fixed(s.i1)) {
+                addBlock(J, 2 * s.i1 + 1, 2 * s.i1, K, 1.0f / mass);
+                addBlock(J, 2 * s.i1 + 1, 2 * s.i2, K, -1.0f / mass);
+            }
+            if (!is_fixed(s.i2)) {
+                addBlock(J, 2 * s.i2 + 1, 2 * s.i2, K, 1.0f / mass);
+                addBlock(J, 2 * s.i2 + 1, 2 * s.i1, K, -1.0f / mass);
+            }
+        }
+    }
+
+#endif
+
 } // namespace
 
 void SimpleSystem::reset() {
     current_state_ = State(1, Vec3f(0, radius_, 0));
 }
 
-State SimpleSystem::evalF(const State &state) const {
-    State f(1, Vec3f(-state[0].y, state[0].x, 0));
-    return f;
+void SimpleSystem::evalF(const State &state, State &f) {
+    f.resize(1);
+    f[0] = Vec3f(-state[0].y, state[0].x, 0);
+}
+
+Sprinkler::Sprinkler(unsigned capacity, unsigned emission_per_step) : capacity_(capacity), emission_per_step_(emission_per_step) {
+    reset();
 }
 
 void Sprinkler::reset() {
-    current_state_ = State();
-    points_to_render_ = Points();
-    // points_ = list<FW::Vec3f>();
-}
-
-void Sprinkler::set_state(State s) {
-    // std::list<Vec3f>::iterator i = points_.begin();
-    State filtered_state;
-    auto const n = s.size();
-    srand(time(0));
-    time_t seconds;
-    seconds = time(NULL) % 1000;
-    for (int i = 0; i < n / 3; i++) {
-        // Filter old particles
-        // std::cout << s[i * 3 + 2][0] << std::endl;
-        // std::cout << "noe: "<< seconds% 1000 << std::endl;
-        if (seconds % 1000 - s[i * 3 + 2][0] < 5) {
-            filtered_state.push_back(s[i * 3]);
-            filtered_state.push_back(s[i * 3 + 1]);
-            filtered_state.push_back(s[i * 3 + 2]);
-        } else {
-            // std::cout << "removed" << std::endl;
-        }
-    }
-    if (filtered_state.size() < 12000) {
-        for (int i = 0; i < 5; i++) {
-            // std::cout << "added" << std::endl;
-            float angle = (((double) rand() / (RAND_MAX)) + 1) * 2.0f * FW_PI;
-            // Add new particles
-            filtered_state.emplace_back(0.0f);
-            filtered_state.emplace_back(FW::sin(angle), 1.0f, FW::cos(angle));
-            filtered_state.emplace_back(seconds);
+    current_state_.assign(2 * size_t(capacity_) + 1, Vec3f(0.0f));
+    birth_times_.assign(capacity_, 0.0f);
+    num_live_ = 0;
+    random_.reset(0u);
+}
+
+void Sprinkler::swap_state(State &s) {
+    assert(s.size() == current_state_.size() && "the size of the sprinkler state is fixed by its capacity");
+    current_state_.swap(s);
+    auto &state = current_state_;
+    const auto now = state[clock_idx()].x;
+
+    // Kill particles that have lived long enough by moving the last live particle into their slot.
+    for (unsigned i = 0; i < num_live_;) {
+        if (now - birth_times_[i] < SPRINKLER_LIFETIME) {
+            ++i;
+            continue;
         }
+        const auto last = --num_live_;
+        state[pos_idx(i)] = state[pos_idx(last)];
+        state[vel_idx(i)] = state[vel_idx(last)];
+        birth_times_[i] = birth_times_[last];
     }
-    points_to_render_.clear();
-    for (int i = 0; i < filtered_state.size() / 3; i++) {
-        points_to_render_.push_back(filtered_state[3 * i]);
+
+    // Emit new particles into the first free slots, as long as there are any.
+    for (unsigned i = 0; i < emission_per_step_ && num_live_ < capacity_; ++i) {
+        const auto slot = num_live_++;
+        const auto angle = random_.getF32(0.0f, 2.0f * FW_PI);
+        state[pos_idx(slot)] = Vec3f(0.0f);
+        state[vel_idx(slot)] = Vec3f(FW::sin(angle), 1.0f, FW::cos(angle));
+        birth_times_[slot] = now;
     }
-    current_state_ = filtered_state;
 }
 
-State Sprinkler::evalF(const State &state) const {
+bool Sprinkler::getRenderView(RenderView &result) const {
+    result.positions = current_state_.data();
+    result.num_points = num_live_;
+    result.stride = sizeof(Vec3f);
+    result.line_indices = nullptr;
+    result.static_lines = nullptr;
+    result.topology = topology_;
+    return true;
+}
+
+Points Sprinkler::getPoints() {
+    return Points(current_state_.begin(), current_state_.begin() + num_live_);
+}
+
+void Sprinkler::evalF(const State &state, State &f) {
     const auto drag_k = 0.5f;
     const auto mass = 1.0f;
-    auto const n = state.size();
-    State f(n);
-    for (int i = 0; i < n / 3; i++) {
-        f[3 * i] = state[3 * i + 1];
-        f[3 * i + 1] = fGravity(mass) + fDrag(state[3 * i + 1], drag_k);
-        f[3 * i + 2] = 0;
-    }
-    return f;
+    f.resize(state.size());
+    // Particles are independent of each other. Free slots stay where they are.
+    auto evalParticles = [&](size_t first, size_t end) {
+        for (auto i = first; i < end; i++) {
+            const auto &v = state[vel_idx(unsigned(i))];
+            if (i < num_live_) {
+                f[pos_idx(unsigned(i))] = v;
+                f[vel_idx(unsigned(i))] = fGravity(mass) + fDrag(v, drag_k);
+            } else {
+                f[pos_idx(unsigned(i))] = f[vel_idx(unsigned(i))] = Vec3f(0.0f);
+            }
+        }
+    };
+    if (parallel_)
+        parallelFor(launcher_, capacity_, SPRINKLER_PARALLEL_GRAIN, evalParticles);
+    else
+        evalParticles(0, capacity_);
+    f[clock_idx()] = Vec3f(1.0f, 0.0f, 0.0f);
 }
 
 #ifdef EIGEN_SPARSECORE_MODULE_H
+void Sprinkler::evalJ(const State &, SparseMatrix &result, bool initial) const {
+    const auto drag_k = 0.5f;
+    // The derivative is linear in the state. Free slots get the same blocks as live particles:
+    // their derivative is zero, which keeps them at rest in the implicit solves as well, and
+    // the values only need to be set together with the pattern.
+    if (!initial)
+        return;
+    beginJacobian(result, initial, 2);
+    for (auto i = 0u; i < capacity_; ++i) {
+        addDiagonalBlock(result, pos_idx(i), vel_idx(i), 1.0f);
+        addDiagonalBlock(result, vel_idx(i), vel_idx(i), -drag_k);
+    }
+}
+
 // using the implicit Euler method, the simple system should converge towards origin -- as opposed to the explicit Euler, which diverges outwards from the origin.
 void SimpleSystem::evalJ(const State &, SparseMatrix &result, bool initial) const {
     if (initial) {
@@ -138,10 +276,10 @@ void SpringSystem::reset() {
     this->spring_.rlen = rest_length;
 }
 
-State SpringSystem::evalF(const State &state) const {
+void SpringSystem::evalF(const State &state, State &f) {
     const auto drag_k = 0.5f;
     const auto mass = 1.0f;
-    State f(4);
+    f.resize(4);
     // YOUR CODE HERE (R2)
     // Return a derivative for the system as if it was in state "state".
     // You can use the fGravity, fDrag and fSpring helper functions for the forces.
@@ -150,8 +288,7 @@ State SpringSystem::evalF(const State &state) const {
     f[1] = Vec3f(0.0f);
     //
     f[2] = state[3];
-    f[3] = fGravity(mass) + fSpring(state[0], state[2], spring_.k, spring_.rlen) + fDrag(state[3], drag_k);
-    return f;
+    f[3] = fGravity(mass) + fSpring(state[2], state[0], spring_.k, spring_.rlen) + fDrag(state[3], drag_k);
 }
 
 #ifdef EIGEN_SPARSECORE_MODULE_H
@@ -163,6 +300,12 @@ void SpringSystem::evalJ(const State &state, SparseMatrix &result, bool initial)
     const auto drag_k = 0.5f;
     const auto mass = 1.0f;
     // EXTRA: Evaluate the Jacobian into the 'result' matrix here. Only the free end of the spring should have any nonzero values related to it.
+    beginJacobian(result, initial, 6);
+    addDiagonalBlock(result, 2, 3, 1.0f);
+    addDiagonalBlock(result, 3, 3, -drag_k / mass);
+    const auto K = dSpring(state[2], state[0], spring_.k, spring_.rlen);
+    addBlock(result, 3, 2, K, 1.0f / mass);
+    addBlock(result, 3, 0, K, -1.0f / mass);
 }
 #endif
 
@@ -188,6 +331,12 @@ int vel_idx(int index) {
     return 2 * index + 1;
 }
 
+PendulumSystem::PendulumSystem(unsigned n) : n_(n), forces_(new SpringForces) {
+    reset();
+}
+
+PendulumSystem::~PendulumSystem() {}
+
 void PendulumSystem::reset() {
     const auto spring_k = 1000.0f;
     const auto start_point = Vec3f(0);
@@ -205,40 +354,66 @@ void PendulumSystem::reset() {
         this->springs_.emplace_back(i, i + 1, spring_k, rest_length);
         current_state_[pos_idx(i + 1)] = (end_point * (i + 1)) / (n_ - 1);
     }
+    forces_->setSprings(springs_, n_);
+    springIndices(springs_, spring_indices_);
+    ++topology_;
 }
 
-State PendulumSystem::evalF(const State &state) const {
-    const auto drag_k = 0.5f;
-    const auto mass = 0.5f;
-    auto f = State(2 * n_);
+void PendulumSystem::evalF(const State &state, State &f) {
+    evalForces(state, f, true);
+}
+
+void PendulumSystem::evalFWithoutSprings(const State &state, State &f) {
+    evalForces(state, f, false);
+}
+
+void PendulumSystem::evalForces(const State &state, State &f, bool springs) {
+    const auto drag_k = PENDULUM_DRAG_K;
+    const auto mass = PENDULUM_MASS;
     // YOUR CODE HERE (R4)
     // As in R2, return a derivative of the system state "state".
-    for (auto const &spring : this->springs_) {
-        f[vel_idx(spring.i1)] += fSpring(state[pos_idx(spring.i1)], state[pos_idx(spring.i2)], spring.k, spring.rlen);
-        f[vel_idx(spring.i2)] += fSpring(state[pos_idx(spring.i2)], state[pos_idx(spring.i1)], spring.k, spring.rlen);
-    }
-    for (int i = 1; i < n_; i++) {
-        f[pos_idx(i)] = state[vel_idx(i)];
-        f[vel_idx(i)] += fGravity(mass) + fDrag(state[vel_idx(i)], drag_k);
-        f[vel_idx(i)] /= mass;
-    }
+    // The springs, gravity and drag are evaluated by the same force engine as the cloth.
+    if (springs)
+        forces_->evalF(state, mass, drag_k, fGravity(mass) / mass, f, parallel_);
+    else
+        forces_->evalFWithoutSprings(state, mass, drag_k, fGravity(mass) / mass, f, parallel_);
     // Fixed particle
     f[0] = Vec3f(0.0f);
     f[1] = Vec3f(0.0f);
-    return f;
 }
 
 #ifdef EIGEN_SPARSECORE_MODULE_H
 
 void PendulumSystem::evalJ(const State &state, SparseMatrix &result, bool initial) const {
 
-    const auto drag_k = 0.5f;
-    const auto mass = 0.5f;
+    const auto drag_k = PENDULUM_DRAG_K;
+    const auto mass = PENDULUM_MASS;
 
     // EXTRA: Evaluate the Jacobian here. Each spring has an effect on four blocks of the matrix -- both of the positions of the endpoints will have an effect on both of the velocities of the endpoints.
+    // The first particle is fixed, every other one has at most two springs.
+    springSystemJacobian(state, springs_, n_, mass, drag_k, [](unsigned i) { return i == 0; }, 2, result, initial);
 }
 #endif
 
+bool PendulumSystem::getMassSpring(MassSpring &result) const {
+    result.springs = &springs_;
+    result.mass = PENDULUM_MASS;
+    result.drag_k = PENDULUM_DRAG_K;
+    result.fixed[0] = 0;
+    result.num_fixed = 1;
+    result.topology = topology_;
+    return true;
+}
+
+bool PendulumSystem::getRenderView(RenderView &result) const {
+    result.positions = current_state_.data();
+    result.num_points = n_;
+    result.stride = 2 * sizeof(Vec3f);
+    result.line_indices = &spring_indices_;
+    result.static_lines = nullptr;
+    result.topology = topology_;
+    return true;
+}
 
 Points PendulumSystem::getPoints() {
     auto p = Points(n_);
@@ -274,6 +449,13 @@ int ClothSystem::vel_idx(int idx) const {
     return pos_idx(idx) + 1;
 }
 
+ClothSystem::ClothSystem(unsigned x, unsigned y)
+    : x_(x), y_(y), forces_(new SpringForces), wind_(false), collisions_(new ParticleCollisions), collide_(false) {
+    reset();
+}
+
+ClothSystem::~ClothSystem() {}
+
 void ClothSystem::reset() {
     const auto spring_k = 300.0f;
     const auto width = 1.5f, height = 1.5f; // width and height of the whole grid
@@ -322,54 +504,95 @@ void ClothSystem::reset() {
             }
         }
     }
+    forces_->setSprings(springs_, x_ * y_);
+    springIndices(springs_, spring_indices_);
+    ++topology_;
+
+    // EXTRA: Collisions. The particles are 0.4 grid steps in radius, so that neighbours on the grid
+    // don't touch at rest but the gaps are too narrow for other particles to slip through. The
+    // cloth swings down onto a sphere, and a pyramid stands on the floor below it.
+    collisions_->clear();
+    collisions_->setParticleRadius(0.4f * FW::min(structural_horizontal_rest_length, structural_vertical_rest_length));
+    collisions_->addSphere(Vec3f(0, -0.6f, -0.75f), 0.4f);
+    collisions_->addPlane(Vec3f(0, 1, 0), -1.6f);
+    const auto pyramid = std::vector<Vec3f>{Vec3f(0.4f, -1.6f, -1.2f), Vec3f(0.8f, -1.6f, -1.2f), Vec3f(0.8f, -1.6f, -0.8f),
+                                            Vec3f(0.4f, -1.6f, -0.8f), Vec3f(0.6f, -1.2f, -1.0f)};
+    collisions_->addMesh(pyramid, {Vec3i(0, 4, 1), Vec3i(1, 4, 2), Vec3i(2, 4, 3), Vec3i(3, 4, 0)});
+    collider_lines_.clear();
+    collisions_->getLines(collider_lines_);
+}
+
+void ClothSystem::evalF(const State &state, State &f) {
+    evalForces(state, f, true);
 }
 
-State ClothSystem::evalF(const State &state) const {
-    const auto drag_k = 0.08f;
-    const auto n = x_ * y_;
-    static const auto mass = 0.025f;
-    auto f = State(2 * n);
+void ClothSystem::evalFWithoutSprings(const State &state, State &f) {
+    evalForces(state, f, false);
+}
+
+void ClothSystem::evalForces(const State &state, State &f, bool springs) {
+    const auto drag_k = CLOTH_DRAG_K;
+    const auto mass = CLOTH_MASS;
     // YOUR CODE HERE (R5)
     // This will be much like in R2 and R4.
-    for (auto const &spring : this->springs_) {
-        f[vel_idx(spring.i1)] += fSpring(state[pos_idx(spring.i1)], state[pos_idx(spring.i2)], spring.k, spring.rlen);
-        f[vel_idx(spring.i2)] += fSpring(state[pos_idx(spring.i2)], state[pos_idx(spring.i1)], spring.k, spring.rlen);
-    }
-
-    for (int x = 0; x < x_; x++) {
-        for (int y = 0; y < y_; y++) {
-            f[pos_idx(x, y)] = state[vel_idx(x, y)];
-            f[vel_idx(x, y)] += fGravity(mass) + fDrag(state[vel_idx(x, y)], drag_k);
-            f[vel_idx(x, y)] /= mass;
-        }
-    }
+    // The springs, gravity, drag and wind are all evaluated by the force engine;
+    // gravity and wind are the same acceleration for every particle.
+    auto acceleration = fGravity(mass) / mass;
     // EXTRA: Wind
-    if (this->wind_) {
-        for (int x = 0; x < x_; x++) {
-            for (int y = 0; y < y_; y++) {
-                f[vel_idx(x, y)] += this->wind_direction_;
-            }
-        }
-    }
+    if (this->wind_)
+        acceleration += this->wind_direction_;
+    if (springs)
+        forces_->evalF(state, mass, drag_k, acceleration, f, parallel_);
+    else
+        forces_->evalFWithoutSprings(state, mass, drag_k, acceleration, f, parallel_);
+    // EXTRA: Collisions
+    if (collide_)
+        collisions_->addForces(state, f, parallel_);
+
     // Fixed particle
     f[0] = Vec3f(0.0f);
     f[1] = Vec3f(0.0f);
     f[pos_idx(x_ - 1, 0)] = Vec3f(0.0f);
     f[vel_idx(x_ - 1, 0)] = Vec3f(0.0f);
-    return f;
 }
 
 #ifdef EIGEN_SPARSECORE_MODULE_H
 
 void ClothSystem::evalJ(const State &state, SparseMatrix &result, bool initial) const {
-    const auto drag_k = 0.08f;
-    static const auto mass = 0.025f;
+    const auto drag_k = CLOTH_DRAG_K;
+    const auto mass = CLOTH_MASS;
 
     // EXTRA: Evaluate the Jacobian here. The code is more or less the same as for the pendulum.
+    // Wind is constant and has no derivative. The two top corners are fixed, and every particle
+    // has at most 4 structural, 4 shear and 4 flex springs. Collisions are left out, so the
+    // implicit integrators treat them explicitly.
+    const auto corner = x_ - 1;
+    springSystemJacobian(state, springs_, x_ * y_, mass, drag_k, [corner](unsigned i) { return i == 0 || i == corner; }, 12, result, initial);
 }
 
 #endif
 
+bool ClothSystem::getMassSpring(MassSpring &result) const {
+    result.springs = &springs_;
+    result.mass = CLOTH_MASS;
+    result.drag_k = CLOTH_DRAG_K;
+    result.fixed[0] = 0;
+    result.fixed[1] = x_ - 1;
+    result.num_fixed = 2;
+    result.topology = topology_;
+    return true;
+}
+
+bool ClothSystem::getRenderView(RenderView &result) const {
+    result.positions = current_state_.data();
+    result.num_points = x_ * y_;
+    result.stride = 2 * sizeof(Vec3f);
+    result.line_indices = &spring_indices_;
+    result.static_lines = collide_ ? &collider_lines_ : nullptr;
+    result.topology = topology_;
+    return true;
+}
+
 Points ClothSystem::getPoints() {
     auto n = x_ * y_;
     auto p = Points(n);
@@ -385,8 +608,86 @@ Lines ClothSystem::getLines() {
         l.push_back(current_state_[2 * s.i1]);
         l.push_back(current_state_[2 * s.i2]);
     }
+    if (collide_)
+        l.insert(l.end(), collider_lines_.begin(), collider_lines_.end());
     return l;
 }
-State FluidSystem::evalF(const State &) const {
-    return State();
+FluidSystem::FluidSystem(unsigned n) : n_(n), fluid_(new SphFluid) {
+    reset();
+}
+
+FluidSystem::~FluidSystem() {}
+
+void FluidSystem::reset() {
+    // Fill the lower part of the left half of the box with a block of fluid at rest, on a
+    // cubic lattice, from the bottom up. The slight jitter breaks the symmetry of the lattice.
+    const auto box_min = Vec3f(-FLUID_BOX_HALF_SIZE), box_max = Vec3f(FLUID_BOX_HALF_SIZE);
+    const auto extent = box_max - box_min;
+    const auto spacing = FW::pow(FLUID_FILL * extent.x * extent.y * extent.z / float(FW::max(n_, 1u)), 1.0f / 3.0f);
+    const auto nx = FW::max(1, int(0.5f * extent.x / spacing));
+    const auto nz = FW::max(1, int(extent.z / spacing));
+    Random random(1u);
+    current_state_ = State(2 * n_);
+    for (auto i = 0u; i < n_; ++i) {
+        const auto x = int(i) % nx, z = int(i) / nx % nz, y = int(i) / (nx * nz);
+        const auto jitter = Vec3f(random.getF32(), random.getF32(), random.getF32()) * (0.01f * spacing);
+        current_state_[2 * i] = box_min + (Vec3f(float(x), float(y), float(z)) + 0.5f) * spacing + jitter;
+        current_state_[2 * i + 1] = Vec3f(0.0f);
+    }
+    fluid_->setup(n_, spacing, box_min, box_max);
+
+    // The edges of the box.
+    box_lines_.clear();
+    const auto h = FLUID_BOX_HALF_SIZE;
+    for (int axis = 0; axis < 3; ++axis) {
+        for (int corner = 0; corner < 4; ++corner) {
+            Vec3f a, b;
+            a[axis] = -h;
+            b[axis] = h;
+            a[(axis + 1) % 3] = b[(axis + 1) % 3] = corner & 1 ? h : -h;
+            a[(axis + 2) % 3] = b[(axis + 2) % 3] = corner & 2 ? h : -h;
+            box_lines_.push_back(a);
+            box_lines_.push_back(b);
+        }
+    }
+}
+
+void FluidSystem::swap_state(State &s) {
+    // Sort the new state into the spare buffer and make that current. s gets the previous state
+    // back, as promised, and the unsorted new state stays behind as the next spare buffer.
+    fluid_->sortState(s, sorted_state_);
+    current_state_.swap(sorted_state_);
+    s.swap(sorted_state_);
+}
+
+void FluidSystem::evalF(const State &state, State &f) {
+    fluid_->evalF(state, Vec3f(0, -9.8f, 0), f, parallel_);
+}
+
+#ifdef EIGEN_SPARSECORE_MODULE_H
+void FluidSystem::evalJ(const State &, SparseMatrix &result, bool initial) const {
+    // The fluid has no Jacobian: the implicit integrators step it as if it were explicit.
+    beginJacobian(result, initial, 0);
+}
+#endif
+
+bool FluidSystem::getRenderView(RenderView &result) const {
+    result.positions = current_state_.data();
+    result.num_points = n_;
+    result.stride = 2 * sizeof(Vec3f);
+    result.line_indices = nullptr;
+    result.static_lines = &box_lines_;
+    result.topology = topology_;
+    return true;
+}
+
+Points FluidSystem::getPoints() {
+    auto p = Points(n_);
+    for (auto i = 0u; i < n_; ++i)
+        p[i] = current_state_[2 * i];
+    return p;
+}
+
+Lines FluidSystem::getLines() {
+    return box_lines_;
 }
@@ -1,19 +1,21 @@
 #pragma once
 
 #include "../framework/base/Math.hpp"
+#include "base/MulticoreLauncher.hpp"
+#include "base/Random.hpp"
 
-#include <list>
+#include <memory>
 #include <vector>
 
 // EXTRA: probably want to use Eigen for the implicit solver
 
-//#include "../Eigen/SparseCore" // for the sparse matrices
-//#include "../Eigen/SparseLU"   // LU decomposition for linear solves
-//#include "../Eigen/StdVector"  // for interop with the State vectors
+#include "../Eigen/SparseCore" // for the sparse matrices
+#include "../Eigen/SparseLU"   // LU decomposition for linear solves
+#include "../Eigen/StdVector"  // for interop with the State vectors
 
 // less writing
-// typedef Eigen::SparseMatrix < float, 0, Eigen::DenseIndex > SparseMatrix;
-// typedef Eigen::SparseLU<SparseMatrix, Eigen::COLAMDOrdering<Eigen::DenseIndex>> SparseLU;
+typedef Eigen::SparseMatrix < float, 0, Eigen::DenseIndex > SparseMatrix;
+typedef Eigen::SparseLU<SparseMatrix, Eigen::COLAMDOrdering<Eigen::DenseIndex>> SparseLU;
 
 // Eigen supports a multitude of solvers, SparseLU is probably the best fit for us since our
 // problems are sparse but not necessarily symmetric or positive definite.
@@ -22,6 +24,13 @@ typedef std::vector<FW::Vec3f> State;
 typedef std::vector<FW::Vec3f> Points;
 typedef std::vector<FW::Vec3f> Lines;
 
+// The Jacobian of a system with state S has 3 * S.size() rows and columns: component c of
+// S[i] is row (and column) 3 * i + c.
+// evalJ() is called with initial == true on an empty matrix of the right size, and must then
+// insert every entry that can ever be nonzero, even if its current value is zero. Later calls
+// get the same matrix back and only update the values of those entries, so that the sparsity
+// pattern, and the symbolic factorization computed from it, stay valid from step to step.
+
 struct Spring {
     Spring() {}
     Spring(unsigned index1, unsigned index2, float spring_k, float rest_length) : i1(index1), i2(index2), k(spring_k), rlen(rest_length) {}
@@ -29,27 +38,92 @@ struct Spring {
     float k, rlen;
 };
 
+// Particles that can be held in place by a MassSpring description.
+static const unsigned MASS_SPRING_MAX_FIXED = 2u;
+
+// Describes a system of particles of equal mass, with the state stored as (position, velocity)
+// pairs, under springs, linear drag, and forces that do not depend on the state. Implicit
+// integrators can solve such systems matrix-free, straight from the springs.
+struct MassSpring {
+    const std::vector<Spring> *springs;
+    float mass, drag_k;
+    unsigned fixed[MASS_SPRING_MAX_FIXED]; // particles held in place
+    unsigned num_fixed;
+    unsigned topology; // changes whenever the springs may have, see RenderView
+};
+
+// What to draw of a particle system, straight from its state, so that the renderer can upload it
+// without copies. Particle i is the Vec3f at byte offset i * stride from positions, which point into
+// the state and need uploading every frame. The lines join the particles of the index pairs in
+// line_indices and also include static_lines, which do not depend on the particles. Both stay the
+// same, and can stay uploaded, until reset() or a change of options changes topology.
+struct RenderView {
+    const FW::Vec3f *positions;
+    unsigned num_points;
+    unsigned stride;
+    const std::vector<unsigned> *line_indices; // or nullptr
+    const Lines *static_lines;                  // or nullptr
+    unsigned topology;
+
+    const FW::Vec3f &position(unsigned i) const {
+        return *reinterpret_cast<const FW::Vec3f *>(reinterpret_cast<const char *>(positions) + size_t(i) * stride);
+    }
+};
+
+class ParticleCollisions;
+class SpringForces;
+class SphFluid;
+
 class ParticleSystem {
 public:
     virtual ~ParticleSystem(){};
-    virtual State evalF(const State &) const = 0;
+    // Writes the derivative of "state" into f, reusing the storage of f when it already
+    // has the right size, so that integrators can evaluate without allocating. Systems keep
+    // their scratch buffers for this in themselves, so evalF is not const and a system can
+    // only run one evaluation at a time.
+    virtual void evalF(const State &state, State &f) = 0;
+    State evalF(const State &state) {
+        State f;
+        evalF(state, f);
+        return f;
+    }
 #ifdef EIGEN_SPARSECORE_MODULE_H
     virtual void evalJ(const State &, SparseMatrix &result, bool initial) const = 0;
 #endif
     virtual void reset() = 0;
+    // Systems that are made of springs describe themselves here and return true.
+    virtual bool getMassSpring(MassSpring &) const { return false; }
+    // evalF without the forces of the springs of getMassSpring, for solvers that handle the
+    // springs themselves. Systems without such a description have nothing to leave out.
+    virtual void evalFWithoutSprings(const State &state, State &f) { evalF(state, f); }
+    // Systems that can be drawn straight from their state describe the drawing here and return true.
+    virtual bool getRenderView(RenderView &) const { return false; }
     const State &state() { return current_state_; }
-    virtual void set_state(State s) { current_state_ = s; }
+    // Makes s the current state and hands the previous state back in s, so that the
+    // caller can reuse its storage for the next step.
+    virtual void swap_state(State &s) { current_state_.swap(s); }
+    void set_state(const State &s) {
+        State copy(s);
+        swap_state(copy);
+    }
     virtual Points getPoints() { return Points(); }
     virtual Lines getLines() { return Lines(); }
+    // Lets evalF spread its work over the MulticoreLauncher threads.
+    void setParallel(bool parallel) { parallel_ = parallel; }
+    bool getParallel() const { return parallel_; }
 
 protected:
     State current_state_;
+    bool parallel_ = false;
+    // Counts the changes of the line topology of a RenderView.
+    unsigned topology_ = 0;
 };
 
 class SimpleSystem : public ParticleSystem {
 public:
     SimpleSystem() : radius_(0.5f) { reset(); }
-    State evalF(const State &) const override;
+    using ParticleSystem::evalF;
+    void evalF(const State &state, State &f) override;
 #ifdef EIGEN_SPARSECORE_MODULE_H
     void evalJ(const State &, SparseMatrix &result, bool initial) const override;
 #endif
@@ -61,26 +135,49 @@ private:
     float radius_;
 };
 
+// A fountain of particles, each of which lives for a fixed time of simulation.
+//
+// The particles live in a pool of fixed capacity, kept in the state as structure of arrays:
+// the positions of all slots, then their velocities, and last a clock whose derivative is
+// (1, 0, 0), so that the integrators advance the time of simulation along with the particles.
+// Birth times, which are not integrated, are a third array next to the state. The live particles
+// occupy the first getNumParticles() slots and the remaining slots are the free list, used from
+// the front. A particle dies by moving the last live particle into its slot, so emission and
+// death are O(1) per particle, and the positions of the live particles are always one contiguous
+// array that can be drawn straight from the state.
 class Sprinkler : public ParticleSystem {
 public:
-    Sprinkler() { reset(); }
-    State evalF(const State &) const override;
+    Sprinkler(unsigned capacity = 4096u, unsigned emission_per_step = 5u);
+    using ParticleSystem::evalF;
+    void evalF(const State &state, State &f) override;
 #ifdef EIGEN_SPARSECORE_MODULE_H
     void evalJ(const State &, SparseMatrix &result, bool initial) const override;
 #endif
     void reset() override;
-    void set_state(State s) override;
-    Points getPoints() override { return points_to_render_; };
+    void swap_state(State &s) override;
+    bool getRenderView(RenderView &result) const override;
+    Points getPoints() override;
+    const FW::Vec3f *getPositions() const { return current_state_.data(); }
+    unsigned getNumParticles() const { return num_live_; }
 
 private:
-    std::list<FW::Vec3f> points_;
-    Points points_to_render_;
+    unsigned pos_idx(unsigned slot) const { return slot; }
+    unsigned vel_idx(unsigned slot) const { return capacity_ + slot; }
+    unsigned clock_idx() const { return 2 * capacity_; }
+
+    unsigned capacity_;
+    unsigned emission_per_step_;
+    unsigned num_live_;
+    std::vector<float> birth_times_;
+    FW::Random random_;
+    FW::MulticoreLauncher launcher_;
 };
 
 class SpringSystem : public ParticleSystem {
 public:
     SpringSystem() { reset(); }
-    State evalF(const State &) const override;
+    using ParticleSystem::evalF;
+    void evalF(const State &state, State &f) override;
 #ifdef EIGEN_SPARSECORE_MODULE_H
     void evalJ(const State &, SparseMatrix &result, bool initial) const override;
 #endif
@@ -94,41 +191,70 @@ private:
 
 class PendulumSystem : public ParticleSystem {
 public:
-    PendulumSystem(unsigned n) : n_(n) { reset(); }
-    State evalF(const State &) const override;
+    PendulumSystem(unsigned n);
+    ~PendulumSystem();
+    using ParticleSystem::evalF;
+    void evalF(const State &state, State &f) override;
+    void evalFWithoutSprings(const State &state, State &f) override;
 #ifdef EIGEN_SPARSECORE_MODULE_H
     void evalJ(const State &, SparseMatrix &result, bool initial) const override;
 #endif
     void reset() override;
+    bool getMassSpring(MassSpring &result) const override;
+    bool getRenderView(RenderView &result) const override;
     Points getPoints() override;
     Lines getLines() override;
 
 private:
+    void evalForces(const State &state, State &f, bool springs);
+
     unsigned n_;
     std::vector<Spring> springs_;
+    std::vector<unsigned> spring_indices_; // i1 and i2 of each spring, for RenderView
+    // Sorted SoA copy of springs_ with scratch buffers, rebuilt by reset().
+    std::unique_ptr<SpringForces> forces_;
 };
 
 class ClothSystem : public ParticleSystem {
 public:
-    ClothSystem(unsigned x, unsigned y) : x_(x), y_(y) { reset(); }
-    State evalF(const State &) const override;
+    ClothSystem(unsigned x, unsigned y);
+    ~ClothSystem();
+    using ParticleSystem::evalF;
+    void evalF(const State &state, State &f) override;
+    void evalFWithoutSprings(const State &state, State &f) override;
 #ifdef EIGEN_SPARSECORE_MODULE_H
     void evalJ(const State &, SparseMatrix &result, bool initial) const override;
 #endif
     void reset() override;
+    bool getMassSpring(MassSpring &result) const override;
+    bool getRenderView(RenderView &result) const override;
     Points getPoints() override;
     Lines getLines() override;
     FW::Vec2i getSize() { return FW::Vec2i(x_, y_); }
     // EXTRA: Wind
     void setWindDirection(FW::Vec3f wind_direction) { wind_direction_ = wind_direction; }
     void setWind(bool wind) { wind_ = wind; }
+    // EXTRA: Collisions of the cloth with itself, a sphere, the floor and a pyramid
+    void setCollisions(bool collisions) {
+        collide_ = collisions;
+        ++topology_;
+    }
 
 private:
+    void evalForces(const State &state, State &f, bool springs);
+
     unsigned x_, y_;
     std::vector<Spring> springs_;
+    std::vector<unsigned> spring_indices_; // i1 and i2 of each spring, for RenderView
+    // Sorted SoA copy of springs_ with scratch buffers, rebuilt by reset().
+    std::unique_ptr<SpringForces> forces_;
     // EXTRA: Wind
     bool wind_;
     FW::Vec3f wind_direction_;
+    // EXTRA: Collisions
+    std::unique_ptr<ParticleCollisions> collisions_;
+    bool collide_;
+    Lines collider_lines_;
 
     int pos_idx(int x, int y) const;
     int pos_idx(int idx) const;
@@ -137,18 +263,30 @@ private:
     int particle_idx(int x, int y) const;
 };
 
+// A dam break of n SPH particles in a unit box, see SphFluid.
+//
+// swap_state() reorders the particles of the new state by grid cell, so that neighbouring
+// particles stay close in memory. Particle i is therefore not the same particle from one step
+// to the next, and the previous state handed back is in the previous order. Nothing may keep a
+// particle index across steps; the particles are all alike, so only their positions matter.
 class FluidSystem : public ParticleSystem {
 public:
-    FluidSystem(unsigned n) : n_(n) { reset(); }
-    State evalF(const State &) const override;
+    FluidSystem(unsigned n);
+    ~FluidSystem();
+    using ParticleSystem::evalF;
+    void evalF(const State &state, State &f) override;
 #ifdef EIGEN_SPARSECORE_MODULE_H
     void evalJ(const State &, SparseMatrix &result, bool initial) const override;
 #endif
     void reset() override;
+    void swap_state(State &s) override;
+    bool getRenderView(RenderView &result) const override;
     Points getPoints() override;
     Lines getLines() override;
 
 private:
     unsigned n_;
-    std::vector<unsigned> asd;
+    std::unique_ptr<SphFluid> fluid_;
+    State sorted_state_; // spare buffer that swap_state() sorts into
+    Lines box_lines_;
 };
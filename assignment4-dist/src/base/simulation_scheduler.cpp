@@ -0,0 +1,99 @@
+#include "simulation_scheduler.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+using namespace FW;
+
+const float SimulationScheduler::MAX_BATCH_SECONDS = 1.0f / 60.0f;
+const float SimulationScheduler::MAX_LAG_SECONDS = 0.1f;
+
+void SimulationScheduler::start(function<void(float)> step, function<void(Snapshot &)> capture) {
+    stop();
+    step_ = move(step);
+    capture_ = move(capture);
+    stop_ = false;
+    steps_per_second_ = 0;
+
+    // The thread isn't running yet, so the first snapshot can be captured right here.
+    fresh_ = false;
+    capture_(snapshots_[write_]);
+    publish();
+
+    running_ = true;
+    thread_.start(threadFunc, this);
+}
+
+void SimulationScheduler::stop() {
+    if (!running_)
+        return;
+    monitor_.enter();
+    stop_ = true;
+    monitor_.leave();
+    thread_.join();
+    running_ = false;
+}
+
+const SimulationScheduler::Snapshot &SimulationScheduler::acquire() {
+    swap_lock_.enter();
+    if (fresh_) {
+        swap(read_, ready_);
+        fresh_ = false;
+    }
+    swap_lock_.leave();
+    return snapshots_[read_];
+}
+
+void SimulationScheduler::publish() {
+    swap_lock_.enter();
+    swap(write_, ready_);
+    fresh_ = true;
+    swap_lock_.leave();
+}
+
+void SimulationScheduler::threadFunc(void *param) {
+    static_cast<SimulationScheduler *>(param)->run();
+}
+
+void SimulationScheduler::run() {
+    Timer clock(true), rate(true);
+    auto accumulator = 0.0f;
+    auto steps = 0;
+    for (;;) {
+        monitor_.enter();
+        if (stop_) {
+            monitor_.leave();
+            return;
+        }
+        assert(time_step_ > 0.0f && "the time step must be positive");
+
+        // Take the steps that are due, but publish a snapshot at least once per MAX_BATCH_SECONDS
+        // and leave the rest for the next batch.
+        accumulator = FW::min(accumulator + clock.end(), MAX_LAG_SECONDS);
+        Timer batch(true);
+        auto stepped = false;
+        while (accumulator >= time_step_ && batch.getElapsed() < MAX_BATCH_SECONDS) {
+            step_(time_step_);
+            accumulator -= time_step_;
+            stepped = true;
+            ++steps;
+        }
+        if (rate.getElapsed() >= 1.0f) {
+            steps_per_second_ = int(float(steps) / rate.end());
+            steps = 0;
+        }
+        if (stepped)
+            capture_(snapshots_[write_]);
+        const auto until_next_step = time_step_ - accumulator;
+        monitor_.leave();
+
+        if (stepped)
+            publish();
+        // Sleep until the next step is due, or at least give the other threads a chance at the monitor.
+        if (until_next_step > 0.001f)
+            Thread::sleep(int(until_next_step * 1000.0f));
+        else
+            Thread::yield();
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "integrators.hpp"
+#include "particle_systems.hpp"
+
+#include "base/Thread.hpp"
+#include "base/Timer.hpp"
+
+#include <atomic>
+#include <functional>
+
+// Runs a simulation on a thread of its own with a fixed time step, so that it advances with
+// the wall clock instead of with the frame rate. The thread adds the wall-clock time that has
+// passed to an accumulator and takes as many fixed steps as fit in it. If the steps are too
+// slow to keep up, the accumulator is capped and the simulation runs slower than real time
+// rather than falling ever further behind.
+//
+// After every batch of steps the thread captures what there is to draw into a snapshot. The
+// snapshots are triple-buffered: the simulation fills one, one holds the latest complete
+// snapshot, and the renderer draws the third, so that neither side waits for the other.
+//
+// Batches run between enter() and leave() of the scheduler's monitor. Whatever the steps read
+// must only be changed by other threads between enter() and leave() of their own.
+class SimulationScheduler {
+public:
+    struct Snapshot {
+        Points points;
+        Lines lines;
+        AdaptiveStepControl adaptive; // statistics for display
+    };
+
+    // Wall-clock time a batch may take before its snapshot is published.
+    static const float MAX_BATCH_SECONDS;
+    // How far the simulation may fall behind the wall clock before it slows down.
+    static const float MAX_LAG_SECONDS;
+
+    SimulationScheduler() {}
+    ~SimulationScheduler() { stop(); }
+
+    // Starts the thread. It calls step(dt) to advance the simulation by one fixed step of dt
+    // and capture(snapshot) to fill in the snapshot after each batch.
+    void start(std::function<void(float)> step, std::function<void(Snapshot &)> capture);
+    // Waits for the current batch to finish and stops the thread. Not to be called between
+    // enter() and leave().
+    void stop();
+    bool isRunning() const { return running_; }
+
+    void enter() { monitor_.enter(); }
+    void leave() { monitor_.leave(); }
+
+    // Length of the fixed step. Set between enter() and leave().
+    void setTimeStep(float dt) { time_step_ = dt; }
+    // Steps taken in the last second of wall-clock time.
+    int getStepsPerSecond() const { return steps_per_second_; }
+
+    // The latest published snapshot. It stays valid and unchanged until the next call.
+    const Snapshot &acquire();
+
+private:
+    static void threadFunc(void *param);
+    void run();
+    void publish();
+
+    FW::Thread thread_;
+    FW::Monitor monitor_;
+    bool running_ = false;
+    bool stop_ = false; // guarded by monitor_
+
+    std::function<void(float)> step_;
+    std::function<void(Snapshot &)> capture_;
+    float time_step_ = 0.01f;
+    std::atomic<int> steps_per_second_{0};
+
+    // The simulation fills snapshots_[write_], snapshots_[ready_] is the latest complete one,
+    // and the renderer draws snapshots_[read_]. ready_ and fresh_ are guarded by swap_lock_.
+    Snapshot snapshots_[3];
+    int write_ = 0, ready_ = 1, read_ = 2;
+    bool fresh_ = false;
+    FW::Spinlock swap_lock_;
+};
@@ -0,0 +1,180 @@
+#include "sph_fluid.hpp"
+#include "parallel_for.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+using namespace FW;
+
+namespace {
+
+    const float SPH_REST_DENSITY = 1000.0f;
+    // Pressure per unit of density above the rest density, the square of the speed of sound.
+    const float SPH_STIFFNESS = 100.0f;
+    const float SPH_VISCOSITY = 2.0f;
+    // Penalty acceleration pushing particles back into the box, per unit of penetration, and
+    // damping of the velocity into the wall.
+    const float SPH_WALL_STIFFNESS = 20000.0f;
+    const float SPH_WALL_DAMPING = 100.0f;
+
+} // namespace
+
+void SphFluid::setup(unsigned num_particles, float spacing, const Vec3f &box_min, const Vec3f &box_max) {
+    num_particles_ = num_particles;
+    box_min_ = box_min;
+    box_max_ = box_max;
+    // About 30 neighbours per particle.
+    radius_ = 2.0f * spacing;
+    mass_ = SPH_REST_DENSITY * spacing * spacing * spacing;
+
+    const auto h2 = radius_ * radius_;
+    const auto h6 = h2 * h2 * h2;
+    poly6_ = 315.0f / (64.0f * FW_PI * h6 * h2 * radius_);
+    spiky_gradient_ = 45.0f / (FW_PI * h6);
+    viscosity_laplacian_ = 45.0f / (FW_PI * h6);
+
+    // The density of a particle inside a cubic lattice of the given spacing is the one the
+    // pressure pushes towards, so that the initial block of fluid starts at rest.
+    auto density = 0.0f;
+    for (int z = -2; z <= 2; ++z) {
+        for (int y = -2; y <= 2; ++y) {
+            for (int x = -2; x <= 2; ++x) {
+                const auto r2 = float(x * x + y * y + z * z) * spacing * spacing;
+                if (r2 < h2)
+                    density += mass_ * poly6_ * (h2 - r2) * (h2 - r2) * (h2 - r2);
+            }
+        }
+    }
+    rest_density_ = density;
+
+    const auto extent = box_max - box_min;
+    grid_size_ = Vec3i(FW::max(1, int(extent.x / radius_)), FW::max(1, int(extent.y / radius_)), FW::max(1, int(extent.z / radius_)));
+    cell_start_.assign(size_t(grid_size_.x) * grid_size_.y * grid_size_.z + 1, 0u);
+    cell_cursor_.resize(cell_start_.size());
+    cell_of_.resize(num_particles);
+    sorted_.resize(num_particles);
+    position_.resize(num_particles);
+    velocity_.resize(num_particles);
+    acceleration_.resize(num_particles);
+    density_.resize(num_particles);
+    pressure_.resize(num_particles);
+}
+
+Vec3i SphFluid::cellCoords(const Vec3f &p) const {
+    // Cells are at least as wide as the radius. Particles that have strayed out of the box
+    // belong to the nearest cell on its border.
+    const auto extent = box_max_ - box_min_;
+    const auto u = (p - box_min_) / extent;
+    return Vec3i(FW::clamp(int(u.x * float(grid_size_.x)), 0, grid_size_.x - 1),
+                 FW::clamp(int(u.y * float(grid_size_.y)), 0, grid_size_.y - 1),
+                 FW::clamp(int(u.z * float(grid_size_.z)), 0, grid_size_.z - 1));
+}
+
+int SphFluid::cellIndex(const Vec3f &p) const {
+    const auto c = cellCoords(p);
+    return c.x + grid_size_.x * (c.y + grid_size_.y * c.z);
+}
+
+void SphFluid::sortByCell(const State &state) {
+    assert(state.size() == 2 * size_t(num_particles_) && "state does not match the fluid");
+
+    // Counting sort: count the particles of each cell, turn the counts into the first index of
+    // each cell, and place the particles.
+    fill(cell_start_.begin(), cell_start_.end(), 0u);
+    for (unsigned i = 0; i < num_particles_; ++i) {
+        cell_of_[i] = cellIndex(state[2 * i]);
+        ++cell_start_[cell_of_[i] + 1];
+    }
+    for (size_t c = 1; c < cell_start_.size(); ++c)
+        cell_start_[c] += cell_start_[c - 1];
+    copy(cell_start_.begin(), cell_start_.end(), cell_cursor_.begin());
+    for (unsigned i = 0; i < num_particles_; ++i)
+        sorted_[cell_cursor_[cell_of_[i]]++] = i;
+}
+
+void SphFluid::evalF(const State &state, const Vec3f &gravity, State &f, bool parallel) {
+    sortByCell(state);
+    f.resize(state.size());
+
+    auto run = [&](const auto &pass) {
+        if (parallel)
+            parallelFor(launcher_, num_particles_, PARALLEL_GRAIN, pass);
+        else
+            pass(size_t(0), size_t(num_particles_));
+    };
+    run([&](size_t first, size_t end) {
+        for (auto k = first; k < end; ++k) {
+            position_[k] = state[2 * sorted_[k]];
+            velocity_[k] = state[2 * sorted_[k] + 1];
+        }
+    });
+    run([&](size_t first, size_t end) { computeDensities(first, end); });
+    run([&](size_t first, size_t end) {
+        computeAccelerations(first, end, gravity);
+        for (auto k = first; k < end; ++k) {
+            f[2 * sorted_[k]] = velocity_[k];
+            f[2 * sorted_[k] + 1] = acceleration_[k];
+        }
+    });
+}
+
+void SphFluid::computeDensities(size_t first, size_t end) {
+    const auto h2 = radius_ * radius_;
+    for (auto i = first; i < end; ++i) {
+        const auto p = position_[i];
+        const auto c = cellCoords(p);
+        auto density = 0.0f;
+        forNeighbours(c, [&](unsigned j) {
+            const auto r2 = (p - position_[j]).lenSqr();
+            if (r2 < h2) {
+                const auto w = h2 - r2;
+                density += w * w * w;
+            }
+        });
+        density_[i] = mass_ * poly6_ * density;
+        // Negative pressures would pull particles into clumps, so the fluid only resists compression.
+        pressure_[i] = SPH_STIFFNESS * FW::max(density_[i] - rest_density_, 0.0f);
+    }
+}
+
+void SphFluid::computeAccelerations(size_t first, size_t end, const Vec3f &gravity) {
+    const auto h = radius_;
+    const auto h2 = h * h;
+    for (auto i = first; i < end; ++i) {
+        const auto p = position_[i];
+        const auto v = velocity_[i];
+        const auto c = cellCoords(p);
+        Vec3f pressure_force(0.0f), viscosity_force(0.0f);
+        forNeighbours(c, [&](unsigned j) {
+            const auto d = p - position_[j];
+            const auto r2 = d.lenSqr();
+            if (r2 < h2 && r2 > 0.0f) {
+                const auto r = FW::sqrt(r2);
+                const auto w = h - r;
+                // Symmetrized pressure with the gradient of the spiky kernel, which points from j to i.
+                pressure_force += ((pressure_[i] + pressure_[j]) / (2.0f * density_[j]) * spiky_gradient_ * w * w / r) * d;
+                viscosity_force += (viscosity_laplacian_ * w / density_[j]) * (velocity_[j] - v);
+            }
+        });
+        auto a = mass_ * (pressure_force + SPH_VISCOSITY * viscosity_force) / density_[i] + gravity;
+
+        // Penalty forces of the walls.
+        for (int axis = 0; axis < 3; ++axis) {
+            if (p[axis] < box_min_[axis])
+                a[axis] += SPH_WALL_STIFFNESS * (box_min_[axis] - p[axis]) - SPH_WALL_DAMPING * FW::min(v[axis], 0.0f);
+            else if (p[axis] > box_max_[axis])
+                a[axis] += SPH_WALL_STIFFNESS * (box_max_[axis] - p[axis]) - SPH_WALL_DAMPING * FW::max(v[axis], 0.0f);
+        }
+        acceleration_[i] = a;
+    }
+}
+
+void SphFluid::sortState(const State &state, State &sorted) {
+    sortByCell(state);
+    sorted.resize(state.size());
+    for (unsigned k = 0; k < num_particles_; ++k) {
+        sorted[2 * k] = state[2 * sorted_[k]];
+        sorted[2 * k + 1] = state[2 * sorted_[k] + 1];
+    }
+}
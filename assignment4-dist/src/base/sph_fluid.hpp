@@ -0,0 +1,77 @@
+#pragma once
+
+#include "particle_systems.hpp"
+
+#include "base/MulticoreLauncher.hpp"
+
+#include <vector>
+
+// Smoothed particle hydrodynamics after Mueller et al. 2003, "Particle-Based Fluid Simulation
+// for Interactive Applications", for particles of equal mass in an axis-aligned box. The state is
+// stored the usual way, as interleaved (position, velocity) pairs.
+//
+// Neighbours are found with a uniform grid over the box whose cells are as wide as the kernel
+// radius, so all neighbours of a particle lie in the 3x3x3 cells around it. Every evaluation
+// counting-sorts the particles by cell, copies their positions and velocities into that order,
+// and then computes densities and accelerations with one pass each over the sorted particles,
+// which can run on multiple threads since every particle only writes its own results. The
+// cells along x are consecutive, so each row of three neighbouring cells is one contiguous run
+// of sorted particles.
+class SphFluid {
+public:
+    // Particles handled by one task of the parallel passes.
+    static const size_t PARALLEL_GRAIN = 1024u;
+
+    // Sets up a fluid of num_particles particles in the box [box_min, box_max], with particles
+    // of the given rest spacing. The mass follows from the spacing and the rest density.
+    void setup(unsigned num_particles, float spacing, const FW::Vec3f &box_min, const FW::Vec3f &box_max);
+    float getSmoothingRadius() const { return radius_; }
+
+    // Writes into f the derivative of "state" under pressure, viscosity, gravity and the walls of
+    // the box. f is resized to the size of the state if necessary.
+    void evalF(const State &state, const FW::Vec3f &gravity, State &f, bool parallel = false);
+
+    // Writes into sorted the particles of state ordered by grid cell, so that neighbours stay
+    // close in memory.
+    void sortState(const State &state, State &sorted);
+
+private:
+    int cellIndex(const FW::Vec3f &p) const;
+    FW::Vec3i cellCoords(const FW::Vec3f &p) const;
+    void sortByCell(const State &state);
+    // Calls visit(j) for every sorted particle j in the 3x3x3 cells around cell c.
+    template <typename Visit>
+    void forNeighbours(const FW::Vec3i &c, const Visit &visit) const {
+        for (int z = FW::max(c.z - 1, 0); z <= FW::min(c.z + 1, grid_size_.z - 1); ++z) {
+            for (int y = FW::max(c.y - 1, 0); y <= FW::min(c.y + 1, grid_size_.y - 1); ++y) {
+                const auto row = grid_size_.x * (y + grid_size_.y * z);
+                const auto row_end = cell_start_[row + FW::min(c.x + 1, grid_size_.x - 1) + 1];
+                for (auto j = cell_start_[row + FW::max(c.x - 1, 0)]; j < row_end; ++j)
+                    visit(j);
+            }
+        }
+    }
+    void computeDensities(size_t first, size_t end);
+    void computeAccelerations(size_t first, size_t end, const FW::Vec3f &gravity);
+
+    unsigned num_particles_ = 0;
+    float mass_ = 1.0f;
+    float rest_density_ = 1.0f;
+    float radius_ = 1.0f;
+    FW::Vec3f box_min_, box_max_;
+    FW::Vec3i grid_size_;
+
+    // Kernel constants for the current radius.
+    float poly6_ = 0.0f, spiky_gradient_ = 0.0f, viscosity_laplacian_ = 0.0f;
+
+    // cell_start_[c] is the first sorted particle in cell c, cell_start_[c + 1] the end.
+    std::vector<unsigned> cell_start_, cell_cursor_;
+    std::vector<int> cell_of_;
+    // sorted_[k] is the index in the state of the k-th particle in cell order.
+    std::vector<unsigned> sorted_;
+    // Per-particle data in cell order.
+    std::vector<FW::Vec3f> position_, velocity_, acceleration_;
+    std::vector<float> density_, pressure_;
+
+    FW::MulticoreLauncher launcher_;
+};
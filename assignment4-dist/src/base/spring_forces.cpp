@@ -0,0 +1,212 @@
+#include "spring_forces.hpp"
+#include "parallel_for.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <xmmintrin.h>
+
+using namespace std;
+using namespace FW;
+
+namespace {
+
+    inline size_t padToLanes(size_t n) {
+        return (n + SpringForces::LANES - 1) / SpringForces::LANES * SpringForces::LANES;
+    }
+
+    // Four floats from the given indices of an array.
+    inline __m128 gather(const float *a, const unsigned *idx) {
+        return _mm_set_ps(a[idx[3]], a[idx[2]], a[idx[1]], a[idx[0]]);
+    }
+
+} // namespace
+
+void SpringForces::setSprings(const vector<Spring> &springs, unsigned num_particles) {
+    num_particles_ = num_particles;
+    num_springs_ = springs.size();
+
+    // Orient every spring from its lower to its higher index and sort, so that the springs
+    // of a particle are consecutive and neighbouring springs touch neighbouring particles.
+    auto sorted = springs;
+    for (auto &s : sorted) {
+        assert(s.i1 < num_particles && s.i2 < num_particles && "spring endpoint out of range");
+        if (s.i1 > s.i2)
+            swap(s.i1, s.i2);
+    }
+    sort(sorted.begin(), sorted.end(), [](const Spring &a, const Spring &b) {
+        return a.i1 != b.i1 ? a.i1 < b.i1 : a.i2 < b.i2;
+    });
+
+    const auto padded = padToLanes(num_springs_);
+    spring_i1_.assign(padded, 0u);
+    spring_i2_.assign(padded, 0u);
+    spring_k_.assign(padded, 0.0f);
+    spring_rlen_.assign(padded, 0.0f);
+    for (size_t i = 0; i < num_springs_; ++i) {
+        spring_i1_[i] = sorted[i].i1;
+        spring_i2_[i] = sorted[i].i2;
+        spring_k_[i] = sorted[i].k;
+        spring_rlen_[i] = sorted[i].rlen;
+    }
+
+    const auto padded_particles = padToLanes(num_particles_);
+    for (auto a : {&px_, &py_, &pz_, &vx_, &vy_, &vz_, &fx_, &fy_, &fz_})
+        a->assign(padded_particles, 0.0f);
+
+    // Batches for the parallel evaluation. Thanks to the sorting, the particles touched by a
+    // batch form a short range, and the ranges of neighbouring batches barely overlap.
+    batch_springs_.clear();
+    batch_first_.clear();
+    batch_end_.clear();
+    batch_offset_.clear();
+    size_t total = 0;
+    for (size_t first = 0; first < num_springs_; first += SPRING_GRAIN) {
+        const auto end = std::min(first + SPRING_GRAIN, num_springs_);
+        auto lo = sorted[first].i1, hi = lo;
+        for (size_t s = first; s < end; ++s)
+            hi = std::max(hi, sorted[s].i2);
+        batch_springs_.push_back(first);
+        batch_first_.push_back(lo);
+        batch_end_.push_back(hi + 1);
+        batch_offset_.push_back(total);
+        total += hi + 1 - lo;
+    }
+    batch_springs_.push_back(padded);
+    batch_fx_.assign(total, 0.0f);
+    batch_fy_.assign(total, 0.0f);
+    batch_fz_.assign(total, 0.0f);
+}
+
+void SpringForces::evalF(const State &state, float mass, float drag_k, const Vec3f &acceleration, State &f, bool parallel) {
+    assert(state.size() == 2 * size_t(num_particles_) && "state does not match the springs");
+    f.resize(2 * size_t(num_particles_));
+    const auto padded_particles = fx_.size();
+
+    if (!parallel) {
+        loadState(state, 0, num_particles_);
+        fill(fx_.begin(), fx_.end(), 0.0f);
+        fill(fy_.begin(), fy_.end(), 0.0f);
+        fill(fz_.begin(), fz_.end(), 0.0f);
+        accumulateSprings(0, spring_i1_.size(), 0, fx_.data(), fy_.data(), fz_.data());
+        writeDerivative(0, padded_particles, mass, drag_k, acceleration, f);
+        return;
+    }
+
+    parallelFor(launcher_, num_particles_, PARTICLE_GRAIN, [&](size_t first, size_t end) {
+        loadState(state, first, end);
+    });
+    parallelFor(launcher_, batch_first_.size(), 1, [&](size_t first, size_t end) {
+        for (auto b = first; b < end; ++b) {
+            const auto offset = batch_offset_[b];
+            const auto size = batch_end_[b] - batch_first_[b];
+            fill_n(&batch_fx_[offset], size, 0.0f);
+            fill_n(&batch_fy_[offset], size, 0.0f);
+            fill_n(&batch_fz_[offset], size, 0.0f);
+            accumulateSprings(batch_springs_[b], batch_springs_[b + 1], batch_first_[b], &batch_fx_[offset], &batch_fy_[offset], &batch_fz_[offset]);
+        }
+    });
+    parallelFor(launcher_, padded_particles, PARTICLE_GRAIN, [&](size_t first, size_t end) {
+        gatherBatches(first, end);
+        writeDerivative(first, end, mass, drag_k, acceleration, f);
+    });
+}
+
+void SpringForces::evalFWithoutSprings(const State &state, float mass, float drag_k, const Vec3f &acceleration, State &f, bool parallel) {
+    assert(state.size() == 2 * size_t(num_particles_) && "state does not match the springs");
+    f.resize(2 * size_t(num_particles_));
+    // The ranges of parallelFor are multiples of PARTICLE_GRAIN, so each one covers whole groups of LANES.
+    const auto evalParticles = [&](size_t first, size_t end) {
+        loadState(state, first, std::min(end, size_t(num_particles_)));
+        fill(fx_.begin() + first, fx_.begin() + end, 0.0f);
+        fill(fy_.begin() + first, fy_.begin() + end, 0.0f);
+        fill(fz_.begin() + first, fz_.begin() + end, 0.0f);
+        writeDerivative(first, end, mass, drag_k, acceleration, f);
+    };
+    if (parallel)
+        parallelFor(launcher_, fx_.size(), PARTICLE_GRAIN, evalParticles);
+    else
+        evalParticles(0, fx_.size());
+}
+
+void SpringForces::loadState(const State &state, size_t first, size_t end) {
+    for (auto i = first; i < end; ++i) {
+        const auto &p = state[2 * i];
+        const auto &v = state[2 * i + 1];
+        px_[i] = p.x;
+        py_[i] = p.y;
+        pz_[i] = p.z;
+        vx_[i] = v.x;
+        vy_[i] = v.y;
+        vz_[i] = v.z;
+    }
+}
+
+void SpringForces::accumulateSprings(size_t first, size_t end, unsigned base, float *fx, float *fy, float *fz) const {
+    const __m128 zero = _mm_setzero_ps();
+    for (size_t s = first; s < end; s += LANES) {
+        const unsigned *i1 = &spring_i1_[s];
+        const unsigned *i2 = &spring_i2_[s];
+        const __m128 dx = _mm_sub_ps(gather(px_.data(), i1), gather(px_.data(), i2));
+        const __m128 dy = _mm_sub_ps(gather(py_.data(), i1), gather(py_.data(), i2));
+        const __m128 dz = _mm_sub_ps(gather(pz_.data(), i1), gather(pz_.data(), i2));
+        const __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+
+        // Force on the first endpoint: -k (|d| - rest length) d / |d|, with d = p1 - p2.
+        // Coincident endpoints (and the padding) have no defined direction and get no force.
+        const __m128 k = _mm_loadu_ps(&spring_k_[s]);
+        const __m128 rlen = _mm_loadu_ps(&spring_rlen_[s]);
+        __m128 scale = _mm_div_ps(_mm_mul_ps(k, _mm_sub_ps(rlen, len)), len);
+        scale = _mm_and_ps(scale, _mm_cmpgt_ps(len, zero));
+
+        alignas(16) float force[3][LANES];
+        _mm_store_ps(force[0], _mm_mul_ps(scale, dx));
+        _mm_store_ps(force[1], _mm_mul_ps(scale, dy));
+        _mm_store_ps(force[2], _mm_mul_ps(scale, dz));
+        for (unsigned lane = 0; lane < LANES; ++lane) {
+            // Padding springs connect particle 0 to itself, which may lie outside a batch's range;
+            // they carry no force, so skip them.
+            if (s + lane >= num_springs_)
+                break;
+            const auto a = i1[lane] - base, b = i2[lane] - base;
+            fx[a] += force[0][lane];
+            fy[a] += force[1][lane];
+            fz[a] += force[2][lane];
+            fx[b] -= force[0][lane];
+            fy[b] -= force[1][lane];
+            fz[b] -= force[2][lane];
+        }
+    }
+}
+
+void SpringForces::gatherBatches(size_t first, size_t end) {
+    for (auto i = first; i < end; ++i)
+        fx_[i] = fy_[i] = fz_[i] = 0.0f;
+    for (size_t b = 0; b < batch_first_.size(); ++b) {
+        const auto lo = std::max(first, size_t(batch_first_[b]));
+        const auto hi = std::min(end, size_t(batch_end_[b]));
+        for (auto i = lo; i < hi; ++i) {
+            const auto j = batch_offset_[b] + (i - batch_first_[b]);
+            fx_[i] += batch_fx_[j];
+            fy_[i] += batch_fy_[j];
+            fz_[i] += batch_fz_[j];
+        }
+    }
+}
+
+void SpringForces::writeDerivative(size_t first, size_t end, float mass, float drag_k, const Vec3f &acceleration, State &f) {
+    // a = F_spring / m - (drag_k / m) v + acceleration, computed in place of the forces.
+    const __m128 inv_mass = _mm_set1_ps(1.0f / mass);
+    const __m128 damping = _mm_set1_ps(drag_k / mass);
+    const __m128 ax = _mm_set1_ps(acceleration.x), ay = _mm_set1_ps(acceleration.y), az = _mm_set1_ps(acceleration.z);
+    float *fx = fx_.data(), *fy = fy_.data(), *fz = fz_.data();
+    for (auto i = first; i < end; i += LANES) {
+        _mm_storeu_ps(fx + i, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(fx + i), inv_mass), _mm_mul_ps(damping, _mm_loadu_ps(&vx_[i]))), ax));
+        _mm_storeu_ps(fy + i, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(fy + i), inv_mass), _mm_mul_ps(damping, _mm_loadu_ps(&vy_[i]))), ay));
+        _mm_storeu_ps(fz + i, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(fz + i), inv_mass), _mm_mul_ps(damping, _mm_loadu_ps(&vz_[i]))), az));
+    }
+
+    for (auto i = first; i < std::min(end, size_t(num_particles_)); ++i) {
+        f[2 * i] = Vec3f(vx_[i], vy_[i], vz_[i]);
+        f[2 * i + 1] = Vec3f(fx[i], fy[i], fz[i]);
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "particle_systems.hpp"
+
+#include "base/MulticoreLauncher.hpp"
+
+#include <vector>
+
+// Evaluates the derivative of a mass-spring system whose state is stored the usual way,
+// as interleaved (position, velocity) pairs of particles of equal mass.
+//
+// The springs are copied once into a structure-of-arrays layout, sorted by their endpoints
+// so that consecutive springs touch nearby particles. Every call deinterleaves the state
+// into separate x/y/z arrays of positions and velocities, evaluates the springs four at a
+// time with SSE, and accumulates the spring forces into per-particle arrays before writing
+// the derivative. All of these buffers persist between calls, so after the first call on a
+// given system no memory is allocated.
+//
+// The parallel evaluation splits the springs into batches of consecutive springs. Each batch
+// accumulates into a buffer of its own that covers just the particles its springs touch, and
+// a parallel pass over the particles sums these buffers while it writes the derivative, so no
+// two threads ever write the same memory.
+class SpringForces {
+public:
+    // Springs are evaluated in groups of this many.
+    static const unsigned LANES = 4u;
+    // Work per task of the parallel evaluation, multiples of LANES.
+    static const size_t PARTICLE_GRAIN = 1024u;
+    static const size_t SPRING_GRAIN = 4096u;
+
+    void setSprings(const std::vector<Spring> &springs, unsigned num_particles);
+    unsigned numParticles() const { return num_particles_; }
+    size_t numSprings() const { return num_springs_; }
+
+    // Writes into f the derivative of "state" under the springs, linear drag with
+    // coefficient drag_k, and a constant acceleration (e.g. gravity and wind) acting on all
+    // particles of the given mass. f is resized to the size of the state if necessary.
+    // With parallel set, the work is spread over the MulticoreLauncher threads.
+    void evalF(const State &state, float mass, float drag_k, const FW::Vec3f &acceleration, State &f, bool parallel = false);
+    // As evalF, with the drag and the constant acceleration but without the springs.
+    void evalFWithoutSprings(const State &state, float mass, float drag_k, const FW::Vec3f &acceleration, State &f, bool parallel = false);
+
+private:
+    void loadState(const State &state, size_t first, size_t end);
+    // Adds the forces of springs [first, end) into fx/fy/fz, indexed by particle - base.
+    void accumulateSprings(size_t first, size_t end, unsigned base, float *fx, float *fy, float *fz) const;
+    // Sums the batch buffers into the force arrays for particles [first, end).
+    void gatherBatches(size_t first, size_t end);
+    void writeDerivative(size_t first, size_t end, float mass, float drag_k, const FW::Vec3f &acceleration, State &f);
+
+    unsigned num_particles_ = 0;
+    size_t num_springs_ = 0;
+
+    // Springs sorted by (i1, i2) with i1 < i2, padded to a multiple of LANES with springs of zero stiffness.
+    std::vector<unsigned> spring_i1_, spring_i2_;
+    std::vector<float> spring_k_, spring_rlen_;
+
+    // Per-particle scratch, padded to a multiple of LANES.
+    std::vector<float> px_, py_, pz_;
+    std::vector<float> vx_, vy_, vz_;
+    std::vector<float> fx_, fy_, fz_;
+
+    // Batch b of the parallel evaluation holds springs [batch_springs_[b], batch_springs_[b + 1]),
+    // which touch particles [batch_first_[b], batch_end_[b]), and accumulates into the batch
+    // buffers from batch_offset_[b] on.
+    std::vector<size_t> batch_springs_;
+    std::vector<unsigned> batch_first_, batch_end_;
+    std::vector<size_t> batch_offset_;
+    std::vector<float> batch_fx_, batch_fy_, batch_fz_;
+
+    FW::MulticoreLauncher launcher_;
+};
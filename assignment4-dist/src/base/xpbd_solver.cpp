@@ -0,0 +1,114 @@
+#include "xpbd_solver.hpp"
+#include "parallel_for.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+using namespace FW;
+
+void XpbdSolver::colorSprings(const vector<Spring> &springs, unsigned num_particles) {
+    // Each spring takes the lowest color that no earlier spring of either endpoint has, and a
+    // counting sort then groups the springs by color. A particle with d springs needs at most
+    // 2 d - 1 colors, so the 64 colors are plenty for a grid of springs.
+    const auto num_springs = springs.size();
+    particle_colors_.assign(num_particles, 0ull);
+    color_of_.resize(num_springs);
+    auto num_colors = 0u;
+    for (size_t s = 0; s < num_springs; ++s) {
+        const auto &spring = springs[s];
+        assert(spring.i1 < num_particles && spring.i2 < num_particles && "spring endpoint out of range");
+        const auto used = particle_colors_[spring.i1] | particle_colors_[spring.i2];
+        auto color = 0u;
+        while (color < unsigned(MAX_COLORS) && (used >> color & 1ull))
+            ++color;
+        assert(color < unsigned(MAX_COLORS) && "too many springs on a particle to color");
+        particle_colors_[spring.i1] |= 1ull << color;
+        particle_colors_[spring.i2] |= 1ull << color;
+        color_of_[s] = color;
+        num_colors = FW::max(num_colors, color + 1);
+    }
+
+    color_start_.assign(num_colors + 1, 0u);
+    for (auto color : color_of_)
+        ++color_start_[color + 1];
+    for (size_t c = 1; c < color_start_.size(); ++c)
+        color_start_[c] += color_start_[c - 1];
+    springs_.resize(num_springs);
+    for (size_t s = 0; s < num_springs; ++s)
+        springs_[color_start_[color_of_[s]]++] = springs[s];
+    // The placement moved every start to the end of its color.
+    for (auto c = num_colors; c > 0; --c)
+        color_start_[c] = color_start_[c - 1];
+    color_start_[0] = 0;
+}
+
+template <class Body> void XpbdSolver::forEachColor(bool parallel, const Body &body) {
+    for (size_t c = 0; c + 1 < color_start_.size(); ++c) {
+        const auto first = color_start_[c], end = color_start_[c + 1];
+        if (parallel)
+            parallelFor(launcher_, end - first, PARALLEL_GRAIN, [&](size_t b, size_t e) { body(first + b, first + e); });
+        else
+            body(first, end);
+    }
+}
+
+void XpbdSolver::projectSprings(State &state, float h, size_t first, size_t end) {
+    for (auto s = first; s < end; ++s) {
+        const auto &spring = springs_[s];
+        const auto w1 = inverse_mass_[spring.i1], w2 = inverse_mass_[spring.i2];
+        auto &p1 = state[2 * spring.i1];
+        auto &p2 = state[2 * spring.i2];
+        const auto d = p1 - p2;
+        const auto len = d.length();
+        if (len <= 0.0f || w1 + w2 <= 0.0f)
+            continue;
+        // Constraint C = len - rlen with gradient d / len at p1, and compliance 1 / (k h^2).
+        const auto alpha = 1.0f / (spring.k * h * h);
+        const auto delta_lambda = (spring.rlen - len - alpha * lambda_[s]) / (w1 + w2 + alpha);
+        lambda_[s] += delta_lambda;
+        const auto correction = (delta_lambda / len) * d;
+        p1 += w1 * correction;
+        p2 -= w2 * correction;
+    }
+}
+
+void XpbdSolver::step(ParticleSystem &ps, const MassSpring &system, float step, State &f, State &next) {
+    assert(substeps > 0 && iterations > 0 && "XPBD needs at least one sub-step and iteration");
+    const auto n = unsigned(ps.state().size() / 2);
+    if (system.springs != colored_springs_ || system.springs->size() != colored_count_ || n != colored_particles_ ||
+        system.topology != colored_topology_) {
+        colorSprings(*system.springs, n);
+        colored_springs_ = system.springs;
+        colored_count_ = system.springs->size();
+        colored_particles_ = n;
+        colored_topology_ = system.topology;
+        lambda_.resize(springs_.size());
+    }
+    inverse_mass_.assign(n, 1.0f / system.mass);
+    for (unsigned k = 0; k < system.num_fixed; ++k)
+        inverse_mass_[system.fixed[k]] = 0.0f;
+
+    const auto parallel = ps.getParallel();
+    const auto h = step / float(substeps);
+    for (int sub = 0; sub < substeps; ++sub) {
+        const auto &x0 = ps.state();
+        ps.evalFWithoutSprings(x0, f);
+
+        // Symplectic Euler under the other forces gives the predicted positions.
+        next.resize(x0.size());
+        for (unsigned i = 0; i < n; ++i) {
+            const auto v = inverse_mass_[i] > 0.0f ? x0[2 * i + 1] + h * f[2 * i + 1] : Vec3f(0.0f);
+            next[2 * i] = x0[2 * i] + h * v;
+            next[2 * i + 1] = v;
+        }
+
+        fill(lambda_.begin(), lambda_.end(), 0.0f);
+        for (int it = 0; it < iterations; ++it)
+            forEachColor(parallel, [&](size_t first, size_t end) { projectSprings(next, h, first, end); });
+
+        for (unsigned i = 0; i < n; ++i)
+            next[2 * i + 1] = (next[2 * i] - x0[2 * i]) / h;
+        ps.swap_state(next);
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "particle_systems.hpp"
+
+#include "base/MulticoreLauncher.hpp"
+
+#include <vector>
+
+// Steps a MassSpring system with extended position-based dynamics (XPBD). The springs become
+// distance constraints with a compliance of 1 / k. Every sub-step first moves the particles
+// under the other forces, then projects the positions onto the constraints for a number of
+// Gauss-Seidel iterations, and takes the distance moved over the sub-step as the new velocity.
+// A projection can at most bring a spring back to its rest length, so the springs stay stable
+// at any step size; too few iterations make the cloth stretchier instead of exploding it.
+//
+// The forces other than the springs (gravity, drag, wind, collisions) come from
+// evalFWithoutSprings and are integrated explicitly. They limit the step size only if they are
+// stiff themselves, as the collision penalties are.
+//
+// The springs are greedily colored so that no two springs of one color share a particle. The
+// springs of a color can then be projected in any order, on multiple threads, with the same
+// result. The coloring is kept until the system reports a different spring list or topology.
+class XpbdSolver {
+public:
+    // Springs handled by one task of the parallel projection.
+    static const size_t PARALLEL_GRAIN = 1024u;
+    // The coloring keeps the colors of the springs of a particle in a 64-bit mask.
+    static const int MAX_COLORS = 64;
+
+    // Takes one step of the given length in sub-steps steps. f and next are scratch states.
+    void step(ParticleSystem &ps, const MassSpring &system, float step, State &f, State &next);
+    // Number of colors in the last coloring.
+    int getColors() const { return int(color_start_.size()) - 1; }
+
+    int substeps = 1;
+    int iterations = 10;
+
+private:
+    void colorSprings(const std::vector<Spring> &springs, unsigned num_particles);
+    // Runs body(first, end) over the springs of each color in turn.
+    template <class Body> void forEachColor(bool parallel, const Body &body);
+    // Projects the positions in state onto the springs [first, end) for sub-steps of length h.
+    void projectSprings(State &state, float h, size_t first, size_t end);
+
+    // Springs sorted by color: color c holds springs_[color_start_[c]] up to
+    // springs_[color_start_[c + 1]].
+    std::vector<Spring> springs_;
+    std::vector<unsigned> color_start_, color_of_;
+    std::vector<unsigned long long> particle_colors_;
+    // What the current coloring was computed for.
+    const std::vector<Spring> *colored_springs_ = nullptr;
+    size_t colored_count_ = 0;
+    unsigned colored_particles_ = 0, colored_topology_ = 0;
+
+    std::vector<float> inverse_mass_; // 0 for fixed particles
+    std::vector<float> lambda_;       // accumulated multipliers of the springs_
+
+    FW::MulticoreLauncher launcher_;
+};
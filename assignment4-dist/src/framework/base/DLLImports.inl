@@ -442,6 +442,7 @@ FW_DLL_DECLARE_VOID(void,       APIENTRY,   glGetRenderbufferParameterivEXT,
 FW_DLL_DECLARE_VOID(void,		APIENTRY,	glBindBufferBase,						(GLenum target, GLuint index, GLuint buffer), (target, index, buffer))
 FW_DLL_DECLARE_VOID(void,		APIENTRY,	glDispatchCompute,						(GLuint num_groups_x, GLuint num_groups_y, GLuint num_groups_z), (num_groups_x, num_groups_y, num_groups_z))
 FW_DLL_DECLARE_VOID(void,		APIENTRY,	glCopyBufferSubData,					(GLenum readtarget, GLenum writetarget, GLintptr readoffset, GLintptr writeoffset, GLsizeiptr size), (readtarget, writetarget, readoffset, writeoffset, size))
+FW_DLL_DECLARE_VOID(void,		APIENTRY,	glMemoryBarrier,						(GLbitfield barriers), (barriers))
 //------------------------------------------------------------------------
 // GL_NV_path_rendering
 //------------------------------------------------------------------------